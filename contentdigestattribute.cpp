@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2014 Klaralvdalens Datakonsult AB <info@kdab.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "contentdigestattribute.h"
+
+ContentDigestAttribute::ContentDigestAttribute(const QByteArray &digest)
+:   mDigest(digest)
+{
+}
+
+QByteArray ContentDigestAttribute::digest() const
+{
+    return mDigest;
+}
+
+void ContentDigestAttribute::setDigest(const QByteArray &digest)
+{
+    mDigest = digest;
+}
+
+QByteArray ContentDigestAttribute::itemDigest(const Akonadi::Item &item)
+{
+    if (!item.hasAttribute<ContentDigestAttribute>()) {
+        return QByteArray();
+    }
+    return item.attribute<ContentDigestAttribute>()->digest();
+}
+
+QByteArray ContentDigestAttribute::type() const
+{
+    return "LDAPCONTENTDIGEST";
+}
+
+Akonadi::Attribute *ContentDigestAttribute::clone() const
+{
+    return new ContentDigestAttribute(mDigest);
+}
+
+QByteArray ContentDigestAttribute::serialized() const
+{
+    return mDigest;
+}
+
+void ContentDigestAttribute::deserialize(const QByteArray &data)
+{
+    mDigest = data;
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2014 Klaralvdalens Datakonsult AB <info@kdab.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CONTENTDIGESTATTRIBUTE_H
+#define CONTENTDIGESTATTRIBUTE_H
+
+#include <akonadi/attribute.h>
+#include <akonadi/item.h>
+
+/**
+ * Digest of the mapped attribute values a person was stored with, see LDAPMapper::getContentDigest().
+ *
+ * A changed modifyTimestamp with an unchanged digest means only attributes we don't map were
+ * modified, so the item is left alone.
+ */
+class ContentDigestAttribute : public Akonadi::Attribute
+{
+public:
+    explicit ContentDigestAttribute(const QByteArray &digest = QByteArray());
+
+    QByteArray digest() const;
+    void setDigest(const QByteArray &digest);
+
+    /**
+     * The digest stored with @p item, empty if there is none
+     */
+    static QByteArray itemDigest(const Akonadi::Item &item);
+
+    virtual QByteArray type() const;
+    virtual Attribute *clone() const;
+    virtual QByteArray serialized() const;
+    virtual void deserialize(const QByteArray &data);
+
+private:
+    QByteArray mDigest;
+};
+
+#endif // CONTENTDIGESTATTRIBUTE_H
@@ -0,0 +1,486 @@
+/*
+ * Copyright (C) 2014 Klaralvdalens Datakonsult AB <info@kdab.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "contentsyncjob.h"
+#include "contentdigestattribute.h"
+
+#include "ldapmapper.h"
+
+#include <KABC/Addressee>
+#include <KLDAP/LdapConnection>
+#include <KLDAP/LdapObject>
+#include <KLDAP/LdapOperation>
+
+#include <kdebug.h>
+
+#include <QSocketNotifier>
+#include <QVector>
+
+#include <ldap.h>
+
+static QByteArray toByteArray(const struct berval &value)
+{
+    return QByteArray(value.bv_val, value.bv_len);
+}
+
+ContentSyncJob::ContentSyncJob(Mode mode, const QString &searchBase, KLDAP::LdapConnection &connection, QObject *parent)
+:   KJob(parent),
+    mMode(mode),
+    mSearchbase(searchBase),
+    mConnection(connection),
+    mHandle(0),
+    mMsgId(-1),
+    mNotifier(0),
+    mChanged(false),
+    mRefreshing(true),
+    mFullPayload(true)
+{
+    Q_ASSERT(connection.handle());
+    setCapabilities(KJob::Killable);
+
+    // autostart like an Akonadi::Job
+    QMetaObject::invokeMethod(this, "start", Qt::QueuedConnection);
+}
+
+ContentSyncJob::~ContentSyncJob()
+{
+    if (mMsgId != -1) {
+        ldap_abandon_ext(static_cast<LDAP*>(mHandle), mMsgId, 0, 0);
+    }
+}
+
+void ContentSyncJob::setCookie(const QByteArray &cookie)
+{
+    mCookie = cookie;
+}
+
+void ContentSyncJob::setFullPayload(bool full)
+{
+    mFullPayload = full;
+}
+
+QByteArray ContentSyncJob::cookie() const
+{
+    return mCookie;
+}
+
+UpdateData ContentSyncJob::takeUpdates()
+{
+    const UpdateData updates = mUpdates;
+    mUpdates.clear();
+    return updates;
+}
+
+void ContentSyncJob::start()
+{
+    mHandle = mConnection.handle();
+    LDAP *ld = static_cast<LDAP*>(mHandle);
+
+    // the connection is ours alone, so the bind cannot abandon operations of other jobs
+    KLDAP::LdapOperation op(mConnection);
+    if (op.bind_s() != 0) {
+        kWarning() << "bind failed" << mConnection.ldapErrorString();
+        finish(SearchFailed, mConnection.ldapErrorString());
+        return;
+    }
+
+    // syncRequestValue ::= SEQUENCE { mode ENUMERATED, cookie syncCookie OPTIONAL, reloadHint BOOLEAN DEFAULT FALSE }
+    BerElement *ber = ber_alloc_t(LBER_USE_DER);
+    ber_printf(ber, "{e", mMode == RefreshOnly ? LDAP_SYNC_REFRESH_ONLY : LDAP_SYNC_REFRESH_AND_PERSIST);
+    if (!mCookie.isEmpty()) {
+        struct berval cookie;
+        cookie.bv_val = mCookie.data();
+        cookie.bv_len = mCookie.size();
+        ber_printf(ber, "O", &cookie);
+    }
+    ber_printf(ber, "N}");
+
+    struct berval value;
+    LDAPControl *control = 0;
+    if (ber_flatten2(ber, &value, 0) == -1 || ldap_control_create(LDAP_CONTROL_SYNC, 1, &value, 1, &control) != LDAP_SUCCESS) {
+        ber_free(ber, 1);
+        kWarning() << "failed to create the sync request control";
+        finish(KJob::UserDefinedError);
+        return;
+    }
+    ber_free(ber, 1);
+
+    QList<QByteArray> attributes;
+    // the members of groups are only needed for their digest
+    QStringList requestedAttributes = mFullPayload ? LDAPMapper::requestedFullPayloadAttributes()
+                                                   : LDAPMapper::requestedLookupPayloadAttributes();
+    requestedAttributes << QLatin1String("objectClass") << QLatin1String("uniqueMember");
+    foreach (const QString &attribute, requestedAttributes) {
+        attributes << attribute.toUtf8();
+    }
+    QVector<char*> attrs;
+    for (int i = 0; i < attributes.count(); ++i) {
+        attrs << attributes[i].data();
+    }
+    attrs << 0;
+
+    const QByteArray base = mSearchbase.toUtf8();
+    const QByteArray filter = "(|(objectClass=inetorgperson)(objectClass=groupofuniquenames)(objectClass=kolabgroupofuniquenames))";
+    LDAPControl *controls[] = { control, 0 };
+
+    // the persistent search runs as long as the job, and the refresh of a large directory
+    // may take longer than the time limit of the connection
+    int timeLimit = LDAP_NO_LIMIT;
+    ldap_get_option(ld, LDAP_OPT_TIMELIMIT, &timeLimit);
+    int noLimit = LDAP_NO_LIMIT;
+    ldap_set_option(ld, LDAP_OPT_TIMELIMIT, &noLimit);
+    const int ret = ldap_search_ext(ld, base.constData(), LDAP_SCOPE_SUBTREE, filter.constData(), attrs.data(), 0, controls, 0, 0, 0, &mMsgId);
+    ldap_set_option(ld, LDAP_OPT_TIMELIMIT, &timeLimit);
+    ldap_control_free(control);
+    if (ret != LDAP_SUCCESS) {
+        kWarning() << "search failed" << ldap_err2string(ret);
+        mMsgId = -1;
+        finish(SearchFailed, QString::fromUtf8(ldap_err2string(ret)));
+        return;
+    }
+
+    int fd = -1;
+    ldap_get_option(ld, LDAP_OPT_DESC, &fd);
+    mNotifier = new QSocketNotifier(fd, QSocketNotifier::Read, this);
+    connect(mNotifier, SIGNAL(activated(int)), this, SLOT(readMessages()));
+
+    readMessages();
+}
+
+bool ContentSyncJob::doKill()
+{
+    if (mNotifier) {
+        mNotifier->setEnabled(false);
+    }
+    if (mMsgId != -1) {
+        ldap_abandon_ext(static_cast<LDAP*>(mHandle), mMsgId, 0, 0);
+        mMsgId = -1;
+    }
+    return true;
+}
+
+void ContentSyncJob::readMessages()
+{
+    LDAP *ld = static_cast<LDAP*>(mHandle);
+    struct timeval timeout = { 0, 0 };
+    LDAPMessage *message = 0;
+
+    // libldap might have read more than one message from the socket, so take everything available
+    int ret;
+    while ((ret = ldap_result(ld, mMsgId, LDAP_MSG_ONE, &timeout, &message)) > 0) {
+        const bool searchRunning = processMessage(message);
+        ldap_msgfree(message);
+        if (!searchRunning) {
+            return;
+        }
+    }
+
+    if (ret == -1) {
+        int errorCode = LDAP_OTHER;
+        ldap_get_option(ld, LDAP_OPT_RESULT_CODE, &errorCode);
+        kWarning() << "retrieval failed" << ldap_err2string(errorCode);
+        finish(SearchFailed, QString::fromUtf8(ldap_err2string(errorCode)));
+        return;
+    }
+
+    if (mChanged) {
+        mChanged = false;
+        emit updatesAvailable();
+    }
+}
+
+bool ContentSyncJob::processMessage(void *message)
+{
+    LDAPMessage *msg = static_cast<LDAPMessage*>(message);
+    switch (ldap_msgtype(msg)) {
+        case LDAP_RES_SEARCH_ENTRY:
+            processEntry(msg);
+            break;
+        case LDAP_RES_INTERMEDIATE:
+            processIntermediate(msg);
+            break;
+        case LDAP_RES_SEARCH_RESULT:
+            processResult(msg);
+            return false;
+        default:
+            kDebug() << "ignoring message of type" << ldap_msgtype(msg);
+    }
+    return true;
+}
+
+void ContentSyncJob::processEntry(void *message)
+{
+    LDAP *ld = static_cast<LDAP*>(mHandle);
+    LDAPMessage *msg = static_cast<LDAPMessage*>(message);
+
+    LDAPControl **controls = 0;
+    ldap_get_entry_controls(ld, msg, &controls);
+    LDAPControl *stateControl = ldap_control_find(LDAP_CONTROL_SYNC_STATE, controls, 0);
+    if (!stateControl) {
+        kWarning() << "entry without sync state";
+        ldap_controls_free(controls);
+        return;
+    }
+
+    // syncStateValue ::= SEQUENCE { state ENUMERATED, entryUUID syncUUID, cookie syncCookie OPTIONAL }
+    BerElement *ber = ber_init(&stateControl->ldctl_value);
+    ber_int_t state = -1;
+    struct berval uuid = { 0, 0 };
+    struct berval cookie = { 0, 0 };
+    ber_len_t len;
+    if (ber_scanf(ber, "{em", &state, &uuid) != LBER_ERROR && ber_peek_tag(ber, &len) == LDAP_TAG_SYNC_COOKIE) {
+        ber_scanf(ber, "m", &cookie);
+    }
+    const QString id = LDAPMapper::getStableIdentifier(toByteArray(uuid));
+    const QByteArray newCookie = toByteArray(cookie);
+    ber_free(ber, 1);
+    ldap_controls_free(controls);
+
+    switch (state) {
+        case LDAP_SYNC_PRESENT:
+            if (mRefreshing) {
+                mPresentIds.insert(id);
+            }
+            break;
+
+        case LDAP_SYNC_ADD:
+        case LDAP_SYNC_MODIFY: {
+            KLDAP::LdapObject obj;
+            char *dn = ldap_get_dn(ld, msg);
+            obj.setDn(KLDAP::LdapDN(QString::fromUtf8(dn)));
+            ldap_memfree(dn);
+
+            BerElement *entry = 0;
+            for (char *name = ldap_first_attribute(ld, msg, &entry); name; name = ldap_next_attribute(ld, msg, entry)) {
+                const QString attributeName = QString::fromUtf8(name);
+                struct berval **values = ldap_get_values_len(ld, msg, name);
+                for (int i = 0; values && values[i]; ++i) {
+                    obj.addValue(attributeName, toByteArray(*values[i]));
+                }
+                ldap_value_free_len(values);
+                ldap_memfree(name);
+            }
+            ber_free(entry, 0);
+
+            kDebug() << "got update" << obj.dn().toString();
+            addEntry(obj);
+            if (mRefreshing) {
+                mPresentIds.insert(id);
+            }
+            break;
+        }
+
+        case LDAP_SYNC_DELETE:
+            kDebug() << "got deletion" << id;
+            addDeletion(id);
+            break;
+
+        default:
+            kWarning() << "unknown sync state" << state;
+    }
+
+    if (!newCookie.isEmpty()) {
+        mCookie = newCookie;
+    }
+}
+
+void ContentSyncJob::processIntermediate(void *message)
+{
+    LDAP *ld = static_cast<LDAP*>(mHandle);
+    LDAPMessage *msg = static_cast<LDAPMessage*>(message);
+
+    char *oid = 0;
+    struct berval *data = 0;
+    if (ldap_parse_intermediate(ld, msg, &oid, &data, 0, 0) != LDAP_SUCCESS) {
+        kWarning() << "failed to parse intermediate response";
+        return;
+    }
+
+    if (oid && data && qstrcmp(oid, LDAP_SYNC_INFO) == 0) {
+        BerElement *ber = ber_init(data);
+        struct berval cookie = { 0, 0 };
+        ber_len_t len;
+        ber_tag_t tag = ber_peek_tag(ber, &len);
+        switch (tag) {
+            case LDAP_TAG_SYNC_NEW_COOKIE:
+                ber_scanf(ber, "tm", &tag, &cookie);
+                break;
+
+            case LDAP_TAG_SYNC_REFRESH_DELETE:
+            case LDAP_TAG_SYNC_REFRESH_PRESENT: {
+                ber_int_t refreshDone = 1;
+                ber_scanf(ber, "{");
+                if (ber_peek_tag(ber, &len) == LDAP_TAG_SYNC_COOKIE) {
+                    ber_scanf(ber, "m", &cookie);
+                }
+                if (ber_peek_tag(ber, &len) == LDAP_TAG_REFRESHDONE) {
+                    ber_scanf(ber, "b", &refreshDone);
+                }
+                if (refreshDone && mRefreshing) {
+                    endRefresh(tag == LDAP_TAG_SYNC_REFRESH_DELETE);
+                }
+                break;
+            }
+
+            case LDAP_TAG_SYNC_ID_SET: {
+                ber_int_t refreshDeletes = 0;
+                BerVarray uuids = 0;
+                ber_scanf(ber, "{");
+                if (ber_peek_tag(ber, &len) == LDAP_TAG_SYNC_COOKIE) {
+                    ber_scanf(ber, "m", &cookie);
+                }
+                if (ber_peek_tag(ber, &len) == LDAP_TAG_REFRESHDELETES) {
+                    ber_scanf(ber, "b", &refreshDeletes);
+                }
+                ber_scanf(ber, "[W]", &uuids);
+                for (int i = 0; uuids && uuids[i].bv_val; ++i) {
+                    const QString id = LDAPMapper::getStableIdentifier(toByteArray(uuids[i]));
+                    if (refreshDeletes) {
+                        addDeletion(id);
+                    } else if (mRefreshing) {
+                        mPresentIds.insert(id);
+                    }
+                }
+                ber_bvarray_free(uuids);
+                break;
+            }
+
+            default:
+                kWarning() << "unknown sync info message" << tag;
+        }
+
+        if (cookie.bv_len > 0) {
+            mCookie = toByteArray(cookie);
+        }
+        ber_free(ber, 1);
+    }
+
+    ldap_memfree(oid);
+    ber_bvfree(data);
+}
+
+void ContentSyncJob::processResult(void *message)
+{
+    LDAP *ld = static_cast<LDAP*>(mHandle);
+    LDAPMessage *msg = static_cast<LDAPMessage*>(message);
+    mMsgId = -1;
+
+    int errorCode = LDAP_OTHER;
+    char *errorMessage = 0;
+    LDAPControl **controls = 0;
+    if (ldap_parse_result(ld, msg, &errorCode, 0, &errorMessage, 0, &controls, 0) != LDAP_SUCCESS) {
+        kWarning() << "failed to parse search result";
+        finish(KJob::UserDefinedError);
+        return;
+    }
+    const QString errorText = QString::fromUtf8(errorMessage);
+    ldap_memfree(errorMessage);
+
+    if (errorCode == LDAP_SYNC_REFRESH_REQUIRED) {
+        kWarning() << "server requires a full refresh";
+        ldap_controls_free(controls);
+        finish(RefreshRequired, errorText);
+        return;
+    }
+    if (errorCode != LDAP_SUCCESS) {
+        kWarning() << ldap_err2string(errorCode) << errorText;
+        ldap_controls_free(controls);
+        finish(SearchFailed, QString::fromUtf8(ldap_err2string(errorCode)));
+        return;
+    }
+
+    LDAPControl *doneControl = ldap_control_find(LDAP_CONTROL_SYNC_DONE, controls, 0);
+    if (doneControl) {
+        // syncDoneValue ::= SEQUENCE { cookie syncCookie OPTIONAL, refreshDeletes BOOLEAN DEFAULT FALSE }
+        BerElement *ber = ber_init(&doneControl->ldctl_value);
+        ber_int_t refreshDeletes = 0;
+        struct berval cookie = { 0, 0 };
+        ber_len_t len;
+        ber_scanf(ber, "{");
+        if (ber_peek_tag(ber, &len) == LDAP_TAG_SYNC_COOKIE) {
+            ber_scanf(ber, "m", &cookie);
+        }
+        if (ber_peek_tag(ber, &len) == LDAP_TAG_REFRESHDELETES) {
+            ber_scanf(ber, "b", &refreshDeletes);
+        }
+        if (cookie.bv_len > 0) {
+            mCookie = toByteArray(cookie);
+        }
+        ber_free(ber, 1);
+
+        if (mRefreshing) {
+            endRefresh(refreshDeletes);
+        }
+    }
+    ldap_controls_free(controls);
+
+    finish(0);
+}
+
+void ContentSyncJob::addEntry(const KLDAP::LdapObject &obj)
+{
+    qint64 timestamp;
+    const QString revision = LDAPMapper::getTimestamp(obj, &timestamp);
+    mUpdates.timestamp = qMax(mUpdates.timestamp, timestamp);
+
+    if (LDAPMapper::isGroup(obj)) {
+        mUpdates.groups << GroupUpdate(obj);
+    } else {
+        Akonadi::Item item;
+        item.setRemoteId(LDAPMapper::getStableIdentifier(obj));
+        item.setPayload(LDAPMapper::getAddressee(obj));
+        item.setMimeType(KABC::Addressee::mimeType());
+        item.setRemoteRevision(revision);
+        item.addAttribute(new ContentDigestAttribute(LDAPMapper::getContentDigest(obj)));
+        mUpdates.items << item;
+    }
+    mChanged = true;
+}
+
+void ContentSyncJob::addDeletion(const QString &id)
+{
+    mUpdates.deletedIds << id;
+    mPresentIds.remove(id);
+    mChanged = true;
+}
+
+void ContentSyncJob::endRefresh(bool refreshDeletes)
+{
+    kDebug() << "refresh done" << (refreshDeletes ? "(delete phase)" : "(present phase)");
+    mRefreshing = false;
+
+    // in a present phase everything the server did not mention has been deleted.
+    // Don't take an empty set as "everything is gone" though
+    if (!refreshDeletes && !mPresentIds.isEmpty()) {
+        mUpdates.presentIds = mPresentIds;
+        mUpdates.hasPresentIds = true;
+        mChanged = true;
+    }
+    mPresentIds.clear();
+}
+
+void ContentSyncJob::finish(int error, const QString &errorText)
+{
+    if (mNotifier) {
+        mNotifier->setEnabled(false);
+    }
+    if (error) {
+        setError(error);
+        setErrorText(errorText);
+    }
+    emitResult();
+}
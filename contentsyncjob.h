@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2014 Klaralvdalens Datakonsult AB <info@kdab.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CONTENTSYNCJOB_H
+#define CONTENTSYNCJOB_H
+
+#include "incrementalupdatedata.h"
+
+#include <kjob.h>
+
+#include <QSet>
+#include <QStringList>
+
+class QSocketNotifier;
+
+namespace KLDAP {
+    class LdapConnection;
+    class LdapObject;
+}
+
+/**
+ * Runs a content synchronization search (RFC 4533, "syncrepl") for persons and groups.
+ *
+ * In RefreshOnly mode the job finishes once the server has sent all changes since the cookie.
+ * In RefreshAndPersist mode the search stays open and updatesAvailable() is emitted whenever
+ * further changes arrived, until the job is killed or the server ends the search.
+ *
+ * KLDAP does not give access to the controls of search entries, so this uses libldap directly
+ * on the connection's handle.
+ */
+class ContentSyncJob : public KJob
+{
+    Q_OBJECT
+public:
+    enum Mode {
+        RefreshOnly,
+        RefreshAndPersist
+    };
+
+    enum Error {
+        RefreshRequired = KJob::UserDefinedError + 1,
+        // binding, the search or reading its results failed, e.g. because the replica is not available
+        SearchFailed
+    };
+
+    ContentSyncJob(Mode mode, const QString &searchBase, KLDAP::LdapConnection &connection, QObject *parent = 0);
+    ~ContentSyncJob();
+
+    void setCookie(const QByteArray &cookie);
+
+    /**
+     * Request the full payload of changed persons, instead of only the lookup attributes
+     */
+    void setFullPayload(bool full);
+
+    /**
+     * The cookie matching the changes returned by takeUpdates()
+     */
+    QByteArray cookie() const;
+
+    UpdateData takeUpdates();
+
+Q_SIGNALS:
+    void updatesAvailable();
+
+public Q_SLOTS:
+    virtual void start();
+
+protected:
+    virtual bool doKill();
+
+private Q_SLOTS:
+    void readMessages();
+
+private:
+    bool processMessage(void *message);
+    void processEntry(void *message);
+    void processIntermediate(void *message);
+    void processResult(void *message);
+    void addEntry(const KLDAP::LdapObject &obj);
+    void addDeletion(const QString &id);
+    void endRefresh(bool refreshDeletes);
+    void finish(int error, const QString &errorText = QString());
+
+    const Mode mMode;
+    const QString mSearchbase;
+    KLDAP::LdapConnection &mConnection;
+    void *mHandle;
+    int mMsgId;
+    QSocketNotifier *mNotifier;
+
+    QByteArray mCookie;
+    UpdateData mUpdates;
+    bool mChanged;
+
+    // all entries reported during the refresh stage, needed if the server ends it with a present phase
+    bool mRefreshing;
+    bool mFullPayload;
+    QSet<QString> mPresentIds;
+};
+
+#endif // CONTENTSYNCJOB_H
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2014 Klaralvdalens Datakonsult AB <info@kdab.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "groupmembersattribute.h"
+
+#include <QStringList>
+
+GroupMembersAttribute::GroupMembersAttribute(const QHash<QString, QString> &memberIds)
+:   mMemberIds(memberIds)
+{
+}
+
+QHash<QString, QString> GroupMembersAttribute::memberIds() const
+{
+    return mMemberIds;
+}
+
+void GroupMembersAttribute::setMemberIds(const QHash<QString, QString> &memberIds)
+{
+    mMemberIds = memberIds;
+}
+
+QByteArray GroupMembersAttribute::type() const
+{
+    return "LDAPGROUPMEMBERS";
+}
+
+Akonadi::Attribute *GroupMembersAttribute::clone() const
+{
+    return new GroupMembersAttribute(mMemberIds);
+}
+
+QByteArray GroupMembersAttribute::serialized() const
+{
+    // one "id<tab>dn" line per member, the ids contain neither tabs nor newlines
+    QStringList lines;
+    for (QHash<QString, QString>::const_iterator it = mMemberIds.constBegin(); it != mMemberIds.constEnd(); ++it) {
+        lines << it.value() + QLatin1Char('\t') + it.key();
+    }
+    return lines.join(QLatin1String("\n")).toUtf8();
+}
+
+void GroupMembersAttribute::deserialize(const QByteArray &data)
+{
+    mMemberIds.clear();
+    foreach (const QString &line, QString::fromUtf8(data).split(QLatin1Char('\n'), QString::SkipEmptyParts)) {
+        const int separator = line.indexOf(QLatin1Char('\t'));
+        if (separator > 0) {
+            mMemberIds.insert(line.mid(separator + 1), line.left(separator));
+        }
+    }
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2014 Klaralvdalens Datakonsult AB <info@kdab.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GROUPMEMBERSATTRIBUTE_H
+#define GROUPMEMBERSATTRIBUTE_H
+
+#include <akonadi/attribute.h>
+
+#include <QHash>
+#include <QString>
+
+/**
+ * Remote ids of the persons a group collection was last updated with, by their member DN
+ * normalized with PersonCache::normalizedDn(). Unlike the person cache it survives a restart,
+ * so unchanged members can be told apart without asking the server.
+ */
+class GroupMembersAttribute : public Akonadi::Attribute
+{
+public:
+    explicit GroupMembersAttribute(const QHash<QString, QString> &memberIds = QHash<QString, QString>());
+
+    QHash<QString, QString> memberIds() const;
+    void setMemberIds(const QHash<QString, QString> &memberIds);
+
+    virtual QByteArray type() const;
+    virtual Attribute *clone() const;
+    virtual QByteArray serialized() const;
+    virtual void deserialize(const QByteArray &data);
+
+private:
+    QHash<QString, QString> mMemberIds;
+};
+
+#endif // GROUPMEMBERSATTRIBUTE_H
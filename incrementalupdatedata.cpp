@@ -24,7 +24,47 @@
 
 GroupUpdate::GroupUpdate(const KLDAP::LdapObject &obj)
 :   id(LDAPMapper::getStableIdentifier(obj)),
+    dn(obj.dn().toString()),
     name(obj.value(QLatin1String("cn"))),
-    timestamp(LDAPMapper::getTimestamp(obj))
+    timestamp(LDAPMapper::getTimestamp(obj)),
+    membersDigest(LDAPMapper::getMembersDigest(obj))
 {
 }
+
+GroupUpdate::GroupUpdate(const QString &id)
+:   id(id)
+{
+}
+
+UpdateData::UpdateData()
+:   timestamp(-1),
+    hasPresentIds(false)
+{
+}
+
+bool UpdateData::isEmpty() const
+{
+    return items.isEmpty() && groups.isEmpty() && deletedIds.isEmpty() && !hasPresentIds;
+}
+
+void UpdateData::clear()
+{
+    items.clear();
+    groups.clear();
+    deletedIds.clear();
+    timestamp = -1;
+    presentIds.clear();
+    hasPresentIds = false;
+}
+
+void UpdateData::append(const UpdateData &other)
+{
+    items << other.items;
+    groups << other.groups;
+    deletedIds << other.deletedIds;
+    timestamp = qMax(timestamp, other.timestamp);
+    if (other.hasPresentIds) {
+        presentIds = other.presentIds;
+        hasPresentIds = true;
+    }
+}
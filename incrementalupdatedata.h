@@ -19,8 +19,12 @@
 #ifndef INCREMENTALUPDATEDATA_H
 #define INCREMENTALUPDATEDATA_H
 
+#include <akonadi/item.h>
+
 #include <QList>
+#include <QSet>
 #include <QString>
+#include <QStringList>
 
 namespace KLDAP {
     class LdapObject;
@@ -30,11 +34,40 @@ struct GroupUpdate
 {
     GroupUpdate(const KLDAP::LdapObject &obj);
 
+    /**
+     * Only refreshes the members of group @p id, e.g. after a nested group changed
+     */
+    explicit GroupUpdate(const QString &id);
+
     QString id;
+    QString dn;
     QString name;
     QString timestamp;
+    QByteArray membersDigest;
 };
 
 typedef QList<GroupUpdate> GroupUpdateList;
 
+/**
+ * Changes pushed by the server, see ContentSyncJob
+ */
+struct UpdateData
+{
+    UpdateData();
+
+    bool isEmpty() const;
+    void clear();
+    void append(const UpdateData &other);
+
+    Akonadi::Item::List items;
+    GroupUpdateList groups;
+    QStringList deletedIds;
+    // most recent modifyTimestamp, see LDAPMapper::getTimestampValue()
+    qint64 timestamp;
+
+    // only set after a refresh that ended with a present phase: everything not listed is gone
+    QSet<QString> presentIds;
+    bool hasPresentIds;
+};
+
 #endif // INCREMENTALUPDATEDATA_H
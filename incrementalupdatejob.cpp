@@ -18,6 +18,12 @@
 
 #include "incrementalupdatejob.h"
 
+#include "contentdigestattribute.h"
+#include "ldapmapper.h"
+#include "ldapsearchqueue.h"
+#include "membersdigestattribute.h"
+#include "nestedgroupsattribute.h"
+#include "personcache.h"
 #include "retrieveupdatesjob.h"
 #include "updateitemjob.h"
 #include "updategroupjob.h"
@@ -26,20 +32,107 @@
 #include <KABC/ContactGroup>
 
 #include <akonadi/collectioncreatejob.h>
+#include <akonadi/collectiondeletejob.h>
 #include <akonadi/collectionfetchjob.h>
 #include <akonadi/collectionfetchscope.h>
 #include <akonadi/collectionmodifyjob.h>
+#include <akonadi/itemdeletejob.h>
+#include <akonadi/itemfetchjob.h>
+#include <akonadi/itemfetchscope.h>
 
 IncrementalUpdateJob::IncrementalUpdateJob(const QString &resourceId, const QString &searchBase, KLDAP::LdapConnection &connection, QObject *parent)
 :   KJob(parent),
     mResourceId(resourceId),
     mSearchbase(searchBase),
-    mConnection(connection)
+    mConnection(connection),
+    mOverlap(0),
+    mDeletionDetection(RetrieveUpdatesJob::NoDeletionDetection),
+    mLastChangeNumber(0),
+    mMaxConcurrentSearches(LdapSearchQueue::DefaultMaxConcurrentSearches),
+    mRunningJobs(0),
+    mBatchSize(LdapSearchQueue::DefaultBatchSize),
+    mPersonCache(0),
+    mMaxNestingDepth(0),
+    mLinkMembers(false),
+    mMemberOfLookup(false),
+    mPageSize(0),
+    mFullPayload(true),
+    mHasUpdates(false),
+    mItemIndex(&mOwnItemIndex),
+    mPendingIndexFetches(0),
+    mNextTimestamp(-1)
 {
     // autostart like an Akonadi::Job
     QMetaObject::invokeMethod(this, "start", Qt::QueuedConnection);
 }
 
+void IncrementalUpdateJob::setOverlap(int seconds)
+{
+    mOverlap = seconds;
+}
+
+void IncrementalUpdateJob::setMaxConcurrentSearches(int count)
+{
+    mMaxConcurrentSearches = qMax(1, count);
+}
+
+void IncrementalUpdateJob::setBatchSize(int size)
+{
+    mBatchSize = size;
+}
+
+void IncrementalUpdateJob::setPersonCache(PersonCache *personCache)
+{
+    mPersonCache = personCache;
+}
+
+void IncrementalUpdateJob::setItemIndex(ItemIndex *itemIndex)
+{
+    mItemIndex = itemIndex;
+}
+
+void IncrementalUpdateJob::setMaxNestingDepth(int depth)
+{
+    mMaxNestingDepth = depth;
+}
+
+void IncrementalUpdateJob::setLinkMembers(bool link)
+{
+    mLinkMembers = link;
+}
+
+void IncrementalUpdateJob::setMemberOfLookup(bool memberOf)
+{
+    mMemberOfLookup = memberOf;
+}
+
+void IncrementalUpdateJob::setPageSize(int pageSize)
+{
+    mPageSize = pageSize;
+}
+
+void IncrementalUpdateJob::setFullPayload(bool full)
+{
+    mFullPayload = full;
+}
+
+void IncrementalUpdateJob::setUpdates(const UpdateData &updates)
+{
+    mHasUpdates = true;
+    mUpdates = updates;
+}
+
+void IncrementalUpdateJob::setDeletionDetection(RetrieveUpdatesJob::DeletionDetection detection, qint64 lastChangeNumber)
+{
+    mDeletionDetection = detection;
+    mLastChangeNumber = lastChangeNumber;
+}
+
+qint64 IncrementalUpdateJob::lastChangeNumber() const
+{
+    return mLastChangeNumber;
+}
+
 void IncrementalUpdateJob::start()
 {
     kDebug() << "Starting incremental update";
@@ -66,14 +159,31 @@ void IncrementalUpdateJob::localFetchDone(KJob *job)
     mCollections = fetchJob->collections();
     Q_ASSERT(mCollections.count() > 0);
 
-    // determine timestamp of last update
-    // should be the remote revision of the top level collection
     foreach (const Akonadi::Collection &collection, mCollections) {
         if (collection.parentCollection() == Akonadi::Collection::root()) {
-            mInitialTimestamp = collection.remoteRevision();
-            break;
+            mTopLevelCollection = collection;
+        } else {
+            mGroupCollections.insert(collection.remoteId(), collection);
         }
     }
+    Q_ASSERT(mTopLevelCollection.isValid());
+
+    // determine timestamp of last update
+    // should be the remote revision of the top level collection
+    mInitialTimestamp = mTopLevelCollection.remoteRevision();
+
+    if (mHasUpdates) {
+        mChangedItems = mUpdates.items;
+        mUpdatedGroups = mUpdates.groups;
+        mDeletedIds = mUpdates.deletedIds;
+        mNextTimestamp = mUpdates.timestamp;
+
+        kDebug() << "Applying" << mChangedItems.count() << "item updates," << mUpdatedGroups.count() << "group updates and"
+                 << mDeletedIds.count() << "deletions";
+        addParentGroups();
+        processGroups();
+        return;
+    }
 
     if (mInitialTimestamp.isEmpty()) {
         kWarning() << "No timestamp for incremental update available";
@@ -85,6 +195,10 @@ void IncrementalUpdateJob::localFetchDone(KJob *job)
     kDebug() << "Checking for updates since" << mInitialTimestamp;
 
     RetrieveUpdatesJob *updateJob = new RetrieveUpdatesJob(mInitialTimestamp, mSearchbase, mConnection, this);
+    updateJob->setOverlap(mOverlap);
+    updateJob->setDeletionDetection(mDeletionDetection, mLastChangeNumber);
+    updateJob->setPersonCache(mPersonCache);
+    updateJob->setFullPayload(mFullPayload);
     connect(updateJob, SIGNAL(result(KJob*)), this, SLOT(retrieveUpdatesDone(KJob*)));
 }
 
@@ -92,17 +206,20 @@ void IncrementalUpdateJob::retrieveUpdatesDone(KJob *job)
 {
     if (job->error()) {
         kWarning() << job->errorString();
-        setError(KJob::UserDefinedError);
+        setError(SearchFailed);
         emitResult();
         return;
     }
 
     RetrieveUpdatesJob *updateJob = static_cast<RetrieveUpdatesJob*>(job);
-    mUpdatedItems = updateJob->items();
+    mChangedItems = updateJob->items();
     mUpdatedGroups = updateJob->groups();
+    mDeletedIds = updateJob->deletedIds();
     mNextTimestamp = updateJob->nextTimestamp();
+    mLastChangeNumber = updateJob->lastChangeNumber();
 
-    processNextGroup();
+    addParentGroups();
+    processGroups();
 }
 
 void IncrementalUpdateJob::updateGroupDone(KJob *job)
@@ -113,7 +230,11 @@ void IncrementalUpdateJob::updateGroupDone(KJob *job)
         // try to proceed as far as possible
     }
 
-    processNextGroup();
+    // its members might have changed, list it again when needed
+    mItemIndex->invalidate(job->property("collection").value<Akonadi::Collection>());
+
+    --mRunningJobs;
+    processGroups();
 }
 
 void IncrementalUpdateJob::updateItemDone(KJob *job)
@@ -122,27 +243,75 @@ void IncrementalUpdateJob::updateItemDone(KJob *job)
         kWarning() << job->errorString();
 
         // try to proceed as far as possible
+    } else {
+        UpdateItemJob *updateJob = static_cast<UpdateItemJob*>(job);
+        if (updateJob->addedTopLevelItem().isValid()) {
+            mItemIndex->insert(updateJob->addedTopLevelItem());
+        }
+        mItemIndex->update(updateJob->item());
     }
 
-    processNextItem();
+    --mRunningJobs;
+    processItems();
 }
 
 void IncrementalUpdateJob::createGroupDone(KJob *job)
 {
     if (job->error()) {
         kWarning() << job->errorString();
-        processNextGroup();
+        --mRunningJobs;
+        processGroups();
         return;
     }
 
     Akonadi::CollectionCreateJob *createJob = static_cast<Akonadi::CollectionCreateJob*>(job);
 
     const Akonadi::Collection collection = createJob->collection();
+    mCollections << collection;
+    mGroupCollections.insert(collection.remoteId(), collection);
 
+    // still occupies the slot of the create job
     UpdateGroupJob *updateJob = new UpdateGroupJob(mSearchbase, mConnection, collection, this);
+    updateJob->setProperty("collection", QVariant::fromValue(collection));
+    updateJob->setMaxConcurrentSearches(mMaxConcurrentSearches);
+    updateJob->setBatchSize(mBatchSize);
+    updateJob->setPersonCache(mPersonCache);
+    updateJob->setMaxNestingDepth(mMaxNestingDepth);
+    updateJob->setLinkMembers(mLinkMembers);
+    updateJob->setItemIndex(mItemIndex);
+    updateJob->setMemberOfLookup(mMemberOfLookup);
+    updateJob->setPageSize(mPageSize);
+    updateJob->setFullPayload(mFullPayload);
     connect(updateJob, SIGNAL(result(KJob*)), this, SLOT(updateGroupDone(KJob*)));
 }
 
+void IncrementalUpdateJob::indexFetchDone(KJob *job)
+{
+    if (job->error()) {
+        kWarning() << job->errorString();
+
+        // try to proceed as far as possible
+    } else {
+        const Akonadi::Collection collection = job->property("collection").value<Akonadi::Collection>();
+        mItemIndex->setItems(collection, static_cast<Akonadi::ItemFetchJob*>(job)->items());
+    }
+
+    if (--mPendingIndexFetches == 0) {
+        processItems();
+    }
+}
+
+void IncrementalUpdateJob::deleteDone(KJob *job)
+{
+    if (job->error()) {
+        kWarning() << job->errorString();
+
+        // try to proceed as far as possible
+    }
+
+    processNextDeletion();
+}
+
 void IncrementalUpdateJob::updateTimestampDone(KJob *job)
 {
     if (job->error()) {
@@ -153,81 +322,253 @@ void IncrementalUpdateJob::updateTimestampDone(KJob *job)
     done();
 }
 
-void IncrementalUpdateJob::processNextGroup()
+void IncrementalUpdateJob::addParentGroups()
 {
-    if (mUpdatedGroups.isEmpty()) {
-        processNextItem();
+    if (mMaxNestingDepth <= 0 || mUpdatedGroups.isEmpty()) {
         return;
     }
 
-    const GroupUpdate groupUpdate = mUpdatedGroups.takeFirst();
-    const QString groupId = groupUpdate.id;
-    const QString groupName = groupUpdate.name;
+    // normalized dn of a nested group -> ids of the groups it was expanded into
+    QMultiHash<QString, QString> parents;
+    foreach (const Akonadi::Collection &collection, mGroupCollections) {
+        if (const NestedGroupsAttribute *attribute = collection.attribute<NestedGroupsAttribute>()) {
+            foreach (const QString &dn, attribute->groupDns()) {
+                parents.insert(dn, collection.remoteId());
+            }
+        }
+    }
+    if (parents.isEmpty()) {
+        return;
+    }
 
-    // check if this is a new collection or an update to an existing one
-    foreach (const Akonadi::Collection &collection, mCollections) {
-        if (collection.remoteId() == groupId) {
-            if (collection.remoteRevision().isEmpty() || collection.remoteRevision() != groupUpdate.timestamp) {
-                UpdateGroupJob *updateJob = new UpdateGroupJob(groupUpdate, mSearchbase, mConnection, collection, this);
-                connect(updateJob, SIGNAL(result(KJob*)), this, SLOT(updateGroupDone(KJob*)));
-            } else {
-                // already up to date
-                processNextGroup();
+    QSet<QString> queued;
+    foreach (const GroupUpdate &groupUpdate, mUpdatedGroups) {
+        queued.insert(groupUpdate.id);
+    }
+
+    const GroupUpdateList updatedGroups = mUpdatedGroups;
+    foreach (const GroupUpdate &groupUpdate, updatedGroups) {
+        if (groupUpdate.dn.isEmpty()) {
+            continue;
+        }
+        // e.g. only the description changed
+        const Akonadi::Collection collection = mGroupCollections.value(groupUpdate.id);
+        const MembersDigestAttribute *digest = collection.attribute<MembersDigestAttribute>();
+        if (digest && !groupUpdate.membersDigest.isEmpty() && digest->digest() == groupUpdate.membersDigest) {
+            continue;
+        }
+
+        // the parents list all levels of nested groups, so one step up is enough
+        foreach (const QString &parentId, parents.values(PersonCache::normalizedDn(groupUpdate.dn))) {
+            if (!queued.contains(parentId)) {
+                kDebug() << "members of nested group" << groupUpdate.dn << "changed, updating" << parentId;
+                queued.insert(parentId);
+                mUpdatedGroups << GroupUpdate(parentId);
             }
-            return;
         }
     }
+}
 
-    // find the top level collection
-    foreach (const Akonadi::Collection &collection, mCollections) {
-        if (collection.parentCollection() == Akonadi::Collection::root()) {
-            Akonadi::Collection groupCollection;
-            groupCollection.setName(groupName);
-            groupCollection.setRemoteId(groupId);
-            groupCollection.setContentMimeTypes(QStringList() << KABC::Addressee::mimeType() << Akonadi::Collection::mimeType() << KABC::ContactGroup::mimeType());
-            groupCollection.setParentCollection(collection);
-            groupCollection.setRemoteRevision(groupUpdate.timestamp);
+void IncrementalUpdateJob::processGroups()
+{
+    // groups are independent of each other, keep several of them in flight
+    while (mRunningJobs < mMaxConcurrentSearches && !mUpdatedGroups.isEmpty()) {
+        const GroupUpdate groupUpdate = mUpdatedGroups.takeFirst();
+        const QString groupId = groupUpdate.id;
+        const QString groupName = groupUpdate.name;
+
+        // check if this is a new collection or an update to an existing one
+        const QHash<QString, Akonadi::Collection>::const_iterator it = mGroupCollections.constFind(groupId);
+        if (it != mGroupCollections.constEnd()) {
+            const Akonadi::Collection collection = it.value();
+            // the collection tree synchronization also records the timestamp, so the members have to match as well
+            const MembersDigestAttribute *digest = collection.attribute<MembersDigestAttribute>();
+            if (!collection.remoteRevision().isEmpty() && collection.remoteRevision() == groupUpdate.timestamp &&
+                digest && digest->digest() == groupUpdate.membersDigest) {
+                // already up to date
+                continue;
+            }
 
-            Akonadi::CollectionCreateJob *createJob = new Akonadi::CollectionCreateJob(groupCollection, this);
-            connect(createJob, SIGNAL(result(KJob*)), this, SLOT(createGroupDone(KJob*)));
-            return;
+            ++mRunningJobs;
+            UpdateGroupJob *updateJob = new UpdateGroupJob(groupUpdate, mSearchbase, mConnection, collection, this);
+            updateJob->setProperty("collection", QVariant::fromValue(collection));
+            updateJob->setMaxConcurrentSearches(mMaxConcurrentSearches);
+            updateJob->setBatchSize(mBatchSize);
+            updateJob->setPersonCache(mPersonCache);
+            updateJob->setMaxNestingDepth(mMaxNestingDepth);
+            updateJob->setLinkMembers(mLinkMembers);
+            updateJob->setItemIndex(mItemIndex);
+            updateJob->setMemberOfLookup(mMemberOfLookup);
+            updateJob->setPageSize(mPageSize);
+            updateJob->setFullPayload(mFullPayload);
+            connect(updateJob, SIGNAL(result(KJob*)), this, SLOT(updateGroupDone(KJob*)));
+            continue;
+        }
+
+        Akonadi::Collection groupCollection;
+        groupCollection.setName(groupName);
+        groupCollection.setRemoteId(groupId);
+        if (mLinkMembers) {
+            groupCollection.setVirtual(true);
+            groupCollection.setContentMimeTypes(QStringList() << KABC::Addressee::mimeType() << KABC::ContactGroup::mimeType());
+        } else {
+            groupCollection.setContentMimeTypes(QStringList() << KABC::Addressee::mimeType() << Akonadi::Collection::mimeType() << KABC::ContactGroup::mimeType());
         }
+        groupCollection.setParentCollection(mTopLevelCollection);
+        groupCollection.setRemoteRevision(groupUpdate.timestamp);
+
+        ++mRunningJobs;
+        Akonadi::CollectionCreateJob *createJob = new Akonadi::CollectionCreateJob(groupCollection, this);
+        connect(createJob, SIGNAL(result(KJob*)), this, SLOT(createGroupDone(KJob*)));
+    }
+
+    // persons are only applied once all group changes are done
+    if (mRunningJobs == 0) {
+        buildItemIndex();
     }
 }
 
-void IncrementalUpdateJob::processNextItem()
+void IncrementalUpdateJob::buildItemIndex()
 {
-    if (mUpdatedItems.isEmpty()) {
-        updateTimestamp();
+    if (mChangedItems.isEmpty() && mDeletedIds.isEmpty() && !mUpdates.hasPresentIds) {
+        processItems();
         return;
     }
 
-    const QString itemId = mUpdatedItems.takeFirst();
+    // one listing per collection instead of looking up every changed person in every collection,
+    // only for those not listed by an earlier update or changed since.
+    // built after the group updates, so it includes their membership changes
+    Akonadi::Collection::List collections;
+    foreach (const Akonadi::Collection &collection, indexedCollections()) {
+        if (!mItemIndex->isIndexed(collection)) {
+            collections << collection;
+        }
+    }
+    if (collections.isEmpty()) {
+        processItems();
+        return;
+    }
 
-    UpdateItemJob *updateJob = new UpdateItemJob(itemId, mSearchbase, mConnection, mCollections, this);
-    connect(updateJob, SIGNAL(result(KJob*)), this, SLOT(updateItemDone(KJob*)));
+    kDebug() << "Indexing" << collections.count() << "collections";
+    mPendingIndexFetches = collections.count();
+    foreach (const Akonadi::Collection &collection, collections) {
+        Akonadi::ItemFetchJob *fetchJob = new Akonadi::ItemFetchJob(collection, this);
+        fetchJob->fetchScope().setCacheOnly(true);
+        fetchJob->fetchScope().fetchFullPayload(false);
+        fetchJob->fetchScope().fetchAttribute<ContentDigestAttribute>();
+        fetchJob->setProperty("collection", QVariant::fromValue(collection));
+        connect(fetchJob, SIGNAL(result(KJob*)), this, SLOT(indexFetchDone(KJob*)));
+    }
 }
 
-void IncrementalUpdateJob::updateTimestamp()
+Akonadi::Collection::List IncrementalUpdateJob::indexedCollections() const
 {
-    if (mNextTimestamp.isEmpty() || mInitialTimestamp == mNextTimestamp) {
-        done();
-        return;
+    // linked group members are the items of the top level collection
+    if (mLinkMembers) {
+        return Akonadi::Collection::List() << mTopLevelCollection;
     }
+    return mCollections;
+}
 
-    // find the top level collection
-    foreach (const Akonadi::Collection &collection, mCollections) {
-        if (collection.parentCollection() == Akonadi::Collection::root()) {
-            Akonadi::Collection col = collection;
-            col.setRemoteRevision(mNextTimestamp);
+Akonadi::Item::List IncrementalUpdateJob::localItems(const QString &remoteId) const
+{
+    Akonadi::Item::List items;
+    foreach (const Akonadi::Item &item, mItemIndex->items(remoteId, mTopLevelCollection)) {
+        // the index might still know about collections removed in the meantime
+        if (mCollections.contains(item.parentCollection())) {
+            items << item;
+        }
+    }
+    return items;
+}
+
+void IncrementalUpdateJob::processItems()
+{
+    while (mRunningJobs < mMaxConcurrentSearches && !mChangedItems.isEmpty()) {
+        const Akonadi::Item item = mChangedItems.takeFirst();
+
+        ++mRunningJobs;
+        UpdateItemJob *updateJob = new UpdateItemJob(item, localItems(item.remoteId()), mTopLevelCollection, this);
+        updateJob->setFullPayload(mFullPayload);
+        connect(updateJob, SIGNAL(result(KJob*)), this, SLOT(updateItemDone(KJob*)));
+    }
+
+    if (mRunningJobs == 0) {
+        processDeletions();
+    }
+}
+
+void IncrementalUpdateJob::processDeletions()
+{
+    if (mUpdates.hasPresentIds) {
+        // everything not reported as present is gone
+        foreach (const QString &id, mItemIndex->remoteIds(indexedCollections())) {
+            if (!mUpdates.presentIds.contains(id)) {
+                kDebug() << "no longer present" << id;
+                mDeletedIds << id;
+            }
+        }
+        foreach (const QString &id, mGroupCollections.keys()) {
+            if (!mUpdates.presentIds.contains(id)) {
+                kDebug() << "no longer present" << id;
+                mDeletedIds << id;
+            }
+        }
+    }
+
+    processNextDeletion();
+}
 
-            Akonadi::CollectionModifyJob *modifyJob = new Akonadi::CollectionModifyJob(col, this);
-            connect(modifyJob, SIGNAL(result(KJob*)), this, SLOT(updateTimestampDone(KJob*)));
+void IncrementalUpdateJob::processNextDeletion()
+{
+    while (!mDeletedIds.isEmpty()) {
+        const QString id = mDeletedIds.takeFirst();
+
+        // a group
+        if (mGroupCollections.contains(id)) {
+            kDebug() << "deleting group" << id;
+            const Akonadi::Collection collection = mGroupCollections.take(id);
+            mCollections.removeAll(collection);
+            mItemIndex->invalidate(collection);
+
+            Akonadi::CollectionDeleteJob *deleteJob = new Akonadi::CollectionDeleteJob(collection, this);
+            connect(deleteJob, SIGNAL(result(KJob*)), this, SLOT(deleteDone(KJob*)));
+
+            // with linked members its contact group item is stored in the top level collection
+            mDeletedIds.prepend(id);
             return;
         }
+
+        // a person, with all its copies in group collections still around
+        const Akonadi::Item::List items = localItems(id);
+        mItemIndex->remove(id);
+        if (items.isEmpty()) {
+            kDebug() << "not stored locally" << id;
+            continue;
+        }
+
+        kDebug() << "deleting person" << id;
+        Akonadi::ItemDeleteJob *deleteJob = new Akonadi::ItemDeleteJob(items, this);
+        connect(deleteJob, SIGNAL(result(KJob*)), this, SLOT(deleteDone(KJob*)));
+        return;
     }
 
-    Q_ASSERT("List of collections must include the top level collection" == 0);
+    updateTimestamp();
+}
+
+void IncrementalUpdateJob::updateTimestamp()
+{
+    // the update query overlaps with the previous one, never move the watermark backwards
+    if (mNextTimestamp < 0 || mNextTimestamp <= LDAPMapper::parseTimestamp(mInitialTimestamp)) {
+        done();
+        return;
+    }
+
+    Akonadi::Collection col = mTopLevelCollection;
+    col.setRemoteRevision(LDAPMapper::formatTimestamp(mNextTimestamp));
+
+    Akonadi::CollectionModifyJob *modifyJob = new Akonadi::CollectionModifyJob(col, this);
+    connect(modifyJob, SIGNAL(result(KJob*)), this, SLOT(updateTimestampDone(KJob*)));
 }
 
 void IncrementalUpdateJob::done()
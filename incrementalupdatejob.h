@@ -20,13 +20,19 @@
 #define INCREMENATLUPDATEJOB_H
 
 #include "incrementalupdatedata.h"
+#include "itemindex.h"
+#include "retrieveupdatesjob.h"
 
 #include <akonadi/collection.h>
+#include <akonadi/item.h>
 
 #include <kjob.h>
 
+#include <QHash>
 #include <QStringList>
 
+class PersonCache;
+
 namespace KLDAP {
     class LdapConnection;
 }
@@ -35,8 +41,66 @@ class IncrementalUpdateJob : public KJob
 {
     Q_OBJECT
 public:
+    enum Error {
+        // the search for updates failed, e.g. because the replica is not available
+        SearchFailed = KJob::UserDefinedError + 1
+    };
+
     IncrementalUpdateJob(const QString &resourceId, const QString &searchBase, KLDAP::LdapConnection &connection, QObject *parent = 0);
 
+    void setOverlap(int seconds);
+
+    /**
+     * Maximum number of group and person updates in flight at the same time
+     */
+    void setMaxConcurrentSearches(int count);
+
+    /**
+     * Maximum number of group members fetched with a single search
+     */
+    void setBatchSize(int size);
+
+    void setPersonCache(PersonCache *personCache);
+
+    /**
+     * Keep the locations of the local items in @p itemIndex between updates. Without it,
+     * all collections are listed again for every update.
+     */
+    void setItemIndex(ItemIndex *itemIndex);
+
+    /**
+     * How many levels of nested groups are expanded into group members
+     */
+    void setMaxNestingDepth(int depth);
+
+    /**
+     * Group collections are virtual and link the members of the top level collection
+     */
+    void setLinkMembers(bool link);
+
+    /**
+     * Group members are found through their memberOf attribute
+     */
+    void setMemberOfLookup(bool memberOf);
+
+    /**
+     * Request the group members found through their memberOf attribute in pages of @p pageSize
+     */
+    void setPageSize(int pageSize);
+
+    /**
+     * Fetch the full payload of changed persons, instead of only the lookup attributes
+     */
+    void setFullPayload(bool full);
+
+    /**
+     * Apply the given changes instead of querying the server for them
+     */
+    void setUpdates(const UpdateData &updates);
+
+    void setDeletionDetection(RetrieveUpdatesJob::DeletionDetection detection, qint64 lastChangeNumber);
+    qint64 lastChangeNumber() const;
+
 public Q_SLOTS:
     virtual void start();
 
@@ -46,11 +110,19 @@ private Q_SLOTS:
     void updateGroupDone(KJob *job);
     void updateItemDone(KJob* job);
     void createGroupDone(KJob *job);
+    void indexFetchDone(KJob *job);
+    void deleteDone(KJob *job);
     void updateTimestampDone(KJob *job);
 
 private:
-    void processNextGroup();
-    void processNextItem();
+    void addParentGroups();
+    void processGroups();
+    void buildItemIndex();
+    Akonadi::Collection::List indexedCollections() const;
+    Akonadi::Item::List localItems(const QString &remoteId) const;
+    void processItems();
+    void processDeletions();
+    void processNextDeletion();
     void updateTimestamp();
     void done();
 
@@ -60,11 +132,34 @@ private:
     KLDAP::LdapConnection &mConnection;
 
     Akonadi::Collection::List mCollections;
+    Akonadi::Collection mTopLevelCollection;
+    QHash<QString, Akonadi::Collection> mGroupCollections;
     QString mInitialTimestamp;
-
-    QStringList mUpdatedItems;
+    int mOverlap;
+    RetrieveUpdatesJob::DeletionDetection mDeletionDetection;
+    qint64 mLastChangeNumber;
+    int mMaxConcurrentSearches;
+    int mRunningJobs;
+    int mBatchSize;
+    PersonCache *mPersonCache;
+    int mMaxNestingDepth;
+    bool mLinkMembers;
+    bool mMemberOfLookup;
+    int mPageSize;
+    bool mFullPayload;
+
+    bool mHasUpdates;
+    UpdateData mUpdates;
+
+    Akonadi::Item::List mChangedItems;
     GroupUpdateList mUpdatedGroups;
-    QString mNextTimestamp;
+    QStringList mDeletedIds;
+
+    // where the persons are stored locally
+    ItemIndex mOwnItemIndex;
+    ItemIndex *mItemIndex;
+    int mPendingIndexFetches;
+    qint64 mNextTimestamp;
 
     QElapsedTimer mProcessingTime;
 };
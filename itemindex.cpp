@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2014 Klaralvdalens Datakonsult AB <info@kdab.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "itemindex.h"
+
+#include "contentdigestattribute.h"
+
+#include <QSet>
+
+// the index does not need the payloads
+static Akonadi::Item indexEntry(const Akonadi::Item &item, const Akonadi::Collection &collection)
+{
+    Akonadi::Item entry(item.id());
+    entry.setRemoteId(item.remoteId());
+    entry.setRemoteRevision(item.remoteRevision());
+    entry.setMimeType(item.mimeType());
+    entry.setParentCollection(collection);
+    if (const ContentDigestAttribute *digest = item.attribute<ContentDigestAttribute>()) {
+        entry.addAttribute(digest->clone());
+    }
+    return entry;
+}
+
+bool ItemIndex::isIndexed(const Akonadi::Collection &collection) const
+{
+    return mCollections.contains(collection.id());
+}
+
+void ItemIndex::setItems(const Akonadi::Collection &collection, const Akonadi::Item::List &items)
+{
+    QHash<QString, Akonadi::Item> &collectionItems = mCollections[collection.id()];
+    collectionItems.clear();
+    collectionItems.reserve(items.count());
+    foreach (const Akonadi::Item &item, items) {
+        collectionItems.insert(item.remoteId(), indexEntry(item, collection));
+    }
+}
+
+void ItemIndex::invalidate(const Akonadi::Collection &collection)
+{
+    mCollections.remove(collection.id());
+}
+
+void ItemIndex::invalidateGroups(const Akonadi::Collection &topLevelCollection)
+{
+    const QHash<QString, Akonadi::Item> topLevelItems = mCollections.value(topLevelCollection.id());
+    const bool indexed = isIndexed(topLevelCollection);
+    mCollections.clear();
+    if (indexed) {
+        mCollections.insert(topLevelCollection.id(), topLevelItems);
+    }
+}
+
+void ItemIndex::clear()
+{
+    mCollections.clear();
+}
+
+void ItemIndex::insert(const Akonadi::Item &item)
+{
+    QHash<Akonadi::Collection::Id, QHash<QString, Akonadi::Item> >::iterator it = mCollections.find(item.parentCollection().id());
+    if (it != mCollections.end()) {
+        it->insert(item.remoteId(), indexEntry(item, item.parentCollection()));
+    }
+}
+
+void ItemIndex::update(const Akonadi::Item &item)
+{
+    const ContentDigestAttribute *digest = item.attribute<ContentDigestAttribute>();
+    for (QHash<Akonadi::Collection::Id, QHash<QString, Akonadi::Item> >::iterator it = mCollections.begin(); it != mCollections.end(); ++it) {
+        QHash<QString, Akonadi::Item>::iterator itemIt = it->find(item.remoteId());
+        if (itemIt == it->end()) {
+            continue;
+        }
+        itemIt->setRemoteRevision(item.remoteRevision());
+        if (digest) {
+            itemIt->addAttribute(digest->clone());
+        }
+    }
+}
+
+void ItemIndex::remove(const QString &remoteId)
+{
+    for (QHash<Akonadi::Collection::Id, QHash<QString, Akonadi::Item> >::iterator it = mCollections.begin(); it != mCollections.end(); ++it) {
+        it->remove(remoteId);
+    }
+}
+
+Akonadi::Item::List ItemIndex::items(const QString &remoteId, const Akonadi::Collection &topLevelCollection) const
+{
+    Akonadi::Item::List copies;
+    for (QHash<Akonadi::Collection::Id, QHash<QString, Akonadi::Item> >::const_iterator it = mCollections.constBegin(); it != mCollections.constEnd(); ++it) {
+        const QHash<QString, Akonadi::Item>::const_iterator itemIt = it->constFind(remoteId);
+        if (itemIt == it->constEnd()) {
+            continue;
+        }
+
+        // a linked item is listed in every collection it is linked into, it is still only one item
+        const Akonadi::Item &item = itemIt.value();
+        bool known = false;
+        for (int i = 0; i < copies.count(); ++i) {
+            if (copies.at(i).id() == item.id()) {
+                if (item.parentCollection() == topLevelCollection) {
+                    copies[i] = item;
+                }
+                known = true;
+                break;
+            }
+        }
+        if (!known) {
+            copies << item;
+        }
+    }
+    return copies;
+}
+
+QStringList ItemIndex::remoteIds(const Akonadi::Collection::List &collections) const
+{
+    QSet<QString> remoteIds;
+    foreach (const Akonadi::Collection &collection, collections) {
+        foreach (const QString &remoteId, mCollections.value(collection.id()).keys()) {
+            remoteIds.insert(remoteId);
+        }
+    }
+    return remoteIds.toList();
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2014 Klaralvdalens Datakonsult AB <info@kdab.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ITEMINDEX_H
+#define ITEMINDEX_H
+
+#include <akonadi/collection.h>
+#include <akonadi/item.h>
+
+#include <QHash>
+#include <QStringList>
+
+/**
+ * Where the persons are stored locally, by remote id, kept between incremental updates.
+ *
+ * The items of a collection are listed once when they are first needed and then kept up
+ * to date by the incremental updates. A collection whose items have been written by other
+ * means (e.g. a full synchronization or a membership update) has to be invalidated, it is
+ * listed again the next time it is needed.
+ *
+ * Only identifiers, revisions and content digests are kept, no payloads.
+ */
+class ItemIndex
+{
+public:
+    bool isIndexed(const Akonadi::Collection &collection) const;
+
+    /**
+     * Replaces the known items of @p collection
+     */
+    void setItems(const Akonadi::Collection &collection, const Akonadi::Item::List &items);
+    void invalidate(const Akonadi::Collection &collection);
+
+    /**
+     * Invalidates all collections but @p topLevelCollection
+     */
+    void invalidateGroups(const Akonadi::Collection &topLevelCollection);
+    void clear();
+
+    /**
+     * Adds @p item to its parent collection, if that one is indexed
+     */
+    void insert(const Akonadi::Item &item);
+
+    /**
+     * Takes over the remote revision and content digest of @p item for all its copies
+     */
+    void update(const Akonadi::Item &item);
+    void remove(const QString &remoteId);
+
+    /**
+     * All copies of the item with @p remoteId. A linked item is only returned once,
+     * with @p topLevelCollection as its parent if it is linked from there.
+     */
+    Akonadi::Item::List items(const QString &remoteId, const Akonadi::Collection &topLevelCollection) const;
+
+    /**
+     * The remote ids of all items of the given collections
+     */
+    QStringList remoteIds(const Akonadi::Collection::List &collections) const;
+
+private:
+    // collection id -> its items by remote id
+    QHash<Akonadi::Collection::Id, QHash<QString, Akonadi::Item> > mCollections;
+};
+
+#endif // ITEMINDEX_H
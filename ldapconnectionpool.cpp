@@ -0,0 +1,545 @@
+/*
+ * Copyright (C) 2014 Klaralvdalens Datakonsult AB <info@kdab.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ldapconnectionpool.h"
+
+#include <kdebug.h>
+
+#include <QMultiMap>
+
+#include <ldap.h>
+
+// connections idle for less than this are handed out without a check
+static const int HealthCheckInterval = 30 * 1000;
+// a failed replica is probed again after this
+static const int ReplicaRetryInterval = 60 * 1000;
+// msecs between two looks for the answer to a probe
+static const int ProbePollInterval = 10;
+
+ConnectionRequest::ConnectionRequest(LdapConnectionPool *pool, QObject *parent)
+:   KJob(parent),
+    mPool(pool),
+    mConnection(0)
+{
+    QMetaObject::invokeMethod(this, "start", Qt::QueuedConnection);
+}
+
+KLDAP::LdapConnection *ConnectionRequest::connection() const
+{
+    return mConnection;
+}
+
+void ConnectionRequest::start()
+{
+    mPool->enqueue(this);
+}
+
+bool ConnectionRequest::doKill()
+{
+    mPool->cancel(this);
+    return true;
+}
+
+void ConnectionRequest::done(KLDAP::LdapConnection *connection)
+{
+    mConnection = connection;
+    if (!connection) {
+        setError(KJob::UserDefinedError);
+    }
+    emitResult();
+}
+
+LdapConnectionPool::LdapConnectionPool(QObject *parent)
+:   QObject(parent),
+    mMaxConnections(DefaultMaxConnections),
+    mIdleTimeout(DefaultIdleTimeout),
+    mOperationTimeout(0),
+    mServeScheduled(false)
+{
+    connect(&mReapTimer, SIGNAL(timeout()), this, SLOT(reapIdleConnections()));
+    mReapTimer.start(mIdleTimeout / 2);
+}
+
+LdapConnectionPool::~LdapConnectionPool()
+{
+    clear();
+    foreach (ConnectionRequest *request, mWaiting) {
+        request->kill(KJob::Quietly);
+    }
+    qDeleteAll(mInUse);
+}
+
+void LdapConnectionPool::setServer(const KLDAP::LdapServer &server)
+{
+    setServers(QList<KLDAP::LdapServer>() << server);
+}
+
+void LdapConnectionPool::setServers(const QList<KLDAP::LdapServer> &servers)
+{
+    clear();
+    mReplicaOf.clear();
+    mReplicas.clear();
+    foreach (const KLDAP::LdapServer &server, servers) {
+        Replica replica;
+        replica.server = server;
+        replica.latency = -1;
+        replica.failed = false;
+        mReplicas << replica;
+    }
+    // waiting requests go to the new servers
+    scheduleServeRequests();
+}
+
+KLDAP::LdapServer LdapConnectionPool::preferredServer() const
+{
+    const QList<int> replicas = replicasByPreference();
+    if (replicas.isEmpty()) {
+        return KLDAP::LdapServer();
+    }
+    return mReplicas.at(replicas.first()).server;
+}
+
+void LdapConnectionPool::setMaxConnections(int count)
+{
+    mMaxConnections = qMax(1, count);
+    scheduleServeRequests();
+}
+
+void LdapConnectionPool::setIdleTimeout(int msecs)
+{
+    mIdleTimeout = qMax(1000, msecs);
+    mReapTimer.start(mIdleTimeout / 2);
+}
+
+void LdapConnectionPool::setOperationTimeout(int secs)
+{
+    mOperationTimeout = qMax(0, secs);
+}
+
+void LdapConnectionPool::applyOperationTimeout(KLDAP::LdapConnection &connection) const
+{
+    LDAP *ld = static_cast<LDAP*>(connection.handle());
+    if (!ld || mOperationTimeout <= 0) {
+        return;
+    }
+    // a hung replica fails operations instead of stalling them, so we fail over
+    struct timeval timeout = { mOperationTimeout, 0 };
+    ldap_set_option(ld, LDAP_OPT_TIMEOUT, &timeout);
+    int timeLimit = mOperationTimeout;
+    ldap_set_option(ld, LDAP_OPT_TIMELIMIT, &timeLimit);
+}
+
+ConnectionRequest *LdapConnectionPool::requestConnection(QObject *parent)
+{
+    return new ConnectionRequest(this, parent);
+}
+
+int LdapConnectionPool::freeConnections() const
+{
+    // connections being opened or checked are counted by openConnections() already
+    const int unserved = qMax(0, mWaiting.count() - connectionsUnderway());
+    return qMax(0, mMaxConnections - openConnections() - unserved);
+}
+
+void LdapConnectionPool::enqueue(ConnectionRequest *request)
+{
+    mWaiting << request;
+    connect(request, SIGNAL(destroyed(QObject*)), this, SLOT(requestDestroyed(QObject*)));
+    serveRequests();
+}
+
+void LdapConnectionPool::cancel(ConnectionRequest *request)
+{
+    mWaiting.removeAll(request);
+}
+
+void LdapConnectionPool::requestDestroyed(QObject *request)
+{
+    // only the address is used, the request is gone already
+    mWaiting.removeAll(static_cast<ConnectionRequest*>(request));
+}
+
+void LdapConnectionPool::scheduleServeRequests()
+{
+    if (!mServeScheduled) {
+        mServeScheduled = true;
+        QMetaObject::invokeMethod(this, "serveRequests", Qt::QueuedConnection);
+    }
+}
+
+void LdapConnectionPool::serveRequests()
+{
+    mServeScheduled = false;
+    while (mWaiting.count() > connectionsUnderway()) {
+        if (!mIdle.isEmpty()) {
+            const IdleConnection idle = mIdle.takeLast();
+            mInUse.insert(idle.connection);
+            if (idle.since.elapsed() > HealthCheckInterval) {
+                // handed out once it answers
+                startProbe(idle.connection, IdleProbe, mReplicaOf.value(idle.connection, -1), QList<int>());
+            } else {
+                mWaiting.takeFirst()->done(idle.connection);
+            }
+            continue;
+        }
+
+        if (openConnections() >= mMaxConnections) {
+            // served once a connection is returned
+            return;
+        }
+
+        const QList<int> replicas = replicasByPreference();
+        if (replicas.isEmpty()) {
+            kWarning() << "no server configured";
+            mWaiting.takeFirst()->done(0);
+            continue;
+        }
+        openConnection(replicas);
+    }
+}
+
+int LdapConnectionPool::openConnections() const
+{
+    int opening = 0;
+    foreach (const Probe &probe, mProbes) {
+        if (probe.kind == OpenProbe) {
+            ++opening;
+        }
+    }
+    return mInUse.count() - mRetired.count() + opening;
+}
+
+int LdapConnectionPool::connectionsUnderway() const
+{
+    int count = 0;
+    foreach (const Probe &probe, mProbes) {
+        if (probe.kind != FailedJobProbe) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+void LdapConnectionPool::openConnection(QList<int> replicas)
+{
+    while (!replicas.isEmpty()) {
+        const int replica = replicas.takeFirst();
+        KLDAP::LdapConnection *connection = new KLDAP::LdapConnection(mReplicas.at(replica).server);
+        //This doesn't really open a connection, so we have to test ourselves if the server is available
+        if (connection->connect()) {
+            kWarning() << connection->connectionError();
+            delete connection;
+            replicaFailed(replica);
+            continue;
+        }
+        Q_ASSERT(connection->handle());
+
+        // don't wait for the operating system's timeout if the replica is unreachable,
+        // and don't block while connecting
+        LDAP *ld = static_cast<LDAP*>(connection->handle());
+        struct timeval timeout = { ProbeTimeout, 0 };
+        ldap_set_option(ld, LDAP_OPT_NETWORK_TIMEOUT, &timeout);
+#ifdef LDAP_OPT_CONNECT_ASYNC
+        ldap_set_option(ld, LDAP_OPT_CONNECT_ASYNC, LDAP_OPT_ON);
+#endif
+        applyOperationTimeout(*connection);
+
+        startProbe(connection, OpenProbe, replica, replicas);
+        return;
+    }
+
+    kWarning() << "failed to connect to server";
+    if (!mWaiting.isEmpty()) {
+        mWaiting.takeFirst()->done(0);
+    }
+}
+
+void LdapConnectionPool::startProbe(KLDAP::LdapConnection *connection, ProbeKind kind, int replica, const QList<int> &fallbacks)
+{
+    Probe probe;
+    probe.kind = kind;
+    probe.replica = replica;
+    probe.fallbacks = fallbacks;
+
+    LdapProbe *ldapProbe = new LdapProbe(connection, kind == OpenProbe, this);
+    connect(ldapProbe, SIGNAL(done(LdapProbe*,int)), this, SLOT(probeDone(LdapProbe*,int)));
+    mProbes.insert(ldapProbe, probe);
+    ldapProbe->start();
+}
+
+void LdapConnectionPool::probeDone(LdapProbe *ldapProbe, int latency)
+{
+    const Probe probe = mProbes.take(ldapProbe);
+    KLDAP::LdapConnection *connection = ldapProbe->connection();
+    ldapProbe->deleteLater();
+    scheduleServeRequests();
+
+    if (probe.kind == OpenProbe) {
+        if (latency < 0) {
+            kWarning() << mReplicas.at(probe.replica).server.host() << "does not answer";
+            delete connection;
+            replicaFailed(probe.replica);
+            openConnection(probe.fallbacks);
+            return;
+        }
+
+        Replica &r = mReplicas[probe.replica];
+        r.latency = r.latency < 0 ? latency : (r.latency * 3 + latency) / 4;
+        r.failed = false;
+        kDebug() << "Connected to" << r.server.host() << openConnections() + 1 << "connections open";
+        mReplicaOf.insert(connection, probe.replica);
+        mInUse.insert(connection);
+        checkin(connection);
+        return;
+    }
+
+    if (latency >= 0) {
+        checkin(connection);
+        return;
+    }
+
+    kDebug() << "dropping a broken connection";
+    if (!mRetired.contains(connection) && probe.replica >= 0 && probe.replica < mReplicas.count()) {
+        // fail over right away if the server is the cause
+        replicaFailed(probe.replica);
+    }
+    mInUse.remove(connection);
+    mRetired.remove(connection);
+    mReplicaOf.remove(connection);
+    delete connection;
+}
+
+void LdapConnectionPool::replicaFailed(int replica)
+{
+    Replica &r = mReplicas[replica];
+    kWarning() << "replica failed:" << r.server.host();
+    r.failed = true;
+    r.failedSince.start();
+
+    for (int i = mIdle.count() - 1; i >= 0; --i) {
+        if (mReplicaOf.value(mIdle.at(i).connection, -1) == replica) {
+            KLDAP::LdapConnection *connection = mIdle.takeAt(i).connection;
+            mReplicaOf.remove(connection);
+            delete connection;
+        }
+    }
+    // connections to it still in use are closed once returned
+    for (QHash<KLDAP::LdapConnection*, int>::const_iterator it = mReplicaOf.constBegin(); it != mReplicaOf.constEnd(); ++it) {
+        if (it.value() == replica && mInUse.contains(it.key())) {
+            mRetired.insert(it.key());
+        }
+    }
+}
+
+QList<int> LdapConnectionPool::replicasByPreference() const
+{
+    // measured replicas by latency, then unmeasured ones in configured order,
+    // then failed ones whose retry interval is over
+    QMultiMap<int, int> measured;
+    QList<int> unmeasured;
+    QList<int> retry;
+    for (int i = 0; i < mReplicas.count(); ++i) {
+        const Replica &r = mReplicas.at(i);
+        if (r.failed) {
+            if (r.failedSince.elapsed() > ReplicaRetryInterval) {
+                retry << i;
+            }
+        } else if (r.latency < 0) {
+            unmeasured << i;
+        } else {
+            measured.insert(r.latency, i);
+        }
+    }
+    QList<int> replicas = measured.values();
+    replicas << unmeasured << retry;
+    if (replicas.isEmpty()) {
+        // all of them failed recently, try anyways
+        for (int i = 0; i < mReplicas.count(); ++i) {
+            replicas << i;
+        }
+    }
+    return replicas;
+}
+
+void LdapConnectionPool::checkin(KLDAP::LdapConnection *connection)
+{
+    if (!mInUse.remove(connection)) {
+        kWarning() << "unknown connection";
+        return;
+    }
+    // either it or a slot for a new one is free now
+    scheduleServeRequests();
+
+    if (mRetired.remove(connection)) {
+        mReplicaOf.remove(connection);
+        delete connection;
+        return;
+    }
+
+    IdleConnection idle;
+    idle.connection = connection;
+    idle.since.start();
+    mIdle << idle;
+}
+
+void LdapConnectionPool::checkinWhenFinished(KJob *job, KLDAP::LdapConnection *connection)
+{
+    mJobs.insert(job, connection);
+    connect(job, SIGNAL(finished(KJob*)), this, SLOT(jobFinished(KJob*)));
+}
+
+void LdapConnectionPool::clear()
+{
+    foreach (const IdleConnection &idle, mIdle) {
+        mReplicaOf.remove(idle.connection);
+        delete idle.connection;
+    }
+    mIdle.clear();
+
+    foreach (KLDAP::LdapConnection *connection, mInUse) {
+        mRetired.insert(connection);
+    }
+
+    // probes of connections in use finish on their own, new connections are dropped
+    QHash<LdapProbe*, Probe>::iterator it = mProbes.begin();
+    while (it != mProbes.end()) {
+        if (it.value().kind == OpenProbe) {
+            delete it.key()->connection();
+            delete it.key();
+            it = mProbes.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void LdapConnectionPool::jobFinished(KJob *job)
+{
+    KLDAP::LdapConnection *connection = mJobs.take(job);
+    if (!connection) {
+        return;
+    }
+    // check right away if the job failed because of the server
+    if (job->error() && mReplicaOf.contains(connection) && !mRetired.contains(connection)) {
+        startProbe(connection, FailedJobProbe, mReplicaOf.value(connection), QList<int>());
+        return;
+    }
+    checkin(connection);
+}
+
+void LdapConnectionPool::reapIdleConnections()
+{
+    for (int i = mIdle.count() - 1; i >= 0; --i) {
+        if (mIdle.at(i).since.elapsed() > mIdleTimeout) {
+            kDebug() << "closing an idle connection";
+            KLDAP::LdapConnection *connection = mIdle.takeAt(i).connection;
+            mReplicaOf.remove(connection);
+            delete connection;
+        }
+    }
+}
+
+LdapProbe::LdapProbe(KLDAP::LdapConnection *connection, bool bind, QObject *parent)
+:   QObject(parent),
+    mConnection(connection),
+    mBind(bind),
+    mMsgId(-1)
+{
+    connect(&mPollTimer, SIGNAL(timeout()), this, SLOT(poll()));
+}
+
+KLDAP::LdapConnection *LdapProbe::connection() const
+{
+    return mConnection;
+}
+
+void LdapProbe::start()
+{
+    mElapsed.start();
+    LDAP *ld = static_cast<LDAP*>(mConnection->handle());
+    int ret = LDAP_SERVER_DOWN;
+    if (ld && mBind) {
+        struct berval noCredentials = { 0, 0 };
+        ret = ldap_sasl_bind(ld, 0, LDAP_SASL_SIMPLE, &noCredentials, 0, 0, &mMsgId);
+    } else if (ld) {
+        ret = sendSearch();
+    }
+    if (ret != LDAP_SUCCESS) {
+        kDebug() << "sending the probe failed" << ldap_err2string(ret);
+        // reported by the first poll, not from within the caller
+        mMsgId = -1;
+    }
+    mPollTimer.start(ProbePollInterval);
+}
+
+int LdapProbe::sendSearch()
+{
+    char noAttributes[] = LDAP_NO_ATTRS;
+    char *attrs[] = { noAttributes, 0 };
+    struct timeval timeout = { LdapConnectionPool::ProbeTimeout, 0 };
+    return ldap_search_ext(static_cast<LDAP*>(mConnection->handle()), "", LDAP_SCOPE_BASE, "(objectClass=*)",
+                           attrs, 0, 0, 0, &timeout, 1, &mMsgId);
+}
+
+void LdapProbe::poll()
+{
+    if (mMsgId < 0) {
+        finish(-1);
+        return;
+    }
+
+    LDAP *ld = static_cast<LDAP*>(mConnection->handle());
+    struct timeval noWait = { 0, 0 };
+    LDAPMessage *message = 0;
+    const int type = ldap_result(ld, mMsgId, LDAP_MSG_ALL, &noWait, &message);
+    if (type == 0) {
+        if (mElapsed.elapsed() > LdapConnectionPool::ProbeTimeout * 1000) {
+            kDebug() << "no answer";
+            ldap_abandon_ext(ld, mMsgId, 0, 0);
+            finish(-1);
+        }
+        return;
+    }
+    if (type < 0) {
+        kDebug() << "connection failed";
+        finish(-1);
+        return;
+    }
+
+    int code = LDAP_OTHER;
+    ldap_parse_result(ld, message, &code, 0, 0, 0, 0, 1);
+    if (code != LDAP_SUCCESS) {
+        kDebug() << "probe failed" << ldap_err2string(code);
+        finish(-1);
+        return;
+    }
+
+    if (type == LDAP_RES_BIND) {
+        mBind = false;
+        if (sendSearch() != LDAP_SUCCESS) {
+            finish(-1);
+        }
+        return;
+    }
+    finish(mElapsed.elapsed());
+}
+
+void LdapProbe::finish(int latency)
+{
+    mPollTimer.stop();
+    emit done(this, latency);
+}
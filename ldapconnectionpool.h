@@ -0,0 +1,235 @@
+/*
+ * Copyright (C) 2014 Klaralvdalens Datakonsult AB <info@kdab.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LDAPCONNECTIONPOOL_H
+#define LDAPCONNECTIONPOOL_H
+
+#include <KLDAP/LdapConnection>
+#include <KLDAP/LdapServer>
+
+#include <kjob.h>
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QList>
+#include <QObject>
+#include <QSet>
+#include <QTimer>
+
+class LdapConnectionPool;
+class LdapProbe;
+
+/**
+ * Waits for a connection of an LdapConnectionPool, see LdapConnectionPool::requestConnection()
+ */
+class ConnectionRequest : public KJob
+{
+    Q_OBJECT
+public:
+    /**
+     * The connection, or 0 if none could be opened. It has to be returned with
+     * LdapConnectionPool::checkin() or checkinWhenFinished().
+     */
+    KLDAP::LdapConnection *connection() const;
+
+public Q_SLOTS:
+    virtual void start();
+
+protected:
+    virtual bool doKill();
+
+private:
+    friend class LdapConnectionPool;
+    ConnectionRequest(LdapConnectionPool *pool, QObject *parent);
+    void done(KLDAP::LdapConnection *connection);
+
+    LdapConnectionPool *mPool;
+    KLDAP::LdapConnection *mConnection;
+};
+
+/**
+ * Connections to the server, checked out by jobs so independent jobs don't share a socket.
+ *
+ * Connections are opened on demand up to the maximum. Once all of them are in use, requests
+ * wait until one is returned. Connections which have been idle for a while are checked
+ * before they are handed out again, and closed after the idle timeout.
+ *
+ * The server may have several replicas. New connections go to the fastest replica that
+ * answered the last probe (an anonymous bind and a search of the root DSE). A replica
+ * failing a probe, or whose connection is left broken by a job, is skipped until it
+ * answers again, its idle connections are closed. Probes don't block, see LdapProbe.
+ */
+class LdapConnectionPool : public QObject
+{
+    Q_OBJECT
+public:
+    enum {
+        DefaultMaxConnections = 4,
+        DefaultIdleTimeout = 5 * 60 * 1000,
+        // seconds, for opening a connection and for probes
+        ProbeTimeout = 3
+    };
+
+    explicit LdapConnectionPool(QObject *parent = 0);
+    ~LdapConnectionPool();
+
+    /**
+     * Closes all connections, those in use are closed once they are returned
+     */
+    void setServer(const KLDAP::LdapServer &server);
+    void setServers(const QList<KLDAP::LdapServer> &servers);
+
+    /**
+     * The replica new connections currently go to
+     */
+    KLDAP::LdapServer preferredServer() const;
+    void setMaxConnections(int count);
+    void setIdleTimeout(int msecs);
+
+    /**
+     * Seconds a bind or a search may take on new connections, 0 for no limit.
+     * It is sent along with searches as time limit, and binds and searches of
+     * LdapSearchScheduler which don't get an answer within it fail.
+     */
+    void setOperationTimeout(int secs);
+
+    /**
+     * Applies the operation timeout to @p connection, for those not opened by the pool
+     */
+    void applyOperationTimeout(KLDAP::LdapConnection &connection) const;
+
+    /**
+     * Asks for a connection, which the returned request delivers once one is free.
+     * The request fails if no connection could be opened.
+     */
+    ConnectionRequest *requestConnection(QObject *parent = 0);
+
+    /**
+     * How many requests could be served without waiting for a connection to be returned
+     */
+    int freeConnections() const;
+
+    void checkin(KLDAP::LdapConnection *connection);
+
+    /**
+     * Returns @p connection once @p job has finished
+     */
+    void checkinWhenFinished(KJob *job, KLDAP::LdapConnection *connection);
+
+    void clear();
+
+private Q_SLOTS:
+    void serveRequests();
+    void requestDestroyed(QObject *request);
+    void jobFinished(KJob *job);
+    void probeDone(LdapProbe *probe, int latency);
+    void reapIdleConnections();
+
+private:
+    friend class ConnectionRequest;
+
+    enum ProbeKind {
+        // a new connection
+        OpenProbe,
+        // an idle connection before it is handed out again
+        IdleProbe,
+        // a connection left by a failed job
+        FailedJobProbe
+    };
+
+    void enqueue(ConnectionRequest *request);
+    void cancel(ConnectionRequest *request);
+    void scheduleServeRequests();
+    void openConnection(QList<int> replicas);
+    void startProbe(KLDAP::LdapConnection *connection, ProbeKind kind, int replica, const QList<int> &fallbacks);
+    int openConnections() const;
+    int connectionsUnderway() const;
+    void replicaFailed(int replica);
+    QList<int> replicasByPreference() const;
+
+    struct Replica {
+        KLDAP::LdapServer server;
+        // msecs of the last probes, -1 until measured
+        int latency;
+        bool failed;
+        QElapsedTimer failedSince;
+    };
+
+    struct IdleConnection {
+        KLDAP::LdapConnection *connection;
+        QElapsedTimer since;
+    };
+
+    struct Probe {
+        ProbeKind kind;
+        int replica;
+        // tried next if a new connection to replica doesn't answer
+        QList<int> fallbacks;
+    };
+
+    QList<Replica> mReplicas;
+    // connection -> index of its replica
+    QHash<KLDAP::LdapConnection*, int> mReplicaOf;
+    int mMaxConnections;
+    int mIdleTimeout;
+    int mOperationTimeout;
+    QList<IdleConnection> mIdle;
+    QSet<KLDAP::LdapConnection*> mInUse;
+    QSet<KLDAP::LdapConnection*> mRetired;
+    QHash<KJob*, KLDAP::LdapConnection*> mJobs;
+    // served in order
+    QList<ConnectionRequest*> mWaiting;
+    QHash<LdapProbe*, Probe> mProbes;
+    bool mServeScheduled;
+    QTimer mReapTimer;
+};
+
+/**
+ * Checks whether a connection answers without blocking: an anonymous bind on new connections,
+ * then a search of the root DSE, which is always readable and small. The results are polled
+ * since a new connection may still be connecting when the request is queued.
+ */
+class LdapProbe : public QObject
+{
+    Q_OBJECT
+public:
+    LdapProbe(KLDAP::LdapConnection *connection, bool bind, QObject *parent = 0);
+
+    KLDAP::LdapConnection *connection() const;
+    void start();
+
+Q_SIGNALS:
+    /**
+     * With the msecs taken, or -1 if the connection failed or didn't answer in time
+     */
+    void done(LdapProbe *probe, int latency);
+
+private Q_SLOTS:
+    void poll();
+
+private:
+    int sendSearch();
+    void finish(int latency);
+
+    KLDAP::LdapConnection *mConnection;
+    bool mBind;
+    int mMsgId;
+    QElapsedTimer mElapsed;
+    QTimer mPollTimer;
+};
+
+#endif // LDAPCONNECTIONPOOL_H
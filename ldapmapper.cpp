@@ -17,6 +17,22 @@
 #include "ldapmapper.h"
 #include <kdebug.h>
 
+#include <KABC/Address>
+#include <KABC/Key>
+#include <KABC/PhoneNumber>
+#include <KABC/Picture>
+#include <KUrl>
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QImage>
+#include <QPair>
+#include <QSet>
+#include <QtAlgorithms>
+#include <QVector>
+
+#include <ctype.h>
+
 QString LDAPMapper::getAttribute(LDAPMapper::Attribute attr)
 {
     switch (attr) {
@@ -29,55 +45,690 @@ QString LDAPMapper::getAttribute(LDAPMapper::Attribute attr)
     return QString();
 }
 
-QStringList LDAPMapper::requestedFullPayloadAttributes()
+namespace {
+
+enum Field {
+    Name,
+    GivenName,
+    FamilyName,
+    FormattedName,
+    Email,
+    Organization,
+    Department,
+    Title,
+    Role,
+    WorkPhone,
+    HomePhone,
+    MobilePhone,
+    Fax,
+    Street,
+    Locality,
+    Region,
+    PostalCode,
+    Country,
+    Url,
+    Note,
+    Photo,
+    Certificate,
+    SmimeCertificate
+};
+
+// which searches request the attribute of a field
+enum Level {
+    LookupLevel,
+    FullLevel,
+    // binary and possibly large, only when retrieving a single item
+    ItemLevel
+};
+
+static const struct {
+    const char *name;
+    Field field;
+    Level level;
+} Fields[] = {
+    { "name", Name, LookupLevel },
+    { "givenName", GivenName, LookupLevel },
+    { "familyName", FamilyName, LookupLevel },
+    { "formattedName", FormattedName, LookupLevel },
+    { "email", Email, LookupLevel },
+    { "organization", Organization, FullLevel },
+    { "department", Department, FullLevel },
+    { "title", Title, FullLevel },
+    { "role", Role, FullLevel },
+    { "workPhone", WorkPhone, FullLevel },
+    { "homePhone", HomePhone, FullLevel },
+    { "mobilePhone", MobilePhone, FullLevel },
+    { "fax", Fax, FullLevel },
+    { "street", Street, FullLevel },
+    { "locality", Locality, FullLevel },
+    { "region", Region, FullLevel },
+    { "postalCode", PostalCode, FullLevel },
+    { "country", Country, FullLevel },
+    { "url", Url, FullLevel },
+    { "note", Note, FullLevel },
+    { "photo", Photo, ItemLevel },
+    { "certificate", Certificate, ItemLevel },
+    { "smimeCertificate", SmimeCertificate, ItemLevel }
+};
+
+// the order of attributes mapped to the same field is kept, e.g. the preferred email comes first
+static const char *const DefaultMapping[] = {
+    "cn=name",
+    "givenName=givenName",
+    "sn=familyName",
+    "displayName=formattedName",
+    "mail=email",
+    "alias=email",
+    "o=organization",
+    "ou=department",
+    "title=title",
+    "telephoneNumber=workPhone",
+    "homePhone=homePhone",
+    "mobile=mobilePhone",
+    "facsimileTelephoneNumber=fax",
+    "street=street",
+    "l=locality",
+    "st=region",
+    "postalCode=postalCode",
+    "c=country",
+    "labeledURI=url",
+    "description=note",
+    "jpegPhoto=photo",
+    "userCertificate;binary=certificate",
+    "userSMIMECertificate=smimeCertificate"
+};
+
+struct CompiledMapping
 {
-    QStringList requestedAttributes = requestedLookupPayloadAttributes();
+    struct Entry {
+        QString attribute;
+        Field field;
+        Level level;
+    };
+    QVector<Entry> entries;
+    // lower case attribute name -> index in entries, sorted by name for findEntry()
+    QVector<QPair<QString, int> > index;
+    QStringList lookupAttributes;
+    QStringList fullAttributes;
+    QStringList itemAttributes;
+    int maxBinarySize;
+    bool compiled;
 
-    // TODO: check for more available attributes
-    requestedAttributes << "o" << "title";
+    CompiledMapping() : maxBinarySize(0), compiled(false) {}
+};
 
-    return requestedAttributes;
+}
+
+static CompiledMapping s_mapping;
+
+static bool indexLessThan(const QPair<QString, int> &left, const QPair<QString, int> &right)
+{
+    return left.first < right.first;
+}
+
+// the index of the mapping entry of @p attribute, -1 if it is not mapped. The names of the
+// server's entries come in any case, comparing them case insensitively avoids lowering each one
+static int findEntry(const CompiledMapping &mapping, const QString &attribute)
+{
+    int low = 0;
+    int high = mapping.index.size();
+    while (low < high) {
+        const int middle = (low + high) / 2;
+        const int comparison = QString::compare(mapping.index.at(middle).first, attribute, Qt::CaseInsensitive);
+        if (comparison < 0) {
+            low = middle + 1;
+        } else if (comparison > 0) {
+            high = middle;
+        } else {
+            return mapping.index.at(middle).second;
+        }
+    }
+    return -1;
+}
+
+static const CompiledMapping &compiledMapping()
+{
+    if (!s_mapping.compiled) {
+        LDAPMapper::setAttributeMapping(QStringList());
+    }
+    return s_mapping;
+}
+
+bool LDAPMapper::setAttributeMapping(const QStringList &mapping)
+{
+    QStringList entries = mapping;
+    if (entries.isEmpty()) {
+        for (unsigned i = 0; i < sizeof(DefaultMapping) / sizeof(*DefaultMapping); ++i) {
+            entries << QLatin1String(DefaultMapping[i]);
+        }
+    }
+
+    CompiledMapping compiled;
+    compiled.compiled = true;
+    bool valid = true;
+    QSet<QString> names;
+    foreach (const QString &entry, entries) {
+        const QString attribute = entry.section(QLatin1Char('='), 0, 0).trimmed();
+        const QString fieldName = entry.section(QLatin1Char('='), 1).trimmed();
+
+        int field = -1;
+        for (unsigned i = 0; i < sizeof(Fields) / sizeof(*Fields); ++i) {
+            if (fieldName.compare(QLatin1String(Fields[i].name), Qt::CaseInsensitive) == 0) {
+                field = i;
+                break;
+            }
+        }
+        if (attribute.isEmpty() || field < 0 || names.contains(attribute.toLower())) {
+            kWarning() << "invalid attribute mapping" << entry;
+            valid = false;
+            continue;
+        }
+
+        CompiledMapping::Entry compiledEntry;
+        compiledEntry.attribute = attribute;
+        compiledEntry.field = Fields[field].field;
+        compiledEntry.level = Fields[field].level;
+        names.insert(attribute.toLower());
+        compiled.index << qMakePair(attribute.toLower(), compiled.entries.size());
+        compiled.entries << compiledEntry;
+    }
+    // lower case names sort the same as with a case insensitive comparison
+    qSort(compiled.index.begin(), compiled.index.end(), indexLessThan);
+
+    compiled.lookupAttributes << getAttribute(UniqueIdentifier) << QLatin1String("modifyTimestamp");
+    foreach (const CompiledMapping::Entry &entry, compiled.entries) {
+        switch (entry.level) {
+            case LookupLevel:
+                compiled.lookupAttributes << entry.attribute;
+                break;
+            case FullLevel:
+                compiled.fullAttributes << entry.attribute;
+                break;
+            case ItemLevel:
+                compiled.itemAttributes << entry.attribute;
+                break;
+        }
+    }
+    compiled.fullAttributes = compiled.lookupAttributes + compiled.fullAttributes;
+    compiled.itemAttributes = compiled.fullAttributes + compiled.itemAttributes;
+
+    compiled.maxBinarySize = s_mapping.maxBinarySize;
+    s_mapping = compiled;
+    return valid;
+}
+
+QStringList LDAPMapper::mappedAttributes()
+{
+    QStringList attributes;
+    foreach (const CompiledMapping::Entry &entry, compiledMapping().entries) {
+        attributes << entry.attribute;
+    }
+    return attributes;
+}
+
+QByteArray LDAPMapper::mappingDigest()
+{
+    // the order counts, e.g. the first email is the preferred one
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    foreach (const CompiledMapping::Entry &entry, compiledMapping().entries) {
+        hash.addData(entry.attribute.toLower().toUtf8() + '=' + QByteArray::number(entry.field) + '\n');
+    }
+    return hash.result().toHex();
+}
+
+QStringList LDAPMapper::requestedFullPayloadAttributes()
+{
+    return compiledMapping().fullAttributes;
 }
 
 QStringList LDAPMapper::requestedLookupPayloadAttributes()
 {
-    QStringList requestedAttributes;
-    requestedAttributes << "dn" << "uid" << "cn" << "givenName" << "sn" << "mail" << "alias" << "displayName" << "nsuniqueid" << "modifyTimestamp";
-    return requestedAttributes;
+    return compiledMapping().lookupAttributes;
+}
+
+QStringList LDAPMapper::requestedItemAttributes()
+{
+    return compiledMapping().itemAttributes;
+}
+
+void LDAPMapper::setMaxBinarySize(int bytes)
+{
+    s_mapping.maxBinarySize = qMax(0, bytes);
+}
+
+// the values of each mapping entry, 0 if the entry doesn't have the attribute
+static QVector<const KLDAP::LdapAttrValue*> mappedValues(const CompiledMapping &mapping, const KLDAP::LdapObject &obj)
+{
+    // a single pass over the attributes of the entry, each one is looked up once
+    QVector<const KLDAP::LdapAttrValue*> values(mapping.entries.size(), 0);
+    const KLDAP::LdapAttrMap &attributes = obj.attributes();
+    for (KLDAP::LdapAttrMap::const_iterator it = attributes.constBegin(); it != attributes.constEnd(); ++it) {
+        const int index = findEntry(mapping, it.key());
+        if (index >= 0) {
+            values[index] = &it.value();
+        }
+    }
+    return values;
 }
 
 KABC::Addressee LDAPMapper::getAddressee(const KLDAP::LdapObject& obj)
 {
+    const CompiledMapping &mapping = compiledMapping();
+    const QVector<const KLDAP::LdapAttrValue*> values = mappedValues(mapping, obj);
+
     KABC::Addressee addressee;
-    addressee.setUid(obj.value("nsuniqueid"));
-    addressee.setName(QString::fromUtf8(obj.value("cn")));
-    addressee.setGivenName(QString::fromUtf8(obj.value("givenName")));
-    addressee.setFamilyName(QString::fromUtf8(obj.value("sn")));
-    addressee.setFormattedName(QString::fromUtf8(obj.value("displayName")));
-    QStringList email(obj.value("mail"));
-    foreach(const QByteArray &e, obj.values("alias")) {
-        email << e;
-    }
-    addressee.setEmails(email);
+    addressee.setUid(obj.value(getAttribute(UniqueIdentifier)));
+    QStringList emails;
+    KABC::Address address(KABC::Address::Work);
 
-    // TODO: support for FullPayload attributes
-    if (obj.hasAttribute("o")) {
-        addressee.setOrganization(obj.value("o"));
-    }
-    if (obj.hasAttribute("title")) {
-        addressee.setTitle(obj.value("title"));
+    for (int i = 0; i < values.size(); ++i) {
+        if (!values.at(i) || values.at(i)->isEmpty()) {
+            continue;
+        }
+        const KLDAP::LdapAttrValue &attributeValues = *values.at(i);
+        if (mapping.entries.at(i).level == ItemLevel) {
+            foreach (const QByteArray &data, attributeValues) {
+                if (mapping.maxBinarySize > 0 && data.size() > mapping.maxBinarySize) {
+                    kDebug() << "ignoring" << mapping.entries.at(i).attribute << "of" << data.size() << "bytes";
+                    continue;
+                }
+                if (mapping.entries.at(i).field == Photo) {
+                    addressee.setPhoto(KABC::Picture(QImage::fromData(data)));
+                    continue;
+                }
+                // userCertificate holds a DER encoded X.509 certificate, userSMIMECertificate a PKCS #7 blob
+                KABC::Key key;
+                key.setBinaryData(data);
+                if (mapping.entries.at(i).field == Certificate) {
+                    key.setType(KABC::Key::X509);
+                } else {
+                    key.setType(KABC::Key::Custom);
+                    key.setCustomTypeString(QLatin1String("PKCS7"));
+                }
+                addressee.insertKey(key);
+            }
+            continue;
+        }
+
+        const QString value = QString::fromUtf8(attributeValues.first());
+
+        switch (mapping.entries.at(i).field) {
+            case Name:
+                addressee.setName(value);
+                break;
+            case GivenName:
+                addressee.setGivenName(value);
+                break;
+            case FamilyName:
+                addressee.setFamilyName(value);
+                break;
+            case FormattedName:
+                addressee.setFormattedName(value);
+                break;
+            case Email:
+                foreach (const QByteArray &email, attributeValues) {
+                    emails << QString::fromUtf8(email);
+                }
+                break;
+            case Organization:
+                addressee.setOrganization(value);
+                break;
+            case Department:
+                addressee.setDepartment(value);
+                break;
+            case Title:
+                addressee.setTitle(value);
+                break;
+            case Role:
+                addressee.setRole(value);
+                break;
+            case WorkPhone:
+            case HomePhone:
+            case MobilePhone:
+            case Fax: {
+                KABC::PhoneNumber::Type type = KABC::PhoneNumber::Work;
+                if (mapping.entries.at(i).field == HomePhone) {
+                    type = KABC::PhoneNumber::Home;
+                } else if (mapping.entries.at(i).field == MobilePhone) {
+                    type = KABC::PhoneNumber::Cell;
+                } else if (mapping.entries.at(i).field == Fax) {
+                    type |= KABC::PhoneNumber::Fax;
+                }
+                foreach (const QByteArray &number, attributeValues) {
+                    addressee.insertPhoneNumber(KABC::PhoneNumber(QString::fromUtf8(number), type));
+                }
+                break;
+            }
+            case Street:
+                address.setStreet(value);
+                break;
+            case Locality:
+                address.setLocality(value);
+                break;
+            case Region:
+                address.setRegion(value);
+                break;
+            case PostalCode:
+                address.setPostalCode(value);
+                break;
+            case Country:
+                address.setCountry(value);
+                break;
+            case Url:
+                // labeledURI: the URI, optionally followed by a label
+                addressee.setUrl(KUrl(value.section(QLatin1Char(' '), 0, 0)));
+                break;
+            case Note:
+                addressee.setNote(value);
+                break;
+            default:
+                break;
+        }
     }
 
+    addressee.setEmails(emails);
+    if (!address.isEmpty()) {
+        addressee.insertAddress(address);
+    }
     return addressee;
 }
 
+QByteArray LDAPMapper::getContentDigest(const KLDAP::LdapObject &obj)
+{
+    const CompiledMapping &mapping = compiledMapping();
+    const QVector<const KLDAP::LdapAttrValue*> values = mappedValues(mapping, obj);
+
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    for (int i = 0; i < values.size(); ++i) {
+        if (!values.at(i)) {
+            continue;
+        }
+        // the entry's index separates the attributes, the length prefix the values
+        hash.addData(QByteArray::number(i) + ':');
+        foreach (const QByteArray &value, *values.at(i)) {
+            hash.addData(QByteArray::number(value.size()) + ':');
+            hash.addData(value);
+        }
+        hash.addData("\n", 1);
+    }
+    return hash.result().toHex();
+}
+
 QString LDAPMapper::getStableIdentifier(const KLDAP::LdapObject& obj)
 {
     return obj.value("nsuniqueid");
 }
 
+QString LDAPMapper::getStableIdentifier(const QByteArray &syncUUID)
+{
+    // 389 DS derives the entryUUID used by content synchronization from nsuniqueid,
+    // which is formatted as four groups of eight hex digits
+    const QByteArray hex = syncUUID.toHex();
+    if (hex.size() != 32) {
+        kWarning() << "unexpected UUID" << hex;
+        return QString::fromLatin1(hex);
+    }
+    return QString::fromLatin1(hex.mid(0, 8) + '-' + hex.mid(8, 8) + '-' + hex.mid(16, 8) + '-' + hex.mid(24, 8));
+}
+
+static const QString &timestampAttribute()
+{
+    static const QString attribute = QLatin1String("modifyTimestamp");
+    return attribute;
+}
+
 QString LDAPMapper::getTimestamp(const KLDAP::LdapObject& obj)
 {
-    return obj.value("modifyTimestamp");
+    return QString::fromLatin1(obj.value(timestampAttribute()));
+}
+
+qint64 LDAPMapper::getTimestampValue(const KLDAP::LdapObject &obj)
+{
+    return parseTimestamp(obj.value(timestampAttribute()));
+}
+
+QString LDAPMapper::getTimestamp(const KLDAP::LdapObject &obj, qint64 *value)
+{
+    const QByteArray timestamp = obj.value(timestampAttribute());
+    *value = parseTimestamp(timestamp);
+    return QString::fromLatin1(timestamp);
 }
 
+static inline bool isDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+// days since 1970-01-01 of a date in the proleptic Gregorian calendar
+static qint64 daysFromCivil(int year, int month, int day)
+{
+    year -= month <= 2;
+    const qint64 era = (year >= 0 ? year : year - 399) / 400;
+    const int yearOfEra = year - era * 400;
+    const int dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    const int dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    return era * 146097 + dayOfEra - 719468;
+}
+
+static int daysInMonth(int year, int month)
+{
+    static const int days[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+    if (month == 2 && year % 4 == 0 && (year % 100 != 0 || year % 400 == 0)) {
+        return 29;
+    }
+    return days[month - 1];
+}
+
+qint64 LDAPMapper::parseTimestamp(const QByteArray &generalizedTime)
+{
+    // RFC 4517 section 3.3.13: YYYYMMDDHH[MM[SS]][(.|,)fraction](Z|(+|-)HH[MM])
+    const char *p = generalizedTime.constData();
+    const char *end = p + generalizedTime.size();
+
+    int fields[6] = { 0, 0, 0, 0, 0, 0 };
+    const int widths[6] = { 4, 2, 2, 2, 2, 2 };
+    int parsed = 0;
+    for (; parsed < 6 && p + widths[parsed] <= end && isDigit(*p); ++parsed) {
+        for (int i = 0; i < widths[parsed]; ++i, ++p) {
+            if (!isDigit(*p)) {
+                return -1;
+            }
+            fields[parsed] = fields[parsed] * 10 + (*p - '0');
+        }
+    }
+    // at least the hour
+    if (parsed < 4 || fields[1] < 1 || fields[1] > 12 || fields[2] < 1 || fields[2] > daysInMonth(fields[0], fields[1]) ||
+        fields[3] > 23 || fields[4] > 59 || fields[5] > 60) {
+        return -1;
+    }
+
+    static const qint64 unitMsecs[] = { 0, 0, 0, 3600 * 1000, 60 * 1000, 1000 };
+    qint64 msecs = (daysFromCivil(fields[0], fields[1], fields[2]) * 24 + fields[3]) * 3600 * 1000
+                 + fields[4] * 60 * 1000 + fields[5] * 1000;
+
+    if (p < end && (*p == '.' || *p == ',')) {
+        // a fraction of the last unit given, kept to the millisecond
+        ++p;
+        qint64 fraction = 0;
+        qint64 scale = 1;
+        for (; p < end && isDigit(*p); ++p) {
+            if (scale < 1000000) {
+                fraction = fraction * 10 + (*p - '0');
+                scale *= 10;
+            }
+        }
+        msecs += fraction * unitMsecs[parsed - 1] / scale;
+    }
+
+    if (p < end && *p == 'Z') {
+        ++p;
+    } else if (p + 3 <= end && (*p == '+' || *p == '-') && isDigit(p[1]) && isDigit(p[2])) {
+        const int sign = *p == '+' ? 1 : -1;
+        int offset = ((p[1] - '0') * 10 + (p[2] - '0')) * 60;
+        p += 3;
+        if (p + 2 <= end && isDigit(p[0]) && isDigit(p[1])) {
+            offset += (p[0] - '0') * 10 + (p[1] - '0');
+            p += 2;
+        }
+        // local time = UTC + offset
+        msecs -= sign * offset * 60 * 1000;
+    } else {
+        // local time without offset, not allowed for modifyTimestamp
+        return -1;
+    }
+
+    return p == end ? msecs : -1;
+}
+
+qint64 LDAPMapper::parseTimestamp(const QString &generalizedTime)
+{
+    return parseTimestamp(generalizedTime.toLatin1());
+}
+
+QString LDAPMapper::formatTimestamp(qint64 msecs)
+{
+    const QDateTime dateTime = QDateTime::fromMSecsSinceEpoch(msecs).toUTC();
+    QString timestamp = dateTime.toString(QLatin1String("yyyyMMddHHmmss"));
+    if (msecs % 1000) {
+        timestamp += QLatin1Char('.') + dateTime.toString(QLatin1String("zzz"));
+    }
+    return timestamp + QLatin1Char('Z');
+}
+
+bool LDAPMapper::isGroup(const KLDAP::LdapObject &obj)
+{
+    foreach (const QByteArray &objectClass, obj.values(QLatin1String("objectClass"))) {
+        const QByteArray lowerCase = objectClass.toLower();
+        if (lowerCase == "groupofuniquenames" || lowerCase == "kolabgroupofuniquenames") {
+            return true;
+        }
+    }
+    return false;
+}
+
+QByteArray LDAPMapper::getMembersDigest(const KLDAP::LdapObject &obj)
+{
+    // neither the order of the values nor the case of the DNs matters
+    QList<QByteArray> members;
+    foreach (const QByteArray &member, obj.values(QLatin1String("uniqueMember"))) {
+        members << member.toLower();
+    }
+    qSort(members);
+
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    foreach (const QByteArray &member, members) {
+        hash.addData(member);
+        hash.addData("\n", 1);
+    }
+    return hash.result().toHex();
+}
+
+
+QString LDAPMapper::escapeFilterValue(const QString &value)
+{
+    // RFC 4515 section 3
+    QString escaped;
+    escaped.reserve(value.size());
+    foreach (const QChar &c, value) {
+        switch (c.unicode()) {
+            case '*':
+                escaped += QLatin1String("\\2a");
+                break;
+            case '(':
+                escaped += QLatin1String("\\28");
+                break;
+            case ')':
+                escaped += QLatin1String("\\29");
+                break;
+            case '\\':
+                escaped += QLatin1String("\\5c");
+                break;
+            case 0:
+                escaped += QLatin1String("\\00");
+                break;
+            default:
+                escaped += c;
+        }
+    }
+    return escaped;
+}
+
+QString LDAPMapper::rewindTimestamp(const QString &timestamp, int seconds)
+{
+    const qint64 msecs = parseTimestamp(timestamp);
+    if (msecs < 0) {
+        kWarning() << "invalid timestamp" << timestamp;
+        return timestamp;
+    }
+    return formatTimestamp(msecs - qint64(seconds) * 1000);
+}
+
+bool LDAPMapper::splitDn(const QString &dn, QString *rdnAttribute, QString *rdnValue, QString *parentDn)
+{
+    // RFC 4514: only the first RDN is needed, up to the first unescaped comma
+    int equals = -1;
+    int comma = -1;
+    for (int i = 0; i < dn.size() && comma < 0; ++i) {
+        switch (dn.at(i).unicode()) {
+            case '\\':
+                ++i;
+                break;
+            case '=':
+                if (equals < 0) {
+                    equals = i;
+                }
+                break;
+            case '+':
+                // multi-valued RDN
+                return false;
+            case ',':
+                comma = i;
+                break;
+        }
+    }
+    if (equals <= 0 || comma < 0) {
+        return false;
+    }
+
+    // only unescaped spaces around the value are insignificant, so trim after unescaping
+    const QString value = dn.mid(equals + 1, comma - equals - 1);
+    int start = 0;
+    while (start < value.size() && value.at(start) == QLatin1Char(' ')) {
+        ++start;
+    }
+    if (start < value.size() && value.at(start) == QLatin1Char('#')) {
+        // BER encoded value
+        return false;
+    }
+
+    // hex escapes are bytes of the UTF-8 encoded value, so everything is collected as bytes
+    // and decoded at once. Unescaped parts are converted as a whole to keep surrogate pairs
+    QByteArray unescaped;
+    int run = start;
+    for (int i = start; i < value.size(); ++i) {
+        if (value.at(i) != QLatin1Char('\\') || i + 1 >= value.size()) {
+            continue;
+        }
+        unescaped += value.mid(run, i - run).toUtf8();
+
+        if (i + 2 < value.size() && isxdigit(value.at(i + 1).toLatin1()) && isxdigit(value.at(i + 2).toLatin1())) {
+            unescaped += char(value.mid(i + 1, 2).toInt(0, 16));
+            i += 2;
+        } else {
+            const int length = value.at(i + 1).isHighSurrogate() && i + 2 < value.size() ? 2 : 1;
+            unescaped += value.mid(i + 1, length).toUtf8();
+            i += length;
+        }
+        run = i + 1;
+    }
+    int end = value.size();
+    while (end > run && value.at(end - 1) == QLatin1Char(' ')) {
+        --end;
+    }
+    unescaped += value.mid(run, end - run).toUtf8();
+
+    *rdnAttribute = dn.left(equals).trimmed();
+    *rdnValue = QString::fromUtf8(unescaped);
+    *parentDn = dn.mid(comma + 1).trimmed();
+    return true;
+}
@@ -24,11 +24,65 @@
 class LDAPMapper
 {
 public:
+    /**
+     * Sets which LDAP attribute fills which addressee field, one "attribute=field" entry each,
+     * e.g. "telephoneNumber=workPhone". The mapping is compiled once, and also determines the
+     * requested attributes. An empty list selects the default mapping.
+     * Returns false if an entry is invalid, it is skipped then.
+     */
+    static bool setAttributeMapping(const QStringList &mapping);
+    static QStringList mappedAttributes();
+
+    /**
+     * Identifies the compiled attribute mapping, it changes whenever entries are mapped differently
+     */
+    static QByteArray mappingDigest();
+
     static QStringList requestedFullPayloadAttributes();
     static QStringList requestedLookupPayloadAttributes();
+
+    /**
+     * The full payload attributes plus the potentially large binary ones (photo, certificates),
+     * only requested when a single item is retrieved
+     */
+    static QStringList requestedItemAttributes();
+
+    /**
+     * Binary values larger than @p bytes are ignored, 0 for no limit
+     */
+    static void setMaxBinarySize(int bytes);
     static KABC::Addressee getAddressee(const KLDAP::LdapObject &obj);
     static QString getStableIdentifier(const KLDAP::LdapObject &obj);
+    static QString getStableIdentifier(const QByteArray &syncUUID);
     static QString getTimestamp(const KLDAP::LdapObject &obj);
+
+    /**
+     * modifyTimestamp as milliseconds since the epoch (UTC), -1 if missing or invalid.
+     * Unlike the string, the value orders correctly with fractional seconds and time zone offsets.
+     */
+    static qint64 getTimestampValue(const KLDAP::LdapObject &obj);
+
+    /**
+     * The string and, in @p value, the parsed value of modifyTimestamp, reading the attribute once
+     */
+    static QString getTimestamp(const KLDAP::LdapObject &obj, qint64 *value);
+    static qint64 parseTimestamp(const QByteArray &generalizedTime);
+    static qint64 parseTimestamp(const QString &generalizedTime);
+
+    /**
+     * GeneralizedTime in UTC, with fractional seconds only if needed
+     */
+    static QString formatTimestamp(qint64 msecs);
+    static bool isGroup(const KLDAP::LdapObject &obj);
+    static QByteArray getMembersDigest(const KLDAP::LdapObject &obj);
+
+    /**
+     * Digest of the values of the mapped attributes, changes of other attributes don't change it
+     */
+    static QByteArray getContentDigest(const KLDAP::LdapObject &obj);
+    static QString escapeFilterValue(const QString &value);
+    static QString rewindTimestamp(const QString &timestamp, int seconds);
+    static bool splitDn(const QString &dn, QString *rdnAttribute, QString *rdnValue, QString *parentDn);
     enum Attribute {
         UniqueIdentifier
     };
@@ -16,11 +16,18 @@
  */
 #include "ldapresource.h"
 
+#include "contentdigestattribute.h"
+#include "contentsyncjob.h"
 #include "incrementalupdatejob.h"
+#include "ldapmapper.h"
+#include "membersdigestattribute.h"
+#include "nestedgroupsattribute.h"
+#include "groupmembersattribute.h"
 #include "retrieveitemsjob.h"
 #include "retrieveitemjob.h"
 #include "retrievegroupsjob.h"
 #include "retrievegroupmembersjob.h"
+#include "retrieveallgroupmembersjob.h"
 
 #include "settings.h"
 #include "settingsadaptor.h"
@@ -38,19 +45,34 @@
 #include <kconfigdialog.h>
 #include <klocalizedstring.h>
 #include <kwindowsystem.h>
+#include <Akonadi/AttributeFactory>
 #include <Akonadi/ChangeRecorder>
 using namespace Akonadi;
 
+static const int ContentSyncRetryInterval = 30 * 1000;
+// minutes the full payload of persons is kept when only the lookup part is cached
+static const int FullPayloadCacheTimeout = 60;
+// retry interval of a failed incremental update, another replica may be available by then
+static const int IncrementalUpdateRetryInterval = 30 * 1000;
+
 
 LDAPResource::LDAPResource( const QString &id )
     : ResourceBase( id ),
-      mIncrementalUpdateTimer(new QTimer(this))
+      mIncrementalUpdateTimer(new QTimer(this)),
+      mRemap(false),
+      mApplyScheduled(false)
 {
     new SettingsAdaptor( Settings::self() );
     QDBusConnection::sessionBus().registerObject( QLatin1String( "/Settings" ),
                                 Settings::self(), QDBusConnection::ExportAdaptors );
 
+    AttributeFactory::registerAttribute<MembersDigestAttribute>();
+    AttributeFactory::registerAttribute<ContentDigestAttribute>();
+    AttributeFactory::registerAttribute<NestedGroupsAttribute>();
+    AttributeFactory::registerAttribute<GroupMembersAttribute>();
+
     setNeedsNetwork(true);
+    connect(this, SIGNAL(synchronized()), SLOT(slotSynchronized()));
     loadConfig();
     
     changeRecorder()->itemFetchScope().fetchFullPayload(false);
@@ -74,8 +96,26 @@ LDAPResource::~LDAPResource()
 
 void LDAPResource::loadConfig()
 {
-    mLdapConnection.close();
+    if (mContentSyncJob) {
+        mContentSyncJob->kill();
+        mContentSyncJob = 0;
+    }
+    mSyncConnection.close();
+    mPersonCache.clear();
+    mItemIndex.clear();
+    mGroupsSyncedByPass.clear();
+    mGroupWatermark.clear();
+    mKnownGroups.clear();
     const Settings *s = Settings::self();
+    LDAPMapper::setAttributeMapping(s->attributemapping());
+    // contacts mapped differently are written again by a full synchronization, their
+    // revisions would otherwise let every retrieval skip them
+    mRemap = LDAPMapper::mappingDigest() != s->attributemappingdigest().toLatin1();
+    if (mRemap) {
+        kDebug() << "attribute mapping changed";
+        synchronize();
+    }
+    LDAPMapper::setMaxBinarySize(s->maxbinarysize() * 1024);
     mLdapServer.setHost(s->ldaphost());
     mLdapServer.setPort(s->ldapport());
     mLdapServer.setBaseDn(KLDAP::LdapDN(s->ldapdn()));
@@ -83,31 +123,31 @@ void LDAPResource::loadConfig()
     mLdapServer.setPassword(s->ldappassword());
     mLdapServer.setAuth(KLDAP::LdapServer::Simple);
     mLdapServer.setSecurity(KLDAP::LdapServer::None);
-    kDebug() << s->ldaphost();
+
+    QList<KLDAP::LdapServer> servers;
+    servers << mLdapServer;
+    foreach (const QString &replica, s->ldapreplicas()) {
+        KLDAP::LdapServer server = mLdapServer;
+        const int colon = replica.lastIndexOf(QLatin1Char(':'));
+        bool ok = false;
+        const int port = colon > 0 ? replica.mid(colon + 1).toInt(&ok) : 0;
+        server.setHost(ok ? replica.left(colon).trimmed() : replica.trimmed());
+        server.setPort(ok ? port : s->ldapport());
+        if (!server.host().isEmpty()) {
+            servers << server;
+        }
+    }
+    mConnectionPool.setServers(servers);
+    mConnectionPool.setMaxConnections(s->maxconnections());
+    mConnectionPool.setOperationTimeout(s->operationtimeout());
+    kDebug() << s->ldaphost() << s->ldapreplicas();
     kDebug() << s->ldapdn();
     kDebug() << s->ldapbinddn();
 
     mIncrementalUpdateTimer->setInterval(s->incrementalupdateinterval() * 60 * 1000);
     setName(s->name());
-}
 
-bool LDAPResource::connectToServer()
-{
-    mLdapConnection.setServer(mLdapServer);
-    if (mLdapConnection.handle()) {
-        kWarning() << "already connected";
-        return true;
-    }
-    
-    //This doesn't really open a connection, so we have to test ourselves if the server is available
-    if (mLdapConnection.connect()) {
-        kWarning() << mLdapConnection.connectionError();
-        kWarning() << "failed to connect to server";
-        return false;
-    }
-    Q_ASSERT(mLdapConnection.handle());
-    kWarning() << "Connected";
-    return true;
+    QTimer::singleShot(0, this, SLOT(startContentSync()));
 }
 
 void LDAPResource::retrieveCollections()
@@ -123,25 +163,22 @@ void LDAPResource::retrieveCollections()
     policy.setInheritFromParent(false);
     policy.setSyncOnDemand(true);
 
-    // TODO: not indefinite if offlinemode == false?
-    policy.setCacheTimeout(-1);
-
-    // TODO: revisit when there is actually big enough difference between
-    // the different parts in terms of what the LDAP queries provide
-#if 0
+    // synchronization only provides the lookup attributes unless in offline mode, the full
+    // payload is fetched by retrieveItem() when needed and expires after a while
     QStringList localParts = QStringList() << Akonadi::ContactPart::Lookup;
 
     if (Settings::self()->offlinemode()) {
         localParts << Akonadi::Item::FullPayload;
+        policy.setCacheTimeout(-1);
+    } else {
+        policy.setCacheTimeout(FullPayloadCacheTimeout);
     }
-#else
-    QStringList localParts = QStringList() << Akonadi::Item::FullPayload;
-#endif
 
     policy.setLocalParts(localParts);
 
-    // cache policy interval is in minutes, config in hours
-    const int fullUpdateInterval = Settings::self()->fullupdateinterval() * 60;
+    // cache policy interval is in minutes, config in hours.
+    // content synchronization also reports deletions, so no periodic full updates are needed
+    const int fullUpdateInterval = Settings::self()->syncmode() == Settings::Polling ? Settings::self()->fullupdateinterval() * 60 : 0;
     policy.setIntervalCheckTime(fullUpdateInterval == 0 ? -1 : fullUpdateInterval);
 
     root.setCachePolicy(policy);
@@ -158,13 +195,33 @@ void LDAPResource::retrieveCollections()
         collectionsRetrieved( Collection::List() << root );
         return;
     }
-    if (!connectToServer()) {
+    ConnectionRequest *request = mConnectionPool.requestConnection(this);
+    request->setProperty("root", QVariant::fromValue(root));
+    connect(request, SIGNAL(result(KJob*)), SLOT(retrieveCollectionsConnected(KJob*)));
+}
+
+void LDAPResource::retrieveCollectionsConnected(KJob *request)
+{
+    const Collection root = request->property("root").value<Collection>();
+    KLDAP::LdapConnection *connection = static_cast<ConnectionRequest*>(request)->connection();
+    if (!connection) {
         emit error( QLatin1String("Failed to retrieve collections.") );
         collectionsRetrieved( Collection::List() << root );
         kWarning() << "Failed to connect";
         return;
     }
-    RetrieveGroupsJob *retrieveJob = new RetrieveGroupsJob(mLdapServer.baseDn().toString(), root, mLdapConnection, this);
+    RetrieveGroupsJob *retrieveJob = new RetrieveGroupsJob(mLdapServer.baseDn().toString(), root, *connection, this);
+    mConnectionPool.checkinWhenFinished(retrieveJob, connection);
+    retrieveJob->setLinkMembers(Settings::self()->linkgroupmembers());
+
+    // only groups changed since the last listing, unless removed groups should be found as well
+    const int fullUpdateInterval = Settings::self()->fullupdateinterval() * 60 * 60 * 1000;
+    const bool fullListing = mGroupWatermark.isEmpty() ||
+                             (fullUpdateInterval > 0 && mGroupListingTimer.elapsed() > fullUpdateInterval);
+    if (!fullListing) {
+        retrieveJob->setChangedSince(mGroupWatermark, Settings::self()->updateoverlap(), mKnownGroups);
+    }
+    retrieveJob->setProperty("fullListing", fullListing);
     retrieveJob->setProperty("root", QVariant::fromValue(root));
     connect(retrieveJob, SIGNAL(result(KJob*)), SLOT(slotGroupsRetrievalResult(KJob*)));
 }
@@ -180,7 +237,22 @@ void LDAPResource::slotGroupsRetrievalResult(KJob* job)
         Collection::List collections;
         collections << root;
         collections << retrieveJob->retrievedCollections();
-        collectionsRetrieved( collections );
+
+        mGroupWatermark = retrieveJob->mostRecentTimestamp();
+        if (job->property("fullListing").toBool()) {
+            mKnownGroups.clear();
+        }
+        foreach (const Collection &collection, retrieveJob->retrievedCollections()) {
+            mKnownGroups.insert(collection.remoteId(), collection);
+        }
+
+        if (job->property("fullListing").toBool()) {
+            mGroupListingTimer.start();
+            collectionsRetrieved( collections );
+        } else {
+            kDebug() << collections.count() - 1 << "groups changed since" << mGroupWatermark;
+            collectionsRetrievedIncremental( collections, Collection::List() );
+        }
     }
 }
 
@@ -188,34 +260,92 @@ void LDAPResource::retrieveItems( const Akonadi::Collection &collection )
 {
     kWarning() << collection.remoteId();
     Q_UNUSED( collection );
-    //Make an item synch also trigger a refetch of the collections
+    //Make an item synch also trigger a refetch of the collections, which only
+    //lists the groups changed since the last time
     synchronizeCollectionTree();
 
+    // a single pass for all groups, the other group collections are then already up to date
+    if (collection.parentCollection() != Collection::root() && Settings::self()->syncallgroupsatonce() &&
+        mGroupsSyncedByPass.remove(collection.id()) && mGroupsSyncedByPassTimer.elapsed() < GroupPassValidity) {
+        kDebug() << "already synchronized";
+        itemsRetrievalDone();
+        return;
+    }
+
     // TODO: this method is called when Akonadi wants to know about all the
     // items in the given collection. You can but don't have to provide all the
     // data for each item, remote ID and MIME type are enough at this stage.
     // Depending on how your resource accesses the data, there are several
     // different ways to tell Akonadi when you are done.
-    if (!connectToServer()) {
+    ConnectionRequest *request = mConnectionPool.requestConnection(this);
+    request->setProperty("collection", QVariant::fromValue(collection));
+    connect(request, SIGNAL(result(KJob*)), SLOT(retrieveItemsConnected(KJob*)));
+}
+
+void LDAPResource::retrieveItemsConnected(KJob *request)
+{
+    const Collection collection = request->property("collection").value<Collection>();
+    KLDAP::LdapConnection *connection = static_cast<ConnectionRequest*>(request)->connection();
+    if (!connection) {
         cancelTask(i18n( "Failed to retrieve collection '%1' is invalid.", collection.remoteId()));
         kWarning() << "Failed to connect";
         return;
     }
 
-    const bool fullPayload = collection.cachePolicy().localParts().contains(Akonadi::Item::FullPayload);
+    // group collections inherit the cache policy of the top level collection, so they keep the full
+    // payload of their members in offline mode only. Otherwise the group jobs store the members
+    // without payload, which retrieveItem() provides when a client asks for it.
+    const bool fullPayload = Settings::self()->offlinemode();
 
     if (collection.parentCollection() == Collection::root()) {
-        RetrieveItemsJob *job = new RetrieveItemsJob(mLdapServer.baseDn().toString(), collection, mLdapConnection, this);
+        mItemIndex.invalidate(collection);
+        RetrieveItemsJob *job = new RetrieveItemsJob(mLdapServer.baseDn().toString(), collection, *connection, this);
+        mConnectionPool.checkinWhenFinished(job, connection);
         if (fullPayload) {
             job->setFetchScope(RetrieveItemsJob::FullPayload);
         }
+        job->setPageSize(Settings::self()->pagesize());
+        job->setBatchSize(Settings::self()->batchsize());
+        job->setPersonCache(&mPersonCache);
+        job->setIgnoreLocalRevisions(mRemap);
+        if (Settings::self()->partitionedfullsync()) {
+            // the job holds one of the connections itself
+            job->setPartitioned(&mConnectionPool, Settings::self()->maxconnections() - 1);
+        }
         connect(job, SIGNAL(result(KJob*)), SLOT(slotItemsRetrievalResult(KJob*)));
+    } else if (Settings::self()->syncallgroupsatonce()) {
+        mItemIndex.invalidateGroups(collection.parentCollection());
+        RetrieveAllGroupMembersJob *job = new RetrieveAllGroupMembersJob(mLdapServer.baseDn().toString(), collection.parentCollection(), *connection, this);
+        mConnectionPool.checkinWhenFinished(job, connection);
+        if (fullPayload) {
+            job->setFetchScope(RetrieveGroupMembersJob::FullPayload);
+        }
+        job->setMaxConcurrentSearches(Settings::self()->maxconcurrentsearches());
+        job->setBatchSize(Settings::self()->batchsize());
+        job->setPersonCache(&mPersonCache);
+        job->setMaxNestingDepth(Settings::self()->nestedgroupdepth());
+        job->setLinkMembers(Settings::self()->linkgroupmembers());
+        job->setItemIndex(&mItemIndex);
+        job->setIgnoreLocalRevisions(mRemap);
+        job->setProperty("collectionId", collection.id());
+        connect(job, SIGNAL(result(KJob*)), SLOT(slotAllGroupMembersRetrievalResult(KJob*)));
     } else {
         //Groups
-        RetrieveGroupMembersJob *job = new RetrieveGroupMembersJob(mLdapServer.baseDn().toString(), collection, mLdapConnection, this);
+        mItemIndex.invalidate(collection);
+        RetrieveGroupMembersJob *job = new RetrieveGroupMembersJob(mLdapServer.baseDn().toString(), collection, *connection, this);
+        mConnectionPool.checkinWhenFinished(job, connection);
         if (fullPayload) {
             job->setFetchScope(RetrieveGroupMembersJob::FullPayload);
         }
+        job->setMaxConcurrentSearches(Settings::self()->maxconcurrentsearches());
+        job->setBatchSize(Settings::self()->batchsize());
+        job->setPersonCache(&mPersonCache);
+        job->setMaxNestingDepth(Settings::self()->nestedgroupdepth());
+        job->setLinkMembers(Settings::self()->linkgroupmembers());
+        job->setItemIndex(&mItemIndex);
+        job->setMemberOfLookup(Settings::self()->memberoflookup());
+        job->setPageSize(Settings::self()->pagesize());
+        job->setIgnoreLocalRevisions(mRemap);
         connect(job, SIGNAL(result(KJob*)), SLOT(slotItemsRetrievalResult(KJob*)));
     }
 }
@@ -231,21 +361,52 @@ void LDAPResource::slotItemsRetrievalResult (KJob* job)
     }
 }
 
+void LDAPResource::slotAllGroupMembersRetrievalResult(KJob *job)
+{
+    if (!job->error()) {
+        RetrieveAllGroupMembersJob *retrieveJob = static_cast<RetrieveAllGroupMembersJob*>(job);
+        mGroupsSyncedByPass = retrieveJob->synchronizedCollections().toSet();
+        mGroupsSyncedByPass.remove(job->property("collectionId").value<Akonadi::Collection::Id>());
+        mGroupsSyncedByPassTimer.start();
+    }
+
+    slotItemsRetrievalResult(job);
+}
+
+void LDAPResource::slotSynchronized()
+{
+    if (mRemap) {
+        // all collections have been written with the current mapping
+        mRemap = false;
+        Settings::self()->setAttributemappingdigest(QString::fromLatin1(LDAPMapper::mappingDigest()));
+        Settings::self()->writeConfig();
+    }
+}
+
 bool LDAPResource::retrieveItem( const Akonadi::Item &item, const QSet<QByteArray> &parts )
 {
-    Q_UNUSED( parts );
     kDebug() << parts << item.remoteId();
-    if (!connectToServer()) {
+    ConnectionRequest *request = mConnectionPool.requestConnection(this);
+    request->setProperty("item", QVariant::fromValue(item));
+    connect(request, SIGNAL(result(KJob*)), SLOT(retrieveItemConnected(KJob*)));
+    return true;
+}
+
+void LDAPResource::retrieveItemConnected(KJob *request)
+{
+    const Item item = request->property("item").value<Item>();
+    KLDAP::LdapConnection *connection = static_cast<ConnectionRequest*>(request)->connection();
+    if (!connection) {
         kWarning() << "Failed to connect";
-        return false;
+        cancelTask(i18n("Failed to connect to the server."));
+        return;
     }
 
-    // TODO: this method is called when Akonadi wants more data for a given item.
-    // You can only provide the parts that have been requested but you are allowed
-    // to provide all in one go
-    RetrieveItemJob *job = new RetrieveItemJob(mLdapServer.baseDn().toString(), item, mLdapConnection, this);
+    // the lookup part is a subset of the full payload, so the full payload is provided
+    // whichever part has been requested
+    RetrieveItemJob *job = new RetrieveItemJob(mLdapServer.baseDn().toString(), item, *connection, this);
+    mConnectionPool.checkinWhenFinished(job, connection);
     connect(job, SIGNAL(result(KJob*)), SLOT(slotItemRetrievalResult(KJob*)));
-    return true;
 }
 
 void LDAPResource::slotItemRetrievalResult (KJob* job)
@@ -267,7 +428,79 @@ void LDAPResource::incrementalUpdateTask(const QVariant &params)
 {
     Q_UNUSED(params);
 
-    IncrementalUpdateJob *job = new IncrementalUpdateJob(identifier(), mLdapServer.baseDn().toString(), mLdapConnection, this);
+    switch (Settings::self()->syncmode()) {
+        case Settings::RefreshOnly: {
+            ConnectionRequest *request = mConnectionPool.requestConnection(this);
+            connect(request, SIGNAL(result(KJob*)), SLOT(refreshConnected(KJob*)));
+            return;
+        }
+
+        case Settings::RefreshAndPersist:
+            // the timer only serves as a watchdog for the persistent search
+            if (!mContentSyncJob) {
+                startContentSync();
+            }
+            incrementalUpdateResult(0);
+            return;
+
+        default:
+            break;
+    }
+
+    ConnectionRequest *request = mConnectionPool.requestConnection(this);
+    connect(request, SIGNAL(result(KJob*)), SLOT(incrementalUpdateConnected(KJob*)));
+}
+
+void LDAPResource::refreshConnected(KJob *request)
+{
+    KLDAP::LdapConnection *connection = static_cast<ConnectionRequest*>(request)->connection();
+    if (!connection) {
+        kWarning() << "Failed to connect";
+        retryIncrementalUpdate();
+        return;
+    }
+    const QString replica = connection->server().host();
+    ContentSyncJob *job = new ContentSyncJob(ContentSyncJob::RefreshOnly, mLdapServer.baseDn().toString(), *connection, this);
+    mConnectionPool.checkinWhenFinished(job, connection);
+    job->setCookie(syncCookie(replica));
+    job->setProperty("replica", replica);
+    job->setFullPayload(Settings::self()->offlinemode());
+    connect(job, SIGNAL(result(KJob*)), this, SLOT(contentSyncResult(KJob*)));
+}
+
+void LDAPResource::incrementalUpdateConnected(KJob *request)
+{
+    KLDAP::LdapConnection *connection = static_cast<ConnectionRequest*>(request)->connection();
+    if (!connection) {
+        kWarning() << "Failed to connect";
+        retryIncrementalUpdate();
+        return;
+    }
+
+    const QString replica = connection->server().host();
+    IncrementalUpdateJob *job = new IncrementalUpdateJob(identifier(), mLdapServer.baseDn().toString(), *connection, this);
+    mConnectionPool.checkinWhenFinished(job, connection);
+    job->setMaxConcurrentSearches(Settings::self()->maxconcurrentsearches());
+    job->setBatchSize(Settings::self()->batchsize());
+    job->setPersonCache(&mPersonCache);
+    job->setItemIndex(&mItemIndex);
+    job->setMaxNestingDepth(Settings::self()->nestedgroupdepth());
+    job->setLinkMembers(Settings::self()->linkgroupmembers());
+    job->setMemberOfLookup(Settings::self()->memberoflookup());
+    job->setPageSize(Settings::self()->pagesize());
+    job->setFullPayload(Settings::self()->offlinemode());
+    job->setOverlap(Settings::self()->updateoverlap());
+    switch (Settings::self()->deletiondetection()) {
+        case Settings::RetroChangelog:
+            job->setDeletionDetection(RetrieveUpdatesJob::RetroChangelog, lastChangeNumber(replica));
+            job->setProperty("replica", replica);
+            break;
+        case Settings::Tombstones:
+            job->setDeletionDetection(RetrieveUpdatesJob::Tombstones, 0);
+            break;
+        default:
+            break;
+    }
     connect(job, SIGNAL(result(KJob*)), this, SLOT(incrementalUpdateResult(KJob*)));
 
     // TODO progress reporting
@@ -275,17 +508,232 @@ void LDAPResource::incrementalUpdateTask(const QVariant &params)
 
 void LDAPResource::incrementalUpdateResult(KJob *job)
 {
-    Q_UNUSED(job);
+    IncrementalUpdateJob *updateJob = qobject_cast<IncrementalUpdateJob*>(job);
+    if (updateJob && !job->error() && job->property("replica").isValid()) {
+        saveLastChangeNumber(updateJob->lastChangeNumber(), job->property("replica").toString());
+    }
 
+    // only failed searches are tried again before the next interval, other errors
+    // (e.g. no full update yet) wouldn't go away
+    const bool searchFailed = updateJob ? job->error() == IncrementalUpdateJob::SearchFailed
+                                        : job->error() == ContentSyncJob::SearchFailed;
+    if (searchFailed) {
+        retryIncrementalUpdate();
+        return;
+    }
+    if (job->error()) {
+        kWarning() << job->errorString();
+    }
     taskDone();
     mIncrementalUpdateTimer->start();
 }
 
+void LDAPResource::retryIncrementalUpdate()
+{
+    taskDone();
+    // don't wait for the next interval, another replica may take over
+    QTimer::singleShot(IncrementalUpdateRetryInterval, this, SLOT(scheduleIncrementalUpdateTask()));
+}
+
+void LDAPResource::startContentSync()
+{
+    if (mContentSyncJob || Settings::self()->syncmode() != Settings::RefreshAndPersist || mLdapServer.host().isEmpty()) {
+        return;
+    }
+
+    mSyncConnection.setServer(mConnectionPool.preferredServer());
+    if (!mSyncConnection.handle() && mSyncConnection.connect()) {
+        kWarning() << mSyncConnection.connectionError();
+        kWarning() << "failed to connect to server";
+        QTimer::singleShot(ContentSyncRetryInterval, this, SLOT(startContentSync()));
+        return;
+    }
+    mConnectionPool.applyOperationTimeout(mSyncConnection);
+
+    kDebug() << "starting content synchronization";
+    const QString replica = mSyncConnection.server().host();
+    mContentSyncJob = new ContentSyncJob(ContentSyncJob::RefreshAndPersist, mLdapServer.baseDn().toString(), mSyncConnection, this);
+    mContentSyncJob->setCookie(syncCookie(replica));
+    mContentSyncJob->setProperty("replica", replica);
+    mContentSyncJob->setFullPayload(Settings::self()->offlinemode());
+    connect(mContentSyncJob, SIGNAL(updatesAvailable()), this, SLOT(contentSyncUpdatesAvailable()));
+    connect(mContentSyncJob, SIGNAL(result(KJob*)), this, SLOT(contentSyncResult(KJob*)));
+}
+
+void LDAPResource::contentSyncUpdatesAvailable()
+{
+    ContentSyncJob *job = qobject_cast<ContentSyncJob*>(sender());
+    Q_ASSERT(job);
+    takeContentSyncUpdates(job);
+}
+
+void LDAPResource::takeContentSyncUpdates(ContentSyncJob *job)
+{
+    mPendingUpdates.append(job->takeUpdates());
+    mPendingCookie = job->cookie();
+    mPendingCookieReplica = job->property("replica").toString();
+
+    // changes arriving while the task is queued are applied along with it
+    if (!mApplyScheduled) {
+        mApplyScheduled = true;
+        scheduleCustomTask(this, "applyUpdatesTask", QVariant());
+    }
+}
+
+void LDAPResource::contentSyncResult(KJob *job)
+{
+    ContentSyncJob *syncJob = static_cast<ContentSyncJob*>(job);
+    if (job->error()) {
+        kWarning() << job->errorString();
+    }
+
+    if (syncJob == mContentSyncJob) {
+        kWarning() << "content synchronization stopped";
+        mContentSyncJob = 0;
+        mSyncConnection.close();
+
+        // apply what has been received so far
+        takeContentSyncUpdates(syncJob);
+        QTimer::singleShot(ContentSyncRetryInterval, this, SLOT(startContentSync()));
+    }
+
+    if (job->error() == ContentSyncJob::RefreshRequired) {
+        // the cookie is no longer valid, start over with a complete refresh
+        mPendingCookie.clear();
+        saveSyncCookie(QByteArray(), job->property("replica").toString());
+    }
+
+    if (Settings::self()->syncmode() != Settings::RefreshOnly) {
+        return;
+    }
+
+    // refresh only
+    if (job->error()) {
+        incrementalUpdateResult(job);
+        return;
+    }
+
+    mPendingUpdates.append(syncJob->takeUpdates());
+    mPendingCookie = syncJob->cookie();
+    mPendingCookieReplica = job->property("replica").toString();
+    ConnectionRequest *request = mConnectionPool.requestConnection(this);
+    connect(request, SIGNAL(result(KJob*)), SLOT(applyUpdatesConnected(KJob*)));
+}
+
+void LDAPResource::applyUpdatesTask(const QVariant &params)
+{
+    Q_UNUSED(params);
+    mApplyScheduled = false;
+
+    if (mPendingUpdates.isEmpty()) {
+        if (!mPendingCookie.isEmpty()) {
+            saveSyncCookie(mPendingCookie, mPendingCookieReplica);
+        }
+        taskDone();
+        return;
+    }
+
+    ConnectionRequest *request = mConnectionPool.requestConnection(this);
+    connect(request, SIGNAL(result(KJob*)), SLOT(applyUpdatesConnected(KJob*)));
+}
+
+void LDAPResource::applyUpdatesConnected(KJob *request)
+{
+    KLDAP::LdapConnection *connection = static_cast<ConnectionRequest*>(request)->connection();
+    if (!connection) {
+        kWarning() << "Failed to connect";
+        if (Settings::self()->syncmode() == Settings::RefreshOnly) {
+            // the cookie has not been saved, so the server sends the changes again
+            mPendingUpdates.clear();
+            mPendingCookie.clear();
+            retryIncrementalUpdate();
+        } else {
+            taskDone();
+        }
+        return;
+    }
+
+    IncrementalUpdateJob *job = new IncrementalUpdateJob(identifier(), mLdapServer.baseDn().toString(), *connection, this);
+    mConnectionPool.checkinWhenFinished(job, connection);
+    job->setMaxConcurrentSearches(Settings::self()->maxconcurrentsearches());
+    job->setBatchSize(Settings::self()->batchsize());
+    job->setPersonCache(&mPersonCache);
+    job->setItemIndex(&mItemIndex);
+    job->setMaxNestingDepth(Settings::self()->nestedgroupdepth());
+    job->setLinkMembers(Settings::self()->linkgroupmembers());
+    job->setMemberOfLookup(Settings::self()->memberoflookup());
+    job->setPageSize(Settings::self()->pagesize());
+    job->setFullPayload(Settings::self()->offlinemode());
+    job->setUpdates(mPendingUpdates);
+    job->setProperty("cookie", mPendingCookie);
+    job->setProperty("replica", mPendingCookieReplica);
+    mPendingUpdates.clear();
+    mPendingCookie.clear();
+    connect(job, SIGNAL(result(KJob*)), this, SLOT(applyUpdatesResult(KJob*)));
+}
+
+void LDAPResource::applyUpdatesResult(KJob *job)
+{
+    if (job->error()) {
+        kWarning() << job->errorString();
+    } else if (!job->property("cookie").toByteArray().isEmpty()) {
+        // only remember how far we got once the changes are in Akonadi
+        saveSyncCookie(job->property("cookie").toByteArray(), job->property("replica").toString());
+    }
+
+    taskDone();
+    if (Settings::self()->syncmode() == Settings::RefreshOnly) {
+        mIncrementalUpdateTimer->start();
+    }
+}
+
+QByteArray LDAPResource::syncCookie(const QString &replica) const
+{
+    // the content synchronization state of one replica means nothing to the others.
+    // Without a replica it was saved before they were told apart, by the configured host
+    const QString owner = Settings::self()->synccookiereplica();
+    if ((owner.isEmpty() ? mLdapServer.host() : owner) != replica) {
+        return QByteArray();
+    }
+    return QByteArray::fromBase64(Settings::self()->synccookie().toLatin1());
+}
+
+void LDAPResource::saveSyncCookie(const QByteArray &cookie, const QString &replica)
+{
+    Settings::self()->setSynccookie(QString::fromLatin1(cookie.toBase64()));
+    Settings::self()->setSynccookiereplica(replica);
+    Settings::self()->writeConfig();
+}
+
+qint64 LDAPResource::lastChangeNumber(const QString &replica) const
+{
+    // change numbers are counted by each replica on its own, 0 starts at the current one
+    const QString owner = Settings::self()->lastchangenumberreplica();
+    if ((owner.isEmpty() ? mLdapServer.host() : owner) != replica) {
+        return 0;
+    }
+    return Settings::self()->lastchangenumber();
+}
+
+void LDAPResource::saveLastChangeNumber(qint64 changeNumber, const QString &replica)
+{
+    if (Settings::self()->lastchangenumberreplica() == replica && Settings::self()->lastchangenumber() == changeNumber) {
+        return;
+    }
+    Settings::self()->setLastchangenumber(changeNumber);
+    Settings::self()->setLastchangenumberreplica(replica);
+    Settings::self()->writeConfig();
+}
+
 void LDAPResource::aboutToQuit()
 {
     // TODO: any cleanup you need to do while there is still an active
     // event loop. The resource will terminate after this method returns
-    mLdapConnection.close();
+    if (mContentSyncJob) {
+        mContentSyncJob->kill();
+    }
+    mSyncConnection.close();
+    mConnectionPool.clear();
 }
 
 void LDAPResource::configure( WId windowId )
@@ -18,10 +18,21 @@
 #ifndef LDAPRESOURCE_H
 #define LDAPRESOURCE_H
 
+#include "incrementalupdatedata.h"
+#include "itemindex.h"
+#include "ldapconnectionpool.h"
+#include "personcache.h"
+
 #include <akonadi/resourcebase.h>
 #include <KLDAP/LdapServer>
 #include <KLDAP/LdapSearch>
 
+#include <QElapsedTimer>
+#include <QPointer>
+#include <QSet>
+
+class ContentSyncJob;
+
 class LDAPResource: public Akonadi::ResourceBase,
                     public Akonadi::AgentBase::Observer
 {
@@ -43,19 +54,67 @@ protected:
     virtual void aboutToQuit();
     
 private Q_SLOTS:
+    void retrieveCollectionsConnected(KJob *request);
+    void retrieveItemsConnected(KJob *request);
+    void retrieveItemConnected(KJob *request);
     void slotGroupsRetrievalResult (KJob* job);
     void slotItemsRetrievalResult (KJob* job);
+    void slotAllGroupMembersRetrievalResult(KJob *job);
     void slotItemRetrievalResult (KJob* job);
+    void slotSynchronized();
     void scheduleIncrementalUpdateTask();
     void incrementalUpdateTask(const QVariant &params);
+    void refreshConnected(KJob *request);
+    void incrementalUpdateConnected(KJob *request);
     void incrementalUpdateResult(KJob *job);
+    void contentSyncResult(KJob *job);
+    void contentSyncUpdatesAvailable();
+    void applyUpdatesTask(const QVariant &params);
+    void applyUpdatesConnected(KJob *request);
+    void applyUpdatesResult(KJob *job);
+    void startContentSync();
 
 private:
     void loadConfig();
-    bool connectToServer();
+    QByteArray syncCookie(const QString &replica) const;
+    void saveSyncCookie(const QByteArray &cookie, const QString &replica);
+    qint64 lastChangeNumber(const QString &replica) const;
+    void saveLastChangeNumber(qint64 changeNumber, const QString &replica);
+    void retryIncrementalUpdate();
+    void takeContentSyncUpdates(ContentSyncJob *job);
     KLDAP::LdapServer mLdapServer;
-    KLDAP::LdapConnection mLdapConnection;
+    // one connection per running job, see LdapConnectionPool
+    LdapConnectionPool mConnectionPool;
     QTimer *mIncrementalUpdateTimer;
+
+    // persons seen by full and incremental updates, by DN
+    PersonCache mPersonCache;
+
+    // locations of the local persons, kept between incremental updates
+    ItemIndex mItemIndex;
+
+    // the attribute mapping changed since the stored contacts were written
+    bool mRemap;
+
+    // group collections already synchronized by the last pass over all groups
+    QSet<Akonadi::Collection::Id> mGroupsSyncedByPass;
+    QElapsedTimer mGroupsSyncedByPassTimer;
+    static const int GroupPassValidity = 5*60*1000;
+
+    // most recent modifyTimestamp of all groups in the collection tree, and the groups having it
+    QString mGroupWatermark;
+    // by remote id, as last retrieved
+    QHash<QString, Akonadi::Collection> mKnownGroups;
+    QElapsedTimer mGroupListingTimer;
+
+    // content synchronization (RFC 4533)
+    KLDAP::LdapConnection mSyncConnection;
+    QPointer<ContentSyncJob> mContentSyncJob;
+    UpdateData mPendingUpdates;
+    QByteArray mPendingCookie;
+    // host of the replica mPendingCookie came from
+    QString mPendingCookieReplica;
+    bool mApplyScheduled;
 };
 
 #endif
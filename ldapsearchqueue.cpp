@@ -0,0 +1,532 @@
+/*
+ * Copyright (C) 2014 Klaralvdalens Datakonsult AB <info@kdab.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ldapsearchqueue.h"
+
+#include "ldapmapper.h"
+
+#include <KLDAP/LdapOperation>
+
+#include <kdebug.h>
+
+#include <QSocketNotifier>
+#include <QVector>
+
+#include <ldap.h>
+
+// connection -> its scheduler
+static QHash<KLDAP::LdapConnection*, LdapSearchScheduler*> s_schedulers;
+
+static KLDAP::LdapObject toObject(LDAP *ld, LDAPMessage *msg)
+{
+    KLDAP::LdapObject obj;
+    char *dn = ldap_get_dn(ld, msg);
+    obj.setDn(KLDAP::LdapDN(QString::fromUtf8(dn)));
+    ldap_memfree(dn);
+
+    BerElement *entry = 0;
+    for (char *name = ldap_first_attribute(ld, msg, &entry); name; name = ldap_next_attribute(ld, msg, entry)) {
+        const QString attributeName = QString::fromUtf8(name);
+        struct berval **values = ldap_get_values_len(ld, msg, name);
+        for (int i = 0; values && values[i]; ++i) {
+            obj.addValue(attributeName, QByteArray(values[i]->bv_val, values[i]->bv_len));
+        }
+        ldap_value_free_len(values);
+        ldap_memfree(name);
+    }
+    ber_free(entry, 0);
+    return obj;
+}
+
+LdapSearchQueue::LdapSearchQueue(KLDAP::LdapConnection &connection, QObject *parent)
+:   QObject(parent),
+    mScheduler(LdapSearchScheduler::acquire(connection)),
+    mBatchSize(DefaultBatchSize),
+    mOutstanding(0),
+    mFinishScheduled(false),
+    mError(0)
+{
+    Q_ASSERT(connection.handle());
+}
+
+LdapSearchQueue::~LdapSearchQueue()
+{
+    mScheduler->cancel(this);
+    mScheduler->release();
+}
+
+void LdapSearchQueue::setMaxConcurrentSearches(int count)
+{
+    mScheduler->setMaxConcurrentSearches(count);
+}
+
+int LdapSearchQueue::maxConcurrentSearches() const
+{
+    return mScheduler->maxConcurrentSearches();
+}
+
+void LdapSearchQueue::search(const KLDAP::LdapDN &base, KLDAP::LdapUrl::Scope scope,
+                             const QString &filter, const QStringList &attributes, int pageSize)
+{
+    Request request;
+    request.base = base;
+    request.scope = scope;
+    request.filter = filter;
+    request.attributes = attributes;
+    request.pageSize = qMax(0, pageSize);
+    request.missingIsEmpty = false;
+    enqueue(request);
+}
+
+void LdapSearchQueue::enqueue(const Request &request)
+{
+    if (mError) {
+        return;
+    }
+
+    ++mOutstanding;
+    mScheduler->enqueue(this, request);
+}
+
+void LdapSearchQueue::setBatchSize(int size)
+{
+    mBatchSize = qMax(1, size);
+}
+
+void LdapSearchQueue::searchDns(const QStringList &dns, const QStringList &attributes)
+{
+    QStringList parents;
+    QHash<QString, QStringList> filtersByParent;
+
+    // a dangling member DN must not fail the searches of all others
+    Request request;
+    request.attributes = attributes;
+    request.pageSize = 0;
+    request.missingIsEmpty = true;
+
+    foreach (const QString &dn, dns) {
+        QString attribute;
+        QString value;
+        QString parent;
+        if (!LDAPMapper::splitDn(dn, &attribute, &value, &parent)) {
+            kDebug() << "cannot batch" << dn;
+            request.base = KLDAP::LdapDN(dn);
+            request.scope = KLDAP::LdapUrl::Base;
+            request.filter.clear();
+            enqueue(request);
+            continue;
+        }
+
+        QHash<QString, QStringList>::iterator it = filtersByParent.find(parent);
+        if (it == filtersByParent.end()) {
+            parents << parent;
+            it = filtersByParent.insert(parent, QStringList());
+        }
+        it->append(QString::fromLatin1("(%1=%2)").arg(attribute).arg(LDAPMapper::escapeFilterValue(value)));
+    }
+
+    foreach (const QString &parent, parents) {
+        const QStringList filters = filtersByParent.value(parent);
+        for (int i = 0; i < filters.count(); i += mBatchSize) {
+            request.base = KLDAP::LdapDN(parent);
+            request.scope = KLDAP::LdapUrl::One;
+            request.filter = QLatin1String("(|") + QStringList(filters.mid(i, mBatchSize)).join(QString()) + QLatin1String(")");
+            enqueue(request);
+        }
+    }
+}
+
+bool LdapSearchQueue::isIdle() const
+{
+    return mOutstanding == 0;
+}
+
+int LdapSearchQueue::error() const
+{
+    return mError;
+}
+
+QString LdapSearchQueue::errorString() const
+{
+    return mErrorString;
+}
+
+void LdapSearchQueue::emitFinished()
+{
+    mFinishScheduled = false;
+    if (mOutstanding == 0) {
+        emit finished();
+    }
+}
+
+void LdapSearchQueue::gotEntry(const KLDAP::LdapObject &obj)
+{
+    if (!mError) {
+        emit data(obj);
+    }
+}
+
+void LdapSearchQueue::searchDone(int error, const QString &errorString)
+{
+    --mOutstanding;
+    if (error && !mError) {
+        kWarning() << error << errorString;
+        setError(error, errorString);
+    }
+
+    if (mOutstanding == 0 && !mFinishScheduled) {
+        emit finished();
+    }
+}
+
+void LdapSearchQueue::sendFailed(int error, const QString &errorString)
+{
+    --mOutstanding;
+    if (!mError) {
+        kWarning() << error << errorString;
+        setError(error, errorString);
+    }
+
+    // the caller might still be queueing, report asynchronously
+    if (!mFinishScheduled) {
+        mFinishScheduled = true;
+        QMetaObject::invokeMethod(this, "emitFinished", Qt::QueuedConnection);
+    }
+}
+
+void LdapSearchQueue::setError(int error, const QString &errorString)
+{
+    mError = error ? error : LDAP_OPERATIONS_ERROR;
+    mErrorString = errorString;
+
+    // the remaining searches are of no use any more
+    mOutstanding -= mScheduler->cancel(this);
+}
+
+LdapSearchScheduler *LdapSearchScheduler::acquire(KLDAP::LdapConnection &connection)
+{
+    LdapSearchScheduler *scheduler = s_schedulers.value(&connection);
+    if (!scheduler) {
+        scheduler = new LdapSearchScheduler(connection);
+        s_schedulers.insert(&connection, scheduler);
+    }
+    ++scheduler->mRefCount;
+    return scheduler;
+}
+
+void LdapSearchScheduler::release()
+{
+    if (--mRefCount > 0) {
+        return;
+    }
+
+    // a new scheduler for the same connection must not see a second notifier on the socket
+    s_schedulers.remove(&mConnection);
+    delete mNotifier;
+    mNotifier = 0;
+
+    // might be called from within readMessages()
+    deleteLater();
+}
+
+LdapSearchScheduler::LdapSearchScheduler(KLDAP::LdapConnection &connection)
+:   QObject(0),
+    mConnection(connection),
+    mRefCount(0),
+    mMaxConcurrentSearches(LdapSearchQueue::DefaultMaxConcurrentSearches),
+    mBound(false),
+    mNotifier(0),
+    mTimeout(0)
+{
+    mTimeoutTimer.setSingleShot(true);
+    connect(&mTimeoutTimer, SIGNAL(timeout()), this, SLOT(searchesTimedOut()));
+}
+
+LdapSearchScheduler::~LdapSearchScheduler()
+{
+    Q_ASSERT(mRunning.isEmpty());
+    delete mNotifier;
+}
+
+void LdapSearchScheduler::setMaxConcurrentSearches(int count)
+{
+    mMaxConcurrentSearches = qMax(1, count);
+    startSearches();
+}
+
+int LdapSearchScheduler::maxConcurrentSearches() const
+{
+    return mMaxConcurrentSearches;
+}
+
+void LdapSearchScheduler::enqueue(LdapSearchQueue *queue, const LdapSearchQueue::Request &request)
+{
+    PendingSearch pending;
+    pending.queue = queue;
+    pending.request = request;
+    mPending << pending;
+
+    startSearches();
+}
+
+int LdapSearchScheduler::cancel(LdapSearchQueue *queue)
+{
+    int count = 0;
+    for (int i = mPending.count() - 1; i >= 0; --i) {
+        if (mPending.at(i).queue == queue) {
+            mPending.removeAt(i);
+            ++count;
+        }
+    }
+
+    LDAP *ld = static_cast<LDAP*>(mConnection.handle());
+    QHash<int, PendingSearch>::iterator it = mRunning.begin();
+    while (it != mRunning.end()) {
+        if (it->queue == queue) {
+            ldap_abandon_ext(ld, it.key(), 0, 0);
+            it = mRunning.erase(it);
+            ++count;
+        } else {
+            ++it;
+        }
+    }
+
+    if (count > 0) {
+        startSearches();
+    }
+    return count;
+}
+
+bool LdapSearchScheduler::bind()
+{
+    if (mBound) {
+        return true;
+    }
+
+    // nothing is outstanding yet, so the bind cannot abandon anything
+    Q_ASSERT(mRunning.isEmpty());
+    KLDAP::LdapOperation op(mConnection);
+    if (op.bind_s() != 0) {
+        return false;
+    }
+    mBound = true;
+
+    LDAP *ld = static_cast<LDAP*>(mConnection.handle());
+    struct timeval *timeout = 0;
+    if (ldap_get_option(ld, LDAP_OPT_TIMEOUT, &timeout) == LDAP_OPT_SUCCESS && timeout) {
+        mTimeout = timeout->tv_sec * 1000 + timeout->tv_usec / 1000;
+        ldap_memfree(timeout);
+    }
+
+    int fd = -1;
+    ldap_get_option(ld, LDAP_OPT_DESC, &fd);
+    mNotifier = new QSocketNotifier(fd, QSocketNotifier::Read, this);
+    connect(mNotifier, SIGNAL(activated(int)), this, SLOT(readMessages()));
+    return true;
+}
+
+void LdapSearchScheduler::startSearches()
+{
+    if (mPending.isEmpty() || mRunning.count() >= mMaxConcurrentSearches || mRefCount == 0) {
+        return;
+    }
+
+    if (!bind()) {
+        kWarning() << "bind failed" << mConnection.ldapErrorString();
+        const QList<PendingSearch> pending = mPending;
+        mPending.clear();
+        foreach (const PendingSearch &search, pending) {
+            search.queue->sendFailed(mConnection.ldapErrorCode(), mConnection.ldapErrorString());
+        }
+        return;
+    }
+
+    const bool wasIdle = mRunning.isEmpty();
+    while (!mPending.isEmpty() && mRunning.count() < mMaxConcurrentSearches) {
+        const PendingSearch search = mPending.takeFirst();
+        int msgId = -1;
+        const int ret = sendSearch(search.request, &msgId);
+        if (ret != LDAP_SUCCESS) {
+            search.queue->sendFailed(ret, QString::fromUtf8(ldap_err2string(ret)));
+            continue;
+        }
+        mRunning.insert(msgId, search);
+    }
+    if (mTimeout > 0 && wasIdle && !mRunning.isEmpty()) {
+        mTimeoutTimer.start(mTimeout);
+    }
+
+    // libldap might hold answers already, which the notifier does not report
+    QMetaObject::invokeMethod(this, "readMessages", Qt::QueuedConnection);
+}
+
+int LdapSearchScheduler::sendSearch(const LdapSearchQueue::Request &request, int *msgId)
+{
+    LDAP *ld = static_cast<LDAP*>(mConnection.handle());
+
+    QList<QByteArray> attributes;
+    foreach (const QString &attribute, request.attributes) {
+        attributes << attribute.toUtf8();
+    }
+    QVector<char*> attrs;
+    for (int i = 0; i < attributes.count(); ++i) {
+        attrs << attributes[i].data();
+    }
+    attrs << 0;
+
+    int scope = LDAP_SCOPE_SUBTREE;
+    if (request.scope == KLDAP::LdapUrl::Base) {
+        scope = LDAP_SCOPE_BASE;
+    } else if (request.scope == KLDAP::LdapUrl::One) {
+        scope = LDAP_SCOPE_ONELEVEL;
+    }
+
+    const QByteArray base = request.base.toString().toUtf8();
+    const QByteArray filter = request.filter.isEmpty() ? QByteArray("(objectClass=*)") : request.filter.toUtf8();
+
+    LDAPControl *pageControl = 0;
+    if (request.pageSize > 0) {
+        struct berval cookie;
+        cookie.bv_len = request.cookie.size();
+        cookie.bv_val = const_cast<char*>(request.cookie.constData());
+        const int ret = ldap_create_page_control(ld, request.pageSize, &cookie, 0, &pageControl);
+        if (ret != LDAP_SUCCESS) {
+            return ret;
+        }
+    }
+    LDAPControl *controls[] = { pageControl, 0 };
+
+    const int ret = ldap_search_ext(ld, base.constData(), scope, filter.constData(),
+                                    attributes.isEmpty() ? 0 : attrs.data(), 0,
+                                    pageControl ? controls : 0, 0, 0, 0, msgId);
+    if (pageControl) {
+        ldap_control_free(pageControl);
+    }
+    return ret;
+}
+
+void LdapSearchScheduler::readMessages()
+{
+    LDAP *ld = static_cast<LDAP*>(mConnection.handle());
+    struct timeval timeout = { 0, 0 };
+
+    // take whatever is available for any of the searches, reading one of them
+    // might have buffered answers to the others
+    bool gotMessage = true;
+    while (gotMessage && !mRunning.isEmpty() && mRefCount > 0) {
+        gotMessage = false;
+        foreach (int msgId, mRunning.keys()) {
+            LDAPMessage *message = 0;
+            // the search might have been cancelled in the meantime
+            while (mRunning.contains(msgId) && ldap_result(ld, msgId, LDAP_MSG_ONE, &timeout, &message) > 0) {
+                gotMessage = true;
+                if (mTimeout > 0) {
+                    // the server is alive
+                    mTimeoutTimer.start(mTimeout);
+                }
+                processMessage(msgId, message);
+                ldap_msgfree(message);
+                message = 0;
+            }
+        }
+    }
+}
+
+void LdapSearchScheduler::searchesTimedOut()
+{
+    if (mRunning.isEmpty()) {
+        return;
+    }
+    kWarning() << "no answer from the server within" << mTimeout << "ms";
+
+    LDAP *ld = static_cast<LDAP*>(mConnection.handle());
+    const QHash<int, PendingSearch> running = mRunning;
+    mRunning.clear();
+    for (QHash<int, PendingSearch>::const_iterator it = running.constBegin(); it != running.constEnd(); ++it) {
+        ldap_abandon_ext(ld, it.key(), 0, 0);
+    }
+    foreach (const PendingSearch &search, running) {
+        search.queue->searchDone(LDAP_TIMEOUT, QString::fromUtf8(ldap_err2string(LDAP_TIMEOUT)));
+    }
+}
+
+void LdapSearchScheduler::processMessage(int msgId, void *message)
+{
+    LDAP *ld = static_cast<LDAP*>(mConnection.handle());
+    LDAPMessage *msg = static_cast<LDAPMessage*>(message);
+
+    switch (ldap_msgtype(msg)) {
+        case LDAP_RES_SEARCH_ENTRY:
+            mRunning.value(msgId).queue->gotEntry(toObject(ld, msg));
+            break;
+
+        case LDAP_RES_SEARCH_RESULT: {
+            PendingSearch search = mRunning.take(msgId);
+            int errorCode = LDAP_OTHER;
+            char *errorMessage = 0;
+            LDAPControl **controls = 0;
+            if (ldap_parse_result(ld, msg, &errorCode, 0, &errorMessage, 0, &controls, 0) != LDAP_SUCCESS) {
+                errorCode = LDAP_OTHER;
+            }
+
+            // an empty cookie marks the last page
+            QByteArray cookie;
+            if (errorCode == LDAP_SUCCESS && search.request.pageSize > 0) {
+                if (LDAPControl *pageControl = ldap_control_find(LDAP_CONTROL_PAGEDRESULTS, controls, 0)) {
+                    ber_int_t count = 0;
+                    struct berval nextCookie = { 0, 0 };
+                    if (ldap_parse_pageresponse_control(ld, pageControl, &count, &nextCookie) == LDAP_SUCCESS) {
+                        cookie = QByteArray(nextCookie.bv_val, nextCookie.bv_len);
+                        ber_memfree(nextCookie.bv_val);
+                    }
+                }
+            }
+            ldap_controls_free(controls);
+
+            if (errorCode == LDAP_NO_SUCH_OBJECT && search.request.missingIsEmpty) {
+                kDebug() << "no such object" << search.request.base.toString();
+                errorCode = LDAP_SUCCESS;
+            }
+
+            if (!cookie.isEmpty()) {
+                ldap_memfree(errorMessage);
+                // ahead of everything else, the server keeps state for it
+                search.request.cookie = cookie;
+                mPending.prepend(search);
+                startSearches();
+                break;
+            }
+
+            QString errorText;
+            if (errorCode != LDAP_SUCCESS) {
+                errorText = QString::fromUtf8(ldap_err2string(errorCode));
+                if (errorMessage && *errorMessage) {
+                    errorText += QLatin1String(": ") + QString::fromUtf8(errorMessage);
+                }
+            }
+            ldap_memfree(errorMessage);
+
+            // send the next one before the queue reacts, it might be done with everything
+            startSearches();
+            search.queue->searchDone(errorCode, errorText);
+            break;
+        }
+
+        default:
+            kDebug() << "ignoring message of type" << ldap_msgtype(msg);
+    }
+}
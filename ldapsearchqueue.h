@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) 2014 Klaralvdalens Datakonsult AB <info@kdab.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LDAPSEARCHQUEUE_H
+#define LDAPSEARCHQUEUE_H
+
+#include <KLDAP/LdapConnection>
+#include <KLDAP/LdapObject>
+#include <KLDAP/LdapUrl>
+
+#include <QHash>
+#include <QList>
+#include <QObject>
+#include <QStringList>
+#include <QTimer>
+
+class LdapSearchScheduler;
+class QSocketNotifier;
+
+/**
+ * Runs a number of searches on one connection, keeping several of them in flight instead of
+ * waiting for each result before sending the next request.
+ *
+ * All queues on the same connection share one LdapSearchScheduler, so the limit of searches
+ * in flight applies to the connection, no matter how many nested jobs run their own queue.
+ *
+ * Entries are delivered through data() as they arrive, so entries of different searches
+ * can interleave. finished() is emitted once all queued searches are done, or after the
+ * first failed search, in which case the remaining ones are dropped.
+ */
+class LdapSearchQueue : public QObject
+{
+    Q_OBJECT
+public:
+    static const int DefaultMaxConcurrentSearches = 16;
+    static const int DefaultBatchSize = 100;
+
+    explicit LdapSearchQueue(KLDAP::LdapConnection &connection, QObject *parent = 0);
+    ~LdapSearchQueue();
+
+    /**
+     * Maximum number of searches in flight on the connection, shared by all queues on it
+     */
+    void setMaxConcurrentSearches(int count);
+    int maxConcurrentSearches() const;
+
+    /**
+     * Maximum number of entries requested by a single search of searchDns()
+     */
+    void setBatchSize(int size);
+
+    /**
+     * With a @p pageSize the entries are requested in pages of that size using the simple
+     * paged results control (RFC 2696), so the search is not cut short by the server's size limit
+     */
+    void search(const KLDAP::LdapDN &base, KLDAP::LdapUrl::Scope scope,
+                const QString &filter, const QStringList &attributes, int pageSize = 0);
+
+    /**
+     * Fetches the entries with the given @p dns. Entries below the same parent are requested
+     * with one level searches for (|(rdn=value)...), batchSize at a time, instead of one base
+     * search per entry. Entries which do not exist are silently missing from the result, even
+     * if their parent is gone as well.
+     */
+    void searchDns(const QStringList &dns, const QStringList &attributes);
+
+    /**
+     * Whether there are neither running nor queued searches
+     */
+    bool isIdle() const;
+
+    /**
+     * The LDAP result code of the first failed search
+     */
+    int error() const;
+    QString errorString() const;
+
+Q_SIGNALS:
+    void data(const KLDAP::LdapObject &obj);
+    void finished();
+
+private Q_SLOTS:
+    void emitFinished();
+
+private:
+    friend class LdapSearchScheduler;
+
+    struct Request {
+        KLDAP::LdapDN base;
+        KLDAP::LdapUrl::Scope scope;
+        QString filter;
+        QStringList attributes;
+        int pageSize;
+        // of the next page
+        QByteArray cookie;
+        // LDAP_NO_SUCH_OBJECT means an empty result instead of an error
+        bool missingIsEmpty;
+    };
+
+    void enqueue(const Request &request);
+
+    // called by the scheduler
+    void gotEntry(const KLDAP::LdapObject &obj);
+    void searchDone(int error, const QString &errorString);
+    void sendFailed(int error, const QString &errorString);
+    void setError(int error, const QString &errorString);
+
+    LdapSearchScheduler *mScheduler;
+    int mBatchSize;
+
+    // sent or waiting in the scheduler
+    int mOutstanding;
+    bool mFinishScheduled;
+
+    int mError;
+    QString mErrorString;
+};
+
+/**
+ * Sends the searches of all LdapSearchQueues on one connection.
+ *
+ * The connection is bound once, before the first search. Each KLDAP::LdapSearch binds
+ * before its search, which abandons all operations outstanding on the connection
+ * (RFC 4511, 4.2.1), so the searches are sent with libldap directly and their results
+ * are read by message id as the socket becomes readable.
+ *
+ * If the connection has a timeout (LDAP_OPT_TIMEOUT) and no answer arrives within it,
+ * the running searches fail, so a hung server doesn't stall the jobs waiting for them.
+ */
+class LdapSearchScheduler : public QObject
+{
+    Q_OBJECT
+public:
+    /**
+     * The scheduler of @p connection, created on first use. Each call has to be
+     * matched by release().
+     */
+    static LdapSearchScheduler *acquire(KLDAP::LdapConnection &connection);
+    void release();
+
+    void setMaxConcurrentSearches(int count);
+    int maxConcurrentSearches() const;
+
+    void enqueue(LdapSearchQueue *queue, const LdapSearchQueue::Request &request);
+
+    /**
+     * Drops the waiting and abandons the running searches of @p queue, returns how many
+     */
+    int cancel(LdapSearchQueue *queue);
+
+private Q_SLOTS:
+    void readMessages();
+    void searchesTimedOut();
+
+private:
+    explicit LdapSearchScheduler(KLDAP::LdapConnection &connection);
+    ~LdapSearchScheduler();
+
+    bool bind();
+    void startSearches();
+    int sendSearch(const LdapSearchQueue::Request &request, int *msgId);
+    void processMessage(int msgId, void *message);
+
+    struct PendingSearch {
+        LdapSearchQueue *queue;
+        LdapSearchQueue::Request request;
+    };
+
+    KLDAP::LdapConnection &mConnection;
+    int mRefCount;
+    int mMaxConcurrentSearches;
+    bool mBound;
+    QList<PendingSearch> mPending;
+    // message id -> the search
+    QHash<int, PendingSearch> mRunning;
+    QSocketNotifier *mNotifier;
+    // msecs, 0 without a timeout
+    int mTimeout;
+    QTimer mTimeoutTimer;
+};
+
+#endif // LDAPSEARCHQUEUE_H
@@ -0,0 +1,366 @@
+/*
+ * Copyright (C) 2014 Klaralvdalens Datakonsult AB <info@kdab.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "linkgroupmembersjob.h"
+
+#include "itemindex.h"
+
+#include <KABC/Addressee>
+#include <KABC/ContactGroup>
+
+#include <akonadi/itemcreatejob.h>
+#include <akonadi/itemfetchjob.h>
+#include <akonadi/itemfetchscope.h>
+#include <akonadi/itemmodifyjob.h>
+#include <akonadi/linkjob.h>
+#include <akonadi/transactionsequence.h>
+#include <akonadi/unlinkjob.h>
+
+#include <kdebug.h>
+
+LinkGroupMembersJob::LinkGroupMembersJob(const Akonadi::Collection &groupCollection, const Akonadi::Item::List &members, QObject *parent)
+:   KJob(parent),
+    mGroupCollection(groupCollection),
+    mTopLevelCollection(groupCollection.parentCollection()),
+    mMembers(members),
+    mTransaction(0),
+    mItemIndex(0),
+    mFetchedAllTopLevelItems(false),
+    mPendingLinkJobs(0)
+{
+    // autostart like an Akonadi::Job
+    QMetaObject::invokeMethod(this, "start", Qt::QueuedConnection);
+}
+
+void LinkGroupMembersJob::setContactGroup(const Akonadi::Item &contactGroup)
+{
+    mContactGroup = contactGroup;
+}
+
+void LinkGroupMembersJob::setItemIndex(ItemIndex *itemIndex)
+{
+    mItemIndex = itemIndex;
+}
+
+void LinkGroupMembersJob::start()
+{
+    Akonadi::ItemFetchJob *fetchJob = new Akonadi::ItemFetchJob(mGroupCollection, this);
+    fetchJob->fetchScope().setFetchModificationTime(false);
+    fetchJob->fetchScope().setCacheOnly(true);
+    fetchJob->fetchScope().fetchFullPayload(false);
+    connect(fetchJob, SIGNAL(result(KJob*)), this, SLOT(linkedFetchDone(KJob*)));
+}
+
+void LinkGroupMembersJob::linkedFetchDone(KJob *job)
+{
+    if (job->error()) {
+        kWarning() << job->errorString();
+        setError(KJob::UserDefinedError);
+        emitResult();
+        return;
+    }
+
+    foreach (const Akonadi::Item &item, static_cast<Akonadi::ItemFetchJob*>(job)->items()) {
+        mLinkedItems.insert(item.id(), item);
+    }
+
+    if (mItemIndex && mItemIndex->isIndexed(mTopLevelCollection)) {
+        lookupTopLevelItems();
+        return;
+    }
+    fetchTopLevelItems(false);
+}
+
+void LinkGroupMembersJob::lookupTopLevelItems()
+{
+    QStringList remoteIds;
+    foreach (const Akonadi::Item &member, mMembers) {
+        if (!member.isValid()) {
+            remoteIds << member.remoteId();
+        }
+    }
+    if (!mContactGroup.remoteId().isEmpty()) {
+        remoteIds << mContactGroup.remoteId();
+    }
+
+    foreach (const QString &remoteId, remoteIds) {
+        foreach (const Akonadi::Item &item, mItemIndex->items(remoteId, mTopLevelCollection)) {
+            if (item.parentCollection() == mTopLevelCollection) {
+                mTopLevelItems.insert(remoteId, item);
+            }
+        }
+    }
+
+    writeMembers();
+}
+
+void LinkGroupMembersJob::fetchTopLevelItems(bool all)
+{
+    Akonadi::ItemFetchJob *fetchJob = 0;
+    if (all) {
+        mFetchedAllTopLevelItems = true;
+        fetchJob = new Akonadi::ItemFetchJob(mTopLevelCollection, this);
+    } else {
+        Akonadi::Item::List items;
+        foreach (const Akonadi::Item &member, mMembers) {
+            if (!member.isValid()) {
+                Akonadi::Item item;
+                item.setRemoteId(member.remoteId());
+                items << item;
+            }
+        }
+        if (!mContactGroup.remoteId().isEmpty()) {
+            Akonadi::Item item;
+            item.setRemoteId(mContactGroup.remoteId());
+            items << item;
+        }
+
+        if (items.isEmpty()) {
+            writeMembers();
+            return;
+        }
+        fetchJob = new Akonadi::ItemFetchJob(items, this);
+        fetchJob->setCollection(mTopLevelCollection);
+    }
+
+    fetchJob->fetchScope().setFetchModificationTime(false);
+    fetchJob->fetchScope().setCacheOnly(true);
+    fetchJob->fetchScope().fetchFullPayload(false);
+    connect(fetchJob, SIGNAL(result(KJob*)), this, SLOT(topLevelFetchDone(KJob*)));
+}
+
+void LinkGroupMembersJob::topLevelFetchDone(KJob *job)
+{
+    if (job->error()) {
+        if (!mFetchedAllTopLevelItems) {
+            // e.g. a new member which is not stored yet, find out which ones exist the long way
+            kDebug() << job->errorString();
+            fetchTopLevelItems(true);
+            return;
+        }
+        kWarning() << job->errorString();
+        setError(KJob::UserDefinedError);
+        emitResult();
+        return;
+    }
+
+    const Akonadi::Item::List items = static_cast<Akonadi::ItemFetchJob*>(job)->items();
+    foreach (const Akonadi::Item &item, items) {
+        mTopLevelItems.insert(item.remoteId(), item);
+    }
+    if (mFetchedAllTopLevelItems && mItemIndex) {
+        // the following groups don't have to list it again
+        mItemIndex->setItems(mTopLevelCollection, items);
+    }
+
+    writeMembers();
+}
+
+void LinkGroupMembersJob::writeMembers()
+{
+    foreach (const Akonadi::Item &member, mMembers) {
+        if (member.isValid()) {
+            mMemberIds.insert(member.id());
+            continue;
+        }
+
+        const Akonadi::Item existing = mTopLevelItems.value(member.remoteId());
+        if (existing.isValid()) {
+            mMemberIds.insert(existing.id());
+            if (member.hasPayload() && existing.remoteRevision() != member.remoteRevision()) {
+                Akonadi::Item item = member;
+                item.setId(existing.id());
+                item.setParentCollection(mTopLevelCollection);
+                new Akonadi::ItemModifyJob(item, transaction());
+                mModifiedItems << item;
+            }
+        } else if (member.hasPayload()) {
+            Akonadi::ItemCreateJob *createJob = new Akonadi::ItemCreateJob(member, mTopLevelCollection, transaction());
+            connect(createJob, SIGNAL(result(KJob*)), this, SLOT(createDone(KJob*)));
+        } else {
+            kDebug() << "not stored locally" << member.remoteId();
+        }
+    }
+    mMembers.clear();
+
+    if (!mTransaction) { // no jobs created here -> continue with the contact group
+        writeContactGroup();
+    } else {
+        mTransaction->commit();
+    }
+}
+
+void LinkGroupMembersJob::createDone(KJob *job)
+{
+    if (!job->error()) {
+        const Akonadi::Item item = static_cast<Akonadi::ItemCreateJob*>(job)->item();
+        mMemberIds.insert(item.id());
+        if (mItemIndex) {
+            mItemIndex->insert(item);
+        }
+    }
+}
+
+void LinkGroupMembersJob::transactionDone(KJob *job)
+{
+    if (job->error()) {
+        kWarning() << job->errorString();
+        setError(KJob::UserDefinedError);
+        emitResult();
+        return;
+    }
+
+    if (mItemIndex) {
+        foreach (const Akonadi::Item &item, mModifiedItems) {
+            mItemIndex->update(item);
+        }
+    }
+    mModifiedItems.clear();
+
+    writeContactGroup();
+}
+
+void LinkGroupMembersJob::writeContactGroup()
+{
+    if (mContactGroup.remoteId().isEmpty()) {
+        updateLinks();
+        return;
+    }
+
+    bool membersChanged = false;
+    int linkedPersons = 0;
+    foreach (const Akonadi::Item &item, mLinkedItems) {
+        if (item.mimeType() == KABC::Addressee::mimeType()) {
+            ++linkedPersons;
+            membersChanged = membersChanged || !mMemberIds.contains(item.id());
+        }
+    }
+    membersChanged = membersChanged || linkedPersons != mMemberIds.count();
+
+    Akonadi::Item existing = mTopLevelItems.value(mContactGroup.remoteId());
+    if (mContactGroup.isValid()) {
+        existing = mLinkedItems.value(mContactGroup.id(), mContactGroup);
+    }
+
+    if (existing.isValid() && !membersChanged && existing.remoteRevision() == mContactGroup.remoteRevision()) {
+        kDebug() << "skipping " << mContactGroup.remoteId();
+        mMemberIds.insert(existing.id());
+        updateLinks();
+        return;
+    }
+
+    // the references are resolved within the top level collection
+    KABC::ContactGroup group = mContactGroup.payload<KABC::ContactGroup>();
+    group.removeAllContactReferences();
+    foreach (Akonadi::Item::Id id, mMemberIds) {
+        KABC::ContactGroup::ContactReference reference;
+        reference.setUid(QString::number(id));
+        group.append(reference);
+    }
+    mContactGroup.setPayload(group);
+
+    if (existing.isValid()) {
+        mContactGroup.setId(existing.id());
+        Akonadi::ItemModifyJob *modifyJob = new Akonadi::ItemModifyJob(mContactGroup, this);
+        connect(modifyJob, SIGNAL(result(KJob*)), this, SLOT(contactGroupDone(KJob*)));
+    } else {
+        Akonadi::ItemCreateJob *createJob = new Akonadi::ItemCreateJob(mContactGroup, mTopLevelCollection, this);
+        connect(createJob, SIGNAL(result(KJob*)), this, SLOT(contactGroupDone(KJob*)));
+    }
+}
+
+void LinkGroupMembersJob::contactGroupDone(KJob *job)
+{
+    if (job->error()) {
+        kWarning() << job->errorString();
+
+        // try to proceed as far as possible
+    } else if (Akonadi::ItemCreateJob *createJob = qobject_cast<Akonadi::ItemCreateJob*>(job)) {
+        mMemberIds.insert(createJob->item().id());
+        if (mItemIndex) {
+            mItemIndex->insert(createJob->item());
+        }
+    } else {
+        mMemberIds.insert(mContactGroup.id());
+        if (mItemIndex) {
+            mItemIndex->update(mContactGroup);
+        }
+    }
+
+    updateLinks();
+}
+
+void LinkGroupMembersJob::updateLinks()
+{
+    Akonadi::Item::List toLink;
+    foreach (Akonadi::Item::Id id, mMemberIds) {
+        if (!mLinkedItems.contains(id)) {
+            toLink << Akonadi::Item(id);
+        }
+    }
+
+    Akonadi::Item::List toUnlink;
+    foreach (const Akonadi::Item &item, mLinkedItems) {
+        if (mMemberIds.contains(item.id())) {
+            continue;
+        }
+        // without a contact group to write, the existing one stays
+        if (item.mimeType() == KABC::ContactGroup::mimeType() && mContactGroup.remoteId().isEmpty()) {
+            continue;
+        }
+        toUnlink << item;
+    }
+
+    kDebug() << mGroupCollection.name() << "linking" << toLink.count() << "unlinking" << toUnlink.count();
+
+    if (!toLink.isEmpty()) {
+        ++mPendingLinkJobs;
+        Akonadi::LinkJob *linkJob = new Akonadi::LinkJob(mGroupCollection, toLink, this);
+        connect(linkJob, SIGNAL(result(KJob*)), this, SLOT(linkDone(KJob*)));
+    }
+    if (!toUnlink.isEmpty()) {
+        ++mPendingLinkJobs;
+        Akonadi::UnlinkJob *unlinkJob = new Akonadi::UnlinkJob(mGroupCollection, toUnlink, this);
+        connect(unlinkJob, SIGNAL(result(KJob*)), this, SLOT(linkDone(KJob*)));
+    }
+
+    if (mPendingLinkJobs == 0) {
+        emitResult();
+    }
+}
+
+void LinkGroupMembersJob::linkDone(KJob *job)
+{
+    if (job->error()) {
+        kWarning() << job->errorString();
+        setError(KJob::UserDefinedError);
+    }
+
+    if (--mPendingLinkJobs == 0) {
+        emitResult();
+    }
+}
+
+Akonadi::TransactionSequence *LinkGroupMembersJob::transaction()
+{
+    if (!mTransaction) {
+        mTransaction = new Akonadi::TransactionSequence(this);
+        mTransaction->setAutomaticCommittingEnabled(false);
+        connect(mTransaction, SIGNAL(result(KJob*)), SLOT(transactionDone(KJob*)));
+    }
+    return mTransaction;
+}
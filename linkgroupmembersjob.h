@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2014 Klaralvdalens Datakonsult AB <info@kdab.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LINKGROUPMEMBERSJOB_H
+#define LINKGROUPMEMBERSJOB_H
+
+#include <akonadi/collection.h>
+#include <akonadi/item.h>
+
+#include <kjob.h>
+
+#include <QHash>
+#include <QSet>
+
+namespace Akonadi {
+    class TransactionSequence;
+}
+
+class ItemIndex;
+
+/**
+ * Makes the items linked into a virtual group collection match the given members.
+ *
+ * Members are real items of the top level collection, each person is stored there only once.
+ * Members with a payload are created or updated there if needed, members without a payload
+ * are expected to exist already. Persons which are no longer members are unlinked.
+ *
+ * If a contact group item is set, it is stored in the top level collection as well, references
+ * the members and is linked into the group collection.
+ *
+ * The existing items of the top level collection are looked up in the item index if it has
+ * them. Otherwise they are fetched, and if some are missing the whole collection is listed
+ * once and kept in the index for the following groups.
+ */
+class LinkGroupMembersJob : public KJob
+{
+    Q_OBJECT
+public:
+    LinkGroupMembersJob(const Akonadi::Collection &groupCollection, const Akonadi::Item::List &members, QObject *parent = 0);
+
+    void setContactGroup(const Akonadi::Item &contactGroup);
+
+    /**
+     * Look up the items of the top level collection in @p itemIndex, and keep it up to date
+     */
+    void setItemIndex(ItemIndex *itemIndex);
+
+public Q_SLOTS:
+    virtual void start();
+
+private Q_SLOTS:
+    void linkedFetchDone(KJob *job);
+    void topLevelFetchDone(KJob *job);
+    void createDone(KJob *job);
+    void transactionDone(KJob *job);
+    void contactGroupDone(KJob *job);
+    void linkDone(KJob *job);
+
+private:
+    Akonadi::TransactionSequence *transaction();
+    void fetchTopLevelItems(bool all);
+    void lookupTopLevelItems();
+    void writeMembers();
+    void writeContactGroup();
+    void updateLinks();
+
+    const Akonadi::Collection mGroupCollection;
+    const Akonadi::Collection mTopLevelCollection;
+    Akonadi::Item::List mMembers;
+    Akonadi::Item mContactGroup;
+    Akonadi::TransactionSequence *mTransaction;
+    ItemIndex *mItemIndex;
+
+    // id -> items currently linked into the group collection
+    QHash<Akonadi::Item::Id, Akonadi::Item> mLinkedItems;
+    // remote id -> items of the top level collection
+    QHash<QString, Akonadi::Item> mTopLevelItems;
+    bool mFetchedAllTopLevelItems;
+    // written in the transaction, for the item index once it is committed
+    Akonadi::Item::List mModifiedItems;
+    QSet<Akonadi::Item::Id> mMemberIds;
+    int mPendingLinkJobs;
+};
+
+#endif // LINKGROUPMEMBERSJOB_H
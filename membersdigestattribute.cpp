@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2014 Klaralvdalens Datakonsult AB <info@kdab.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "membersdigestattribute.h"
+
+MembersDigestAttribute::MembersDigestAttribute(const QByteArray &digest)
+:   mDigest(digest)
+{
+}
+
+QByteArray MembersDigestAttribute::digest() const
+{
+    return mDigest;
+}
+
+void MembersDigestAttribute::setDigest(const QByteArray &digest)
+{
+    mDigest = digest;
+}
+
+QByteArray MembersDigestAttribute::type() const
+{
+    return "LDAPMEMBERSDIGEST";
+}
+
+Akonadi::Attribute *MembersDigestAttribute::clone() const
+{
+    return new MembersDigestAttribute(mDigest);
+}
+
+QByteArray MembersDigestAttribute::serialized() const
+{
+    return mDigest;
+}
+
+void MembersDigestAttribute::deserialize(const QByteArray &data)
+{
+    mDigest = data;
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2014 Klaralvdalens Datakonsult AB <info@kdab.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MEMBERSDIGESTATTRIBUTE_H
+#define MEMBERSDIGESTATTRIBUTE_H
+
+#include <akonadi/attribute.h>
+
+/**
+ * Digest of the uniqueMember values a group collection was last synchronized with,
+ * see LDAPMapper::getMembersDigest()
+ */
+class MembersDigestAttribute : public Akonadi::Attribute
+{
+public:
+    explicit MembersDigestAttribute(const QByteArray &digest = QByteArray());
+
+    QByteArray digest() const;
+    void setDigest(const QByteArray &digest);
+
+    virtual QByteArray type() const;
+    virtual Attribute *clone() const;
+    virtual QByteArray serialized() const;
+    virtual void deserialize(const QByteArray &data);
+
+private:
+    QByteArray mDigest;
+};
+
+#endif // MEMBERSDIGESTATTRIBUTE_H
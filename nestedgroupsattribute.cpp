@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2014 Klaralvdalens Datakonsult AB <info@kdab.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "nestedgroupsattribute.h"
+
+NestedGroupsAttribute::NestedGroupsAttribute(const QStringList &groupDns)
+:   mGroupDns(groupDns)
+{
+}
+
+QStringList NestedGroupsAttribute::groupDns() const
+{
+    return mGroupDns;
+}
+
+void NestedGroupsAttribute::setGroupDns(const QStringList &groupDns)
+{
+    mGroupDns = groupDns;
+}
+
+QByteArray NestedGroupsAttribute::type() const
+{
+    return "LDAPNESTEDGROUPS";
+}
+
+Akonadi::Attribute *NestedGroupsAttribute::clone() const
+{
+    return new NestedGroupsAttribute(mGroupDns);
+}
+
+QByteArray NestedGroupsAttribute::serialized() const
+{
+    // a DN can't contain an unescaped newline
+    return mGroupDns.join(QLatin1String("\n")).toUtf8();
+}
+
+void NestedGroupsAttribute::deserialize(const QByteArray &data)
+{
+    mGroupDns = QString::fromUtf8(data).split(QLatin1Char('\n'), QString::SkipEmptyParts);
+}
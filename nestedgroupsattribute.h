@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2014 Klaralvdalens Datakonsult AB <info@kdab.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NESTEDGROUPSATTRIBUTE_H
+#define NESTEDGROUPSATTRIBUTE_H
+
+#include <akonadi/attribute.h>
+
+#include <QStringList>
+
+/**
+ * Normalized DNs of the nested groups whose members were expanded into a group collection,
+ * see ResolveMembersJob::nestedGroupDns()
+ */
+class NestedGroupsAttribute : public Akonadi::Attribute
+{
+public:
+    explicit NestedGroupsAttribute(const QStringList &groupDns = QStringList());
+
+    QStringList groupDns() const;
+    void setGroupDns(const QStringList &groupDns);
+
+    virtual QByteArray type() const;
+    virtual Attribute *clone() const;
+    virtual QByteArray serialized() const;
+    virtual void deserialize(const QByteArray &data);
+
+private:
+    QStringList mGroupDns;
+};
+
+#endif // NESTEDGROUPSATTRIBUTE_H
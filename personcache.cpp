@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2014 Klaralvdalens Datakonsult AB <info@kdab.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "personcache.h"
+
+void PersonCache::insert(const QString &dn, const QString &id, const QString &revision)
+{
+    if (dn.isEmpty() || id.isEmpty()) {
+        return;
+    }
+
+    Entry entry;
+    entry.id = id;
+    entry.revision = revision;
+    mEntries.insert(normalizedDn(dn), entry);
+}
+
+bool PersonCache::contains(const QString &dn) const
+{
+    return mEntries.contains(normalizedDn(dn));
+}
+
+PersonCache::Entry PersonCache::value(const QString &dn) const
+{
+    return mEntries.value(normalizedDn(dn));
+}
+
+void PersonCache::clear()
+{
+    mEntries.clear();
+}
+
+QString PersonCache::normalizedDn(const QString &dn)
+{
+    // member values and entry DNs usually only differ in case
+    return dn.toLower();
+}
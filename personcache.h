@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2014 Klaralvdalens Datakonsult AB <info@kdab.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PERSONCACHE_H
+#define PERSONCACHE_H
+
+#include <QHash>
+#include <QString>
+
+/**
+ * Remembers the identifier and revision of every person seen by the resource, by DN.
+ *
+ * Group memberships refer to persons by DN, this allows resolving them to the items
+ * in the top level collection instead of fetching the same persons from the server again.
+ */
+class PersonCache
+{
+public:
+    struct Entry {
+        QString id;
+        QString revision;
+    };
+
+    void insert(const QString &dn, const QString &id, const QString &revision);
+    bool contains(const QString &dn) const;
+    Entry value(const QString &dn) const;
+    void clear();
+
+    /**
+     * The form of @p dn used for lookups
+     */
+    static QString normalizedDn(const QString &dn);
+
+private:
+
+    QHash<QString, Entry> mEntries;
+};
+
+#endif // PERSONCACHE_H
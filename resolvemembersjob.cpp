@@ -0,0 +1,371 @@
+/*
+ * Copyright (C) 2014 Klaralvdalens Datakonsult AB <info@kdab.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "resolvemembersjob.h"
+#include "contentdigestattribute.h"
+
+#include "ldapmapper.h"
+#include "personcache.h"
+
+#include <KABC/Addressee>
+
+#include <akonadi/itemfetchjob.h>
+#include <akonadi/kabc/contactparts.h>
+#include <akonadi/itemfetchscope.h>
+
+#include <kdebug.h>
+
+ResolveMembersJob::ResolveMembersJob(const QStringList &memberDns, const Akonadi::Collection &topLevelCollection,
+                                     KLDAP::LdapConnection &connection, QObject *parent)
+:   KJob(parent),
+    mMemberDns(memberDns),
+    mPageSize(0),
+    mTopLevelCollection(topLevelCollection),
+    mPersonCache(0),
+    mFullPayload(true),
+    mAttributes(LDAPMapper::requestedFullPayloadAttributes()),
+    mSearches(connection),
+    mMaxNestingDepth(0),
+    mDepth(0)
+{
+    connect(&mSearches, SIGNAL(data(KLDAP::LdapObject)),
+            this, SLOT(gotSearchData(KLDAP::LdapObject)));
+    connect(&mSearches, SIGNAL(finished()),
+            this, SLOT(searchesFinished()));
+
+    // autostart like an Akonadi::Job
+    QMetaObject::invokeMethod(this, "start", Qt::QueuedConnection);
+}
+
+void ResolveMembersJob::setPersonCache(PersonCache *personCache)
+{
+    mPersonCache = personCache;
+}
+
+void ResolveMembersJob::setFullPayload(bool full)
+{
+    mFullPayload = full;
+    mAttributes = full ? LDAPMapper::requestedFullPayloadAttributes()
+                       : LDAPMapper::requestedLookupPayloadAttributes();
+}
+
+void ResolveMembersJob::setMaxConcurrentSearches(int count)
+{
+    mSearches.setMaxConcurrentSearches(count);
+}
+
+void ResolveMembersJob::setBatchSize(int size)
+{
+    mSearches.setBatchSize(size);
+}
+
+void ResolveMembersJob::setMaxNestingDepth(int depth)
+{
+    mMaxNestingDepth = depth;
+}
+
+void ResolveMembersJob::setKnownGroups(const QHash<QString, QStringList> &groups)
+{
+    for (QHash<QString, QStringList>::const_iterator it = groups.constBegin(); it != groups.constEnd(); ++it) {
+        mGroups.insert(PersonCache::normalizedDn(it.key()), it.value());
+    }
+}
+
+void ResolveMembersJob::setMemberOf(const QString &groupDn, const QString &searchBase)
+{
+    mMemberOfGroup = groupDn;
+    mSearchBase = searchBase;
+}
+
+void ResolveMembersJob::setPageSize(int pageSize)
+{
+    mPageSize = pageSize;
+}
+
+Akonadi::Item::List ResolveMembersJob::items() const
+{
+    return mItems.values();
+}
+
+QHash<QString, Akonadi::Item> ResolveMembersJob::itemsByDn() const
+{
+    return mItems;
+}
+
+QStringList ResolveMembersJob::expandedMemberDns(const QStringList &memberDns)
+{
+    QStringList result;
+    foreach (const QString &dn, memberDns) {
+        const QString key = PersonCache::normalizedDn(dn);
+        if (!mGroups.contains(key)) {
+            result << dn;
+        } else if (mMaxNestingDepth > 0) {
+            int height = 0;
+            QSet<QString> cycles;
+            result += expandGroup(key, 1, &height, &cycles);
+        }
+    }
+    result.removeDuplicates();
+    return result;
+}
+
+QStringList ResolveMembersJob::nestedGroupDns() const
+{
+    return nestedGroupDns(mMemberDns);
+}
+
+QStringList ResolveMembersJob::nestedGroupDns(const QStringList &memberDns) const
+{
+    QSet<QString> groups;
+    QStringList level = memberDns;
+    for (int depth = 1; depth <= mMaxNestingDepth && !level.isEmpty(); ++depth) {
+        QStringList nextLevel;
+        foreach (const QString &dn, level) {
+            const QString key = PersonCache::normalizedDn(dn);
+            if (mGroups.contains(key) && !groups.contains(key)) {
+                groups.insert(key);
+                nextLevel += mGroups.value(key);
+            }
+        }
+        level = nextLevel;
+    }
+    return groups.toList();
+}
+
+QStringList ResolveMembersJob::expandGroup(const QString &groupDn, int depth, int *height, QSet<QString> *cycles)
+{
+    // levels of groups which may still be expanded, including this one
+    const int levels = mMaxNestingDepth - depth + 1;
+
+    // a complete expansion serves every depth with enough levels left, a truncated one only its own
+    const QHash<QString, Expansion>::const_iterator cached = mExpansions.constFind(groupDn);
+    if (cached != mExpansions.constEnd() &&
+        (cached->levels == levels || (cached->height <= cached->levels && cached->height <= levels))) {
+        *height = cached->height;
+        return cached->persons;
+    }
+    if (mExpanding.contains(groupDn)) {
+        kDebug() << "Ignoring membership cycle through" << groupDn;
+        cycles->insert(groupDn);
+        *height = 0;
+        return QStringList();
+    }
+    mExpanding.insert(groupDn);
+
+    QStringList persons;
+    // groups on the way up which had to be left out below this one
+    QSet<QString> cutCycles;
+    *height = 1;
+    foreach (const QString &dn, mGroups.value(groupDn)) {
+        const QString memberKey = PersonCache::normalizedDn(dn);
+        if (!mGroups.contains(memberKey)) {
+            persons << dn;
+        } else if (depth < mMaxNestingDepth) {
+            int memberHeight = 0;
+            persons += expandGroup(memberKey, depth + 1, &memberHeight, &cutCycles);
+            *height = qMax(*height, memberHeight + 1);
+        } else {
+            // truncated by the nesting depth
+            *height = qMax(*height, levels + 1);
+        }
+    }
+    persons.removeDuplicates();
+
+    mExpanding.remove(groupDn);
+
+    // the members of this group are complete once it is done itself. If a group further up had
+    // to be left out, the result lacks its members and only holds for the current path.
+    cutCycles.remove(groupDn);
+    if (cutCycles.isEmpty()) {
+        Expansion expansion;
+        expansion.persons = persons;
+        expansion.levels = levels;
+        expansion.height = *height;
+        mExpansions.insert(groupDn, expansion);
+    } else {
+        cycles->unite(cutCycles);
+    }
+    return persons;
+}
+
+void ResolveMembersJob::start()
+{
+    if (!mMemberOfGroup.isEmpty()) {
+        // the server also takes care of nested groups. Large groups exceed the server's size limit, so
+        // they are requested in pages
+        kDebug() << "Fetching the members of" << mMemberOfGroup << "from the server";
+        mSearches.search(KLDAP::LdapDN(mSearchBase), KLDAP::LdapUrl::Sub,
+                         QString::fromLatin1("(&(objectClass=inetorgperson)(memberOf=%1))").arg(LDAPMapper::escapeFilterValue(mMemberOfGroup)),
+                         mAttributes, mPageSize);
+        return;
+    }
+
+    resolve(mMemberDns);
+}
+
+void ResolveMembersJob::resolve(const QStringList &dns)
+{
+    Akonadi::Item::List cachedItems;
+    foreach (const QString &dn, dns) {
+        const QString key = PersonCache::normalizedDn(dn);
+        if (mVisited.contains(key)) {
+            continue;
+        }
+        mVisited.insert(key);
+
+        if (mGroups.contains(key)) {
+            mNestedMembers += mGroups.value(key);
+        } else if (mPersonCache && mTopLevelCollection.isValid() && mPersonCache->contains(dn)) {
+            const QString id = mPersonCache->value(dn).id;
+            mCachedMembers.insert(id, dn);
+
+            Akonadi::Item item;
+            item.setRemoteId(id);
+            cachedItems << item;
+        } else {
+            mMissingMembers << dn;
+        }
+    }
+
+    if (cachedItems.isEmpty()) {
+        searchMissingMembers();
+        return;
+    }
+
+    kDebug() << "Looking up" << cachedItems.count() << "of" << dns.count() << "members locally";
+
+    // cache only: asking Akonadi to retrieve missing payloads would end up back in this resource
+    Akonadi::ItemFetchJob *fetchJob = new Akonadi::ItemFetchJob(cachedItems, this);
+    fetchJob->setCollection(mTopLevelCollection);
+    fetchJob->fetchScope().setCacheOnly(true);
+    // unless in offline mode the top level collection keeps only the lookup part
+    if (mFullPayload) {
+        fetchJob->fetchScope().fetchFullPayload(true);
+    } else {
+        fetchJob->fetchScope().fetchPayloadPart(Akonadi::ContactPart::Lookup);
+    }
+    fetchJob->fetchScope().fetchAttribute<ContentDigestAttribute>();
+    connect(fetchJob, SIGNAL(result(KJob*)), this, SLOT(localFetchDone(KJob*)));
+}
+
+void ResolveMembersJob::localFetchDone(KJob *job)
+{
+    if (job->error()) {
+        // e.g. one of the persons is gone, just ask the server for all of them
+        kDebug() << job->errorString();
+        mMissingMembers += mCachedMembers.values();
+        mCachedMembers.clear();
+        searchMissingMembers();
+        return;
+    }
+
+    foreach (const Akonadi::Item &localItem, static_cast<Akonadi::ItemFetchJob*>(job)->items()) {
+        const QString dn = mCachedMembers.take(localItem.remoteId());
+        if (dn.isEmpty()) {
+            continue;
+        }
+
+        if (!localItem.hasPayload<KABC::Addressee>() || localItem.remoteRevision() != mPersonCache->value(dn).revision) {
+            mMissingMembers << dn;
+            continue;
+        }
+
+        Akonadi::Item item;
+        item.setRemoteId(localItem.remoteId());
+        item.setPayload(localItem.payload<KABC::Addressee>());
+        item.setMimeType(KABC::Addressee::mimeType());
+        item.setRemoteRevision(localItem.remoteRevision());
+        if (localItem.hasAttribute<ContentDigestAttribute>()) {
+            item.addAttribute(localItem.attribute<ContentDigestAttribute>()->clone());
+        }
+        mItems.insert(PersonCache::normalizedDn(dn), item);
+    }
+
+    mMissingMembers += mCachedMembers.values();
+    mCachedMembers.clear();
+
+    searchMissingMembers();
+}
+
+void ResolveMembersJob::gotSearchData(const KLDAP::LdapObject &obj)
+{
+    if (LDAPMapper::isGroup(obj)) {
+        QStringList members;
+        foreach (const QByteArray &member, obj.values(QLatin1String("uniqueMember"))) {
+            members << QString::fromUtf8(member);
+        }
+        mGroups.insert(PersonCache::normalizedDn(obj.dn().toString()), members);
+        mNestedMembers += members;
+        return;
+    }
+
+    Akonadi::Item item;
+    item.setRemoteId(LDAPMapper::getStableIdentifier(obj));
+    item.setPayload(LDAPMapper::getAddressee(obj));
+    item.setMimeType(KABC::Addressee::mimeType());
+    item.setRemoteRevision(LDAPMapper::getTimestamp(obj));
+    item.addAttribute(new ContentDigestAttribute(LDAPMapper::getContentDigest(obj)));
+    mItems.insert(PersonCache::normalizedDn(obj.dn().toString()), item);
+
+    if (mPersonCache) {
+        mPersonCache->insert(obj.dn().toString(), item.remoteId(), item.remoteRevision());
+    }
+}
+
+void ResolveMembersJob::searchesFinished()
+{
+    if (mSearches.error()) {
+        kWarning() << mSearches.error() << mSearches.errorString();
+        setError(KJob::UserDefinedError);
+        emitResult();
+        return;
+    }
+
+    finishRound();
+}
+
+void ResolveMembersJob::searchMissingMembers()
+{
+    if (mMissingMembers.isEmpty()) {
+        finishRound();
+        return;
+    }
+
+    // the object class tells groups from persons
+    QStringList attributes = mAttributes;
+    attributes << QLatin1String("objectClass") << QLatin1String("uniqueMember");
+    attributes.removeDuplicates();
+
+    kDebug() << "Fetching" << mMissingMembers.count() << "members from the server";
+    mSearches.searchDns(mMissingMembers, attributes);
+    mMissingMembers.clear();
+}
+
+void ResolveMembersJob::finishRound()
+{
+    const QStringList nestedMembers = mNestedMembers;
+    mNestedMembers.clear();
+
+    if (nestedMembers.isEmpty() || mDepth >= mMaxNestingDepth) {
+        emitResult();
+        return;
+    }
+
+    mDepth++;
+    kDebug() << "Resolving" << nestedMembers.count() << "members of nested groups on level" << mDepth;
+    resolve(nestedMembers);
+}
@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2014 Klaralvdalens Datakonsult AB <info@kdab.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RESOLVEMEMBERSJOB_H
+#define RESOLVEMEMBERSJOB_H
+
+#include "ldapsearchqueue.h"
+
+#include <akonadi/collection.h>
+#include <akonadi/item.h>
+
+#include <kjob.h>
+
+#include <QHash>
+#include <QSet>
+#include <QStringList>
+
+class PersonCache;
+
+/**
+ * Turns the member DNs of a group into person items.
+ *
+ * Members known to the person cache are taken from the top level collection if the
+ * revision stored there is still the one the cache knows about. All others are fetched
+ * from the server, which also updates the cache.
+ *
+ * Members which turn out to be groups are expanded up to the configured nesting depth.
+ * Every DN is resolved at most once per job, no matter how many groups include it, so
+ * cycles end there. Each group is expanded once per job as well, unless the nesting depth
+ * or a cycle cut its expansion short. Known groups (e.g. from a search over all groups) are expanded
+ * without asking the server again.
+ *
+ * The resulting items have no id and no parent collection.
+ */
+class ResolveMembersJob : public KJob
+{
+    Q_OBJECT
+public:
+    ResolveMembersJob(const QStringList &memberDns, const Akonadi::Collection &topLevelCollection,
+                      KLDAP::LdapConnection &connection, QObject *parent = 0);
+
+    void setPersonCache(PersonCache *personCache);
+
+    /**
+     * Whether the members are requested with all mapped attributes, as in offline mode, or with
+     * the lookup attributes only. Members taken from the top level collection are read from the
+     * matching payload part.
+     */
+    void setFullPayload(bool full);
+
+    void setMaxConcurrentSearches(int count);
+    void setBatchSize(int size);
+
+    /**
+     * How many levels of nested groups are expanded, 0 disables the expansion
+     */
+    void setMaxNestingDepth(int depth);
+
+    /**
+     * Groups which are already known, by dn with their member DNs
+     */
+    void setKnownGroups(const QHash<QString, QStringList> &groups);
+
+    /**
+     * Find the members with a single search for the persons whose memberOf attribute
+     * (maintained by the server's memberOf plugin) contains @p groupDn, instead of
+     * resolving member DNs
+     */
+    void setMemberOf(const QString &groupDn, const QString &searchBase);
+
+    /**
+     * Request the persons found through their memberOf attribute in pages of @p pageSize,
+     * 0 disables paging
+     */
+    void setPageSize(int pageSize);
+
+    /**
+     * All items, including the members of nested groups
+     */
+    Akonadi::Item::List items() const;
+
+    /**
+     * The resolved items by member DN, normalized with PersonCache::normalizedDn()
+     */
+    QHash<QString, Akonadi::Item> itemsByDn() const;
+
+    /**
+     * Replaces the groups among @p memberDns with the person DNs they contain
+     */
+    QStringList expandedMemberDns(const QStringList &memberDns);
+
+    /**
+     * The normalized DNs of the groups expanded into the members of the job's member DNs,
+     * or of @p memberDns
+     */
+    QStringList nestedGroupDns() const;
+    QStringList nestedGroupDns(const QStringList &memberDns) const;
+
+public Q_SLOTS:
+    virtual void start();
+
+private Q_SLOTS:
+    void localFetchDone(KJob *job);
+    void gotSearchData(const KLDAP::LdapObject &obj);
+    void searchesFinished();
+
+private:
+    void resolve(const QStringList &dns);
+    void searchMissingMembers();
+    void finishRound();
+    QStringList expandGroup(const QString &groupDn, int depth, int *height, QSet<QString> *cycles);
+
+    const QStringList mMemberDns;
+    QString mMemberOfGroup;
+    QString mSearchBase;
+    int mPageSize;
+    const Akonadi::Collection mTopLevelCollection;
+    PersonCache *mPersonCache;
+    bool mFullPayload;
+    QStringList mAttributes;
+    LdapSearchQueue mSearches;
+
+    // remote id -> dn of the members looked up in the top level collection
+    QHash<QString, QString> mCachedMembers;
+    QStringList mMissingMembers;
+    QHash<QString, Akonadi::Item> mItems;
+
+    int mMaxNestingDepth;
+    // the nesting level currently being resolved, 0 are the direct members
+    int mDepth;
+    // normalized DNs which have been resolved already
+    QSet<QString> mVisited;
+    // normalized dn -> member DNs of all groups found so far
+    QHash<QString, QStringList> mGroups;
+    QStringList mNestedMembers;
+    struct Expansion {
+        QStringList persons;
+        // levels which were left for expanding the group
+        int levels;
+        // levels of nested groups it has, exceeds levels if the expansion was truncated
+        int height;
+    };
+    // normalized group dn -> its expansion, unless a cycle cut it short
+    QHash<QString, Expansion> mExpansions;
+    QSet<QString> mExpanding;
+};
+
+#endif // RESOLVEMEMBERSJOB_H
@@ -0,0 +1,249 @@
+/*
+ * Copyright (C) 2014 Klaralvdalens Datakonsult AB <info@kdab.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "retrieveallgroupmembersjob.h"
+
+#include "ldapmapper.h"
+#include "ldapsearchqueue.h"
+#include "personcache.h"
+#include "resolvemembersjob.h"
+
+#include <kldap/ldapdefs.h>
+
+#include <akonadi/collectionfetchjob.h>
+
+#include <kdebug.h>
+
+RetrieveAllGroupMembersJob::RetrieveAllGroupMembersJob(const QString &searchBase, const Akonadi::Collection &topLevelCollection,
+                                                       KLDAP::LdapConnection &connection, QObject *parent)
+:   KJob(parent),
+    mSearchbase(searchBase),
+    mTopLevelCollection(topLevelCollection),
+    mConnection(connection),
+    mLdapSearch(connection),
+    mFetchScope(RetrieveGroupMembersJob::LookupPayload),
+    mMaxConcurrentSearches(LdapSearchQueue::DefaultMaxConcurrentSearches),
+    mBatchSize(LdapSearchQueue::DefaultBatchSize),
+    mPersonCache(0),
+    mMaxNestingDepth(0),
+    mLinkMembers(false),
+    mItemIndex(0),
+    mIgnoreLocalRevisions(false)
+{
+    Q_ASSERT(connection.handle());
+    connect(&mLdapSearch, SIGNAL(result(KLDAP::LdapSearch*)),
+            this, SLOT(gotSearchResult(KLDAP::LdapSearch*)));
+    connect(&mLdapSearch, SIGNAL(data(KLDAP::LdapSearch*,KLDAP::LdapObject)),
+            this, SLOT(gotSearchData(KLDAP::LdapSearch*,KLDAP::LdapObject)));
+
+    // autostart like an Akonadi::Job
+    QMetaObject::invokeMethod(this, "start", Qt::QueuedConnection);
+}
+
+void RetrieveAllGroupMembersJob::setFetchScope(RetrieveGroupMembersJob::FetchScope fetchScope)
+{
+    mFetchScope = fetchScope;
+}
+
+void RetrieveAllGroupMembersJob::setMaxConcurrentSearches(int count)
+{
+    mMaxConcurrentSearches = count;
+}
+
+void RetrieveAllGroupMembersJob::setBatchSize(int size)
+{
+    mBatchSize = size;
+}
+
+void RetrieveAllGroupMembersJob::setPersonCache(PersonCache *personCache)
+{
+    mPersonCache = personCache;
+}
+
+void RetrieveAllGroupMembersJob::setMaxNestingDepth(int depth)
+{
+    mMaxNestingDepth = depth;
+}
+
+void RetrieveAllGroupMembersJob::setLinkMembers(bool link)
+{
+    mLinkMembers = link;
+}
+
+void RetrieveAllGroupMembersJob::setItemIndex(ItemIndex *itemIndex)
+{
+    mItemIndex = itemIndex;
+}
+
+void RetrieveAllGroupMembersJob::setIgnoreLocalRevisions(bool ignore)
+{
+    mIgnoreLocalRevisions = ignore;
+}
+
+QList<Akonadi::Collection::Id> RetrieveAllGroupMembersJob::synchronizedCollections() const
+{
+    return mSynchronizedCollections;
+}
+
+void RetrieveAllGroupMembersJob::start()
+{
+    mTime.start();
+
+    Akonadi::CollectionFetchJob *fetchJob =
+        new Akonadi::CollectionFetchJob(mTopLevelCollection, Akonadi::CollectionFetchJob::FirstLevel, this);
+    connect(fetchJob, SIGNAL(result(KJob*)), this, SLOT(localFetchDone(KJob*)));
+}
+
+void RetrieveAllGroupMembersJob::localFetchDone(KJob *job)
+{
+    if (job->error()) {
+        kWarning() << job->errorString();
+        setError(KJob::UserDefinedError);
+        emitResult();
+        return;
+    }
+
+    foreach (const Akonadi::Collection &collection, static_cast<Akonadi::CollectionFetchJob*>(job)->collections()) {
+        mGroupCollections.insert(collection.remoteId(), collection);
+    }
+
+    if (mGroupCollections.isEmpty()) {
+        emitResult();
+        return;
+    }
+
+    const int ret = mLdapSearch.search(KLDAP::LdapDN(mSearchbase), KLDAP::LdapUrl::Sub,
+                                       QLatin1String("(|(objectClass=groupofuniquenames)(objectClass=kolabgroupofuniquenames))"),
+                                       QStringList() << LDAPMapper::getAttribute(LDAPMapper::UniqueIdentifier)
+                                                     << "cn" << "uniqueMember" << "modifyTimestamp");
+    if (!ret) {
+        kWarning() << mLdapSearch.errorString();
+        kWarning() << "retrieval failed";
+        setError(KJob::UserDefinedError);
+        emitResult();
+    }
+}
+
+void RetrieveAllGroupMembersJob::gotSearchData(KLDAP::LdapSearch *search, const KLDAP::LdapObject &obj)
+{
+    Q_UNUSED(search);
+
+    QStringList memberDns;
+    foreach (const QByteArray &member, obj.values("uniqueMember")) {
+        memberDns << QString::fromUtf8(member);
+    }
+    // needed to expand nested groups
+    mGroupMemberDns.insert(obj.dn().toString(), memberDns);
+
+    const QString id = LDAPMapper::getStableIdentifier(obj);
+    if (!mGroupCollections.contains(id)) {
+        // not yet known as a collection, the next collection tree sync will add it
+        return;
+    }
+
+    mGroups.insert(id, obj);
+    foreach (const QString &dn, memberDns) {
+        mMemberDns.insert(PersonCache::normalizedDn(dn), dn);
+    }
+}
+
+void RetrieveAllGroupMembersJob::gotSearchResult(KLDAP::LdapSearch *search)
+{
+    if (search->error()) {
+        kWarning() << search->error() << search->errorString();
+        switch (search->error()) {
+            case KLDAP_SIZELIMIT_EXCEEDED:
+                kWarning() << "Sizelimit exceeded";
+                break;
+            default:
+                kWarning() << "Unknown error";
+        }
+        setError(KJob::UserDefinedError);
+        emitResult();
+        return;
+    }
+
+    kDebug() << "Resolving" << mMemberDns.count() << "members of" << mGroups.count() << "groups";
+
+    ResolveMembersJob *resolveJob = new ResolveMembersJob(mMemberDns.values(), mTopLevelCollection, mConnection, this);
+    resolveJob->setPersonCache(mPersonCache);
+    resolveJob->setFullPayload(mFetchScope == RetrieveGroupMembersJob::FullPayload);
+    resolveJob->setMaxConcurrentSearches(mMaxConcurrentSearches);
+    resolveJob->setBatchSize(mBatchSize);
+    resolveJob->setMaxNestingDepth(mMaxNestingDepth);
+    resolveJob->setKnownGroups(mGroupMemberDns);
+    connect(resolveJob, SIGNAL(result(KJob*)), this, SLOT(resolveMembersDone(KJob*)));
+}
+
+void RetrieveAllGroupMembersJob::resolveMembersDone(KJob *job)
+{
+    if (job->error()) {
+        setError(KJob::UserDefinedError);
+        emitResult();
+        return;
+    }
+
+    ResolveMembersJob *resolveJob = static_cast<ResolveMembersJob*>(job);
+    mMembers = resolveJob->itemsByDn();
+    mMemberDns.clear();
+
+    for (QHash<QString, KLDAP::LdapObject>::const_iterator it = mGroups.constBegin(); it != mGroups.constEnd(); ++it) {
+        const QStringList memberDns = mGroupMemberDns.value(it.value().dn().toString());
+        mExpandedMembers.insert(it.key(), resolveJob->expandedMemberDns(memberDns));
+        mNestedGroups.insert(it.key(), resolveJob->nestedGroupDns(memberDns));
+        mPendingCollections << mGroupCollections.value(it.key());
+    }
+    mGroupMemberDns.clear();
+
+    processNextGroup();
+}
+
+void RetrieveAllGroupMembersJob::groupDone(KJob *job)
+{
+    if (job->error()) {
+        kWarning() << job->errorString();
+
+        // try to proceed as far as possible
+    } else {
+        mSynchronizedCollections << job->property("collectionId").value<Akonadi::Collection::Id>();
+    }
+
+    processNextGroup();
+}
+
+void RetrieveAllGroupMembersJob::processNextGroup()
+{
+    if (mPendingCollections.isEmpty()) {
+        kDebug() << "Done. Took " << mTime.elapsed()/1000.0 << " s";
+        emitResult();
+        return;
+    }
+
+    // one after the other, each of them writes in its own transaction
+    const Akonadi::Collection collection = mPendingCollections.takeFirst();
+
+    RetrieveGroupMembersJob *job = new RetrieveGroupMembersJob(mSearchbase, collection, mConnection, this);
+    job->setFetchScope(mFetchScope);
+    job->setPersonCache(mPersonCache);
+    job->setLinkMembers(mLinkMembers);
+    job->setItemIndex(mItemIndex);
+    job->setIgnoreLocalRevisions(mIgnoreLocalRevisions);
+    job->setGroup(mGroups.value(collection.remoteId()), mExpandedMembers.value(collection.remoteId()), mMembers,
+                  mNestedGroups.value(collection.remoteId()));
+    job->setProperty("collectionId", collection.id());
+    connect(job, SIGNAL(result(KJob*)), this, SLOT(groupDone(KJob*)));
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2014 Klaralvdalens Datakonsult AB <info@kdab.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RETRIEVEALLGROUPMEMBERSJOB_H
+#define RETRIEVEALLGROUPMEMBERSJOB_H
+
+#include "retrievegroupmembersjob.h"
+
+#include <akonadi/collection.h>
+#include <akonadi/item.h>
+
+#include <KLDAP/LdapSearch>
+
+#include <kjob.h>
+
+#include <QHash>
+#include <QTime>
+
+class ItemIndex;
+class PersonCache;
+
+/**
+ * Synchronizes the members of all group collections in one pass.
+ *
+ * All groups are retrieved with a single search, the members of all of them are resolved
+ * once, nested groups are expanded from the same search, and then each group collection is updated from that data without further searches.
+ */
+class RetrieveAllGroupMembersJob : public KJob
+{
+    Q_OBJECT
+public:
+    RetrieveAllGroupMembersJob(const QString &searchBase, const Akonadi::Collection &topLevelCollection,
+                               KLDAP::LdapConnection &connection, QObject *parent = 0);
+
+    void setFetchScope(RetrieveGroupMembersJob::FetchScope fetchScope);
+    void setMaxConcurrentSearches(int count);
+    void setBatchSize(int size);
+    void setPersonCache(PersonCache *personCache);
+    void setMaxNestingDepth(int depth);
+    void setLinkMembers(bool link);
+
+    /**
+     * Where the linked members are looked up in the top level collection, it is listed
+     * at most once for all groups
+     */
+    void setItemIndex(ItemIndex *itemIndex);
+
+    /**
+     * See RetrieveGroupMembersJob::setIgnoreLocalRevisions()
+     */
+    void setIgnoreLocalRevisions(bool ignore);
+
+    /**
+     * The group collections which have been synchronized
+     */
+    QList<Akonadi::Collection::Id> synchronizedCollections() const;
+
+public Q_SLOTS:
+    virtual void start();
+
+private Q_SLOTS:
+    void localFetchDone(KJob *job);
+    void gotSearchResult(KLDAP::LdapSearch *search);
+    void gotSearchData(KLDAP::LdapSearch *search, const KLDAP::LdapObject &obj);
+    void resolveMembersDone(KJob *job);
+    void groupDone(KJob *job);
+
+private:
+    void processNextGroup();
+
+    const QString mSearchbase;
+    const Akonadi::Collection mTopLevelCollection;
+    KLDAP::LdapConnection &mConnection;
+    KLDAP::LdapSearch mLdapSearch;
+
+    RetrieveGroupMembersJob::FetchScope mFetchScope;
+    int mMaxConcurrentSearches;
+    int mBatchSize;
+    PersonCache *mPersonCache;
+    int mMaxNestingDepth;
+    bool mLinkMembers;
+    ItemIndex *mItemIndex;
+    bool mIgnoreLocalRevisions;
+
+    QHash<QString, Akonadi::Collection> mGroupCollections;
+    QHash<QString, KLDAP::LdapObject> mGroups;
+    // dn -> member DNs of all groups, including those without a collection
+    QHash<QString, QStringList> mGroupMemberDns;
+    // id -> member DNs with nested groups expanded
+    QHash<QString, QStringList> mExpandedMembers;
+    // id -> normalized DNs of the nested groups expanded into the members
+    QHash<QString, QStringList> mNestedGroups;
+    // normalized dn -> dn of all members of all groups
+    QHash<QString, QString> mMemberDns;
+    QHash<QString, Akonadi::Item> mMembers;
+
+    Akonadi::Collection::List mPendingCollections;
+    QList<Akonadi::Collection::Id> mSynchronizedCollections;
+    QTime mTime;
+};
+
+#endif // RETRIEVEALLGROUPMEMBERSJOB_H
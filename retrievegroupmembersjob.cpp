@@ -16,11 +16,20 @@
  */
 
 #include "retrievegroupmembersjob.h"
+#include "contentdigestattribute.h"
 #include "ldapmapper.h"
+#include "ldapsearchqueue.h"
+#include "groupmembersattribute.h"
+#include "membersdigestattribute.h"
+#include "nestedgroupsattribute.h"
+#include "personcache.h"
+#include "linkgroupmembersjob.h"
+#include "resolvemembersjob.h"
 #include "settings.h"
 
 #include <KABC/Addressee>
 #include <KABC/ContactGroup>
+#include <Akonadi/CollectionModifyJob>
 #include <Akonadi/ItemFetchJob>
 #include <Akonadi/ItemFetchScope>
 #include <Akonadi/ItemCreateJob>
@@ -32,7 +41,18 @@
 RetrieveGroupMembersJob::RetrieveGroupMembersJob(const QString &searchbase, const Akonadi::Collection& col, KLDAP::LdapConnection& connection, QObject* parent)
 :   Job(parent),
     mFetchScope(LookupPayload),
+    mConnection(connection),
     mLdapSearch(connection),
+    mMaxConcurrentSearches(LdapSearchQueue::DefaultMaxConcurrentSearches),
+    mBatchSize(LdapSearchQueue::DefaultBatchSize),
+    mPersonCache(0),
+    mMaxNestingDepth(0),
+    mLinkMembers(false),
+    mItemIndex(0),
+    mMemberOfLookup(false),
+    mPageSize(0),
+    mIgnoreLocalRevisions(false),
+    mHasGroup(false),
     mParentCollection(col),
     mTransaction(0),
     mSearchbase(searchbase),
@@ -52,6 +72,7 @@ void RetrieveGroupMembersJob::doStart()
     job->fetchScope().setFetchModificationTime(false);
     job->fetchScope().setCacheOnly(true);
     job->fetchScope().fetchFullPayload(false);
+    job->fetchScope().fetchAttribute<ContentDigestAttribute>();
     connect(job, SIGNAL(itemsReceived(Akonadi::Item::List)), this, SLOT(localItemsReceived(Akonadi::Item::List)));
     connect(job, SIGNAL(result(KJob*)), this, SLOT(localFetchDone(KJob*)));
     mTime.start();
@@ -62,18 +83,82 @@ void RetrieveGroupMembersJob::setFetchScope(RetrieveGroupMembersJob::FetchScope
     mFetchScope = fetchScope;
 }
 
+void RetrieveGroupMembersJob::setMaxConcurrentSearches(int count)
+{
+    mMaxConcurrentSearches = count;
+}
+
+void RetrieveGroupMembersJob::setBatchSize(int size)
+{
+    mBatchSize = size;
+}
+
+void RetrieveGroupMembersJob::setPersonCache(PersonCache *personCache)
+{
+    mPersonCache = personCache;
+}
+
+void RetrieveGroupMembersJob::setMaxNestingDepth(int depth)
+{
+    mMaxNestingDepth = depth;
+}
+
+void RetrieveGroupMembersJob::setLinkMembers(bool link)
+{
+    mLinkMembers = link;
+}
+
+void RetrieveGroupMembersJob::setItemIndex(ItemIndex *itemIndex)
+{
+    mItemIndex = itemIndex;
+}
+
+void RetrieveGroupMembersJob::setMemberOfLookup(bool memberOf)
+{
+    mMemberOfLookup = memberOf;
+}
+
+void RetrieveGroupMembersJob::setPageSize(int pageSize)
+{
+    mPageSize = pageSize;
+}
+
+void RetrieveGroupMembersJob::setIgnoreLocalRevisions(bool ignore)
+{
+    mIgnoreLocalRevisions = ignore;
+}
+
+void RetrieveGroupMembersJob::setGroup(const KLDAP::LdapObject &group, const QStringList &memberDns,
+                                       const QHash<QString, Akonadi::Item> &members, const QStringList &nestedGroups)
+{
+    mHasGroup = true;
+    mGroupObject = group;
+    mExpandedMembers = memberDns;
+    mResolvedMembers = members;
+    mNestedGroups = nestedGroups;
+}
+
 void RetrieveGroupMembersJob::localItemsReceived(const Akonadi::Item::List &items)
 {
     kDebug() << items.size();
     foreach (const Akonadi::Item &item, items) {
         kDebug() << item.remoteId() << item.remoteRevision();
-        if (mLocalItems.contains(item.remoteId())) {
+        if (mLocalItems.contains(item.remoteId()) && !mLinkMembers) {
             Akonadi::ItemDeleteJob *job = new Akonadi::ItemDeleteJob(item, transaction());
             transaction()->setIgnoreJobFailure(job);
             continue;
         }
-        mLocalItems.insert(item.remoteId(), item.remoteRevision());
         mRemoteLocalIds.insert(item.remoteId(), item.id());
+        if (mIgnoreLocalRevisions) {
+            // never matches a revision from the server
+            mLocalItems.insert(item.remoteId(), QString());
+            continue;
+        }
+        mLocalItems.insert(item.remoteId(), item.remoteRevision());
+        const QByteArray digest = ContentDigestAttribute::itemDigest(item);
+        if (!digest.isEmpty()) {
+            mLocalDigests.insert(item.remoteId(), digest);
+        }
     }
 }
 
@@ -86,29 +171,26 @@ void RetrieveGroupMembersJob::localFetchDone(KJob *job)
         emitResult();
         return;
     }
+
+    if (mHasGroup) {
+        processGroup(mGroupObject);
+        mGroupMembers = mExpandedMembers;
+        resolveMembers();
+        return;
+    }
     searchForGroup();
 }
 
 void RetrieveGroupMembersJob::searchForGroup()
 {
     kDebug();
+    QStringList attributes = QStringList() << "nsuniqueid" << "cn";
+    if (!mMemberOfLookup) {
+        attributes << "uniqueMember";
+    }
     const int ret = mLdapSearch.search( KLDAP::LdapDN(mSearchbase), KLDAP::LdapUrl::Sub,
                                         QString("%1=%2").arg(LDAPMapper::getAttribute(LDAPMapper::UniqueIdentifier)).arg(mParentCollection.remoteId()),
-                                        QStringList() << "nsuniqueid" << "uniqueMember" << "cn");
-    if (!ret) {
-        kWarning() << mLdapSearch.errorString();
-        kWarning() << "retrieval failed";
-        setError(KJob::UserDefinedError);
-        emitResult();
-    }
-}
-
-void RetrieveGroupMembersJob::searchForMember(const QString &memberDn)
-{
-    kDebug();
-    const QStringList attributes = mFetchScope == FullPayload ? LDAPMapper::requestedFullPayloadAttributes()
-                                                              : LDAPMapper::requestedLookupPayloadAttributes();
-    const int ret = mLdapSearch.search( KLDAP::LdapDN(memberDn), KLDAP::LdapUrl::Base, QString(), attributes);
+                                        attributes);
     if (!ret) {
         kWarning() << mLdapSearch.errorString();
         kWarning() << "retrieval failed";
@@ -117,16 +199,6 @@ void RetrieveGroupMembersJob::searchForMember(const QString &memberDn)
     }
 }
 
-bool RetrieveGroupMembersJob::getNextMember()
-{
-    if (mGroupMembers.isEmpty()) {
-        return false;
-    }
-    const QString member = mGroupMembers.takeFirst();
-    searchForMember(member);
-    return true;
-}
-
 void RetrieveGroupMembersJob::gotSearchResult(KLDAP::LdapSearch *search)
 {
     Q_UNUSED( search );
@@ -145,7 +217,97 @@ void RetrieveGroupMembersJob::gotSearchResult(KLDAP::LdapSearch *search)
         return;
     }
 
-    if (getNextMember()) {
+    resolveMembers();
+}
+
+void RetrieveGroupMembersJob::resolveMembers()
+{
+    // members whose local copy matches the person cache need neither payload nor an update
+    QStringList membersToResolve;
+    foreach (const QString &member, mGroupMembers) {
+        if (mPersonCache && mPersonCache->contains(member)) {
+            const PersonCache::Entry entry = mPersonCache->value(member);
+            const QHash<QString, QString>::iterator it = mLocalItems.find(entry.id);
+            if (it != mLocalItems.end() && *it == entry.revision) {
+                mMemberIds.insert(entry.id);
+                mMemberDnIds.insert(PersonCache::normalizedDn(member), entry.id);
+                if (mLinkMembers) {
+                    // already linked
+                    Akonadi::Item item(mRemoteLocalIds.value(entry.id));
+                    item.setRemoteId(entry.id);
+                    mLinkedMembers << item;
+                }
+                KABC::ContactGroup::ContactReference reference;
+                reference.setUid(QString::number(mRemoteLocalIds.value(entry.id)));
+                mGroup.append(reference);
+                mLocalItems.erase(it);
+                continue;
+            }
+        }
+        membersToResolve << member;
+    }
+    mGroupMembers.clear();
+
+    if (mHasGroup) {
+        // resolved for all groups at once
+        foreach (const QString &member, membersToResolve) {
+            const QString key = PersonCache::normalizedDn(member);
+            const Akonadi::Item item = mResolvedMembers.value(key);
+            if (!item.remoteId().isEmpty()) {
+                mMemberDnIds.insert(key, item.remoteId());
+                processMember(item);
+            }
+        }
+        processMembers();
+        return;
+    }
+
+    const bool memberOf = mMemberOfLookup && !mGroupDn.isEmpty();
+    if (membersToResolve.isEmpty() && !memberOf) {
+        processMembers();
+        return;
+    }
+
+    // the order of the references in the contact group does not matter
+    ResolveMembersJob *resolveJob = new ResolveMembersJob(membersToResolve, mParentCollection.parentCollection(), mConnection, this);
+    if (memberOf) {
+        resolveJob->setMemberOf(mGroupDn, mSearchbase);
+        resolveJob->setPageSize(mPageSize);
+    }
+    resolveJob->setPersonCache(mPersonCache);
+    resolveJob->setFullPayload(mFetchScope == FullPayload);
+    resolveJob->setMaxConcurrentSearches(mMaxConcurrentSearches);
+    resolveJob->setBatchSize(mBatchSize);
+    resolveJob->setMaxNestingDepth(mMaxNestingDepth);
+    connect(resolveJob, SIGNAL(result(KJob*)), SLOT(resolveMembersDone(KJob*)));
+}
+
+void RetrieveGroupMembersJob::resolveMembersDone(KJob *job)
+{
+    if (job->error()) {
+        setError(KJob::UserDefinedError);
+        done();
+        return;
+    }
+
+    const QHash<QString, Akonadi::Item> members = static_cast<ResolveMembersJob*>(job)->itemsByDn();
+    for (QHash<QString, Akonadi::Item>::const_iterator it = members.constBegin(); it != members.constEnd(); ++it) {
+        mMemberDnIds.insert(it.key(), it.value().remoteId());
+        processMember(it.value());
+    }
+    mNestedGroups = static_cast<ResolveMembersJob*>(job)->nestedGroupDns();
+    processMembers();
+}
+
+void RetrieveGroupMembersJob::processMembers()
+{
+    if (mLinkMembers) {
+        mGroupItem.setPayload(mGroup);
+        LinkGroupMembersJob *linkJob = new LinkGroupMembersJob(mParentCollection, mLinkedMembers, this);
+        linkJob->setContactGroup(mGroupItem);
+        linkJob->setItemIndex(mItemIndex);
+        connect(linkJob, SIGNAL(result(KJob*)), SLOT(linkMembersDone(KJob*)));
+        mLinkedMembers.clear();
         return;
     }
 
@@ -175,6 +337,14 @@ void RetrieveGroupMembersJob::gotSearchResult(KLDAP::LdapSearch *search)
     }
 }
 
+void RetrieveGroupMembersJob::linkMembersDone(KJob *job)
+{
+    if (job->error()) {
+        setError(KJob::UserDefinedError);
+    }
+    done();
+}
+
 void RetrieveGroupMembersJob::gotSearchData(KLDAP::LdapSearch *search, const KLDAP::LdapObject &obj)
 {
     Q_UNUSED( search );
@@ -182,59 +352,89 @@ void RetrieveGroupMembersJob::gotSearchData(KLDAP::LdapSearch *search, const KLD
     kDebug() << "Object:";
     kDebug() << obj.toString();
     if (obj.value("nsuniqueid") == mParentCollection.remoteId()) {
-        foreach (const QByteArray &val, obj.values("uniqueMember")) {
-            mGroupMembers << val;
-        }
-        kDebug() << "found members: " << mGroupMembers;
-
-        KABC::ContactGroup group;
-        group.setName(obj.value("cn"));
-        //group.setEmail(obj.value("email"));
-        mGroup = group;
-        mGroupItem = Akonadi::Item();
-        mGroupItem.setRemoteId(LDAPMapper::getStableIdentifier(obj));
-        mGroupItem.setMimeType(KABC::ContactGroup::mimeType());
-        const QHash<QString, QString>::iterator it = mLocalItems.find(mGroupItem.remoteId());
-        mSaveContactGroup = true;
-        if (it != mLocalItems.end()) {
-            const QHash<QString, Akonadi::Entity::Id>::iterator uid = mRemoteLocalIds.find(mGroupItem.remoteId());
-            mGroupItem.setId(*uid);
-            kDebug() <<  mGroupItem.remoteId() <<  mGroupItem.id();
-            if (*it == LDAPMapper::getTimestamp(obj)) {
-                mSaveContactGroup = false;
-                kDebug() << "skipping " << mGroupItem.remoteId();
-            }
-            mLocalItems.erase(it);
-            return;
+        processGroup(obj);
+    }
+}
+
+void RetrieveGroupMembersJob::processGroup(const KLDAP::LdapObject &obj)
+{
+    mGroupDn = obj.dn().toString();
+    if (!mMemberOfLookup) {
+        mMembersDigest = LDAPMapper::getMembersDigest(obj);
+    }
+    foreach (const QByteArray &val, obj.values("uniqueMember")) {
+        mGroupMembers << val;
+    }
+    kDebug() << "found members: " << mGroupMembers;
+
+    KABC::ContactGroup group;
+    group.setName(obj.value("cn"));
+    //group.setEmail(obj.value("email"));
+    mGroup = group;
+    mGroupItem = Akonadi::Item();
+    mGroupItem.setRemoteId(LDAPMapper::getStableIdentifier(obj));
+    mGroupItem.setMimeType(KABC::ContactGroup::mimeType());
+    const QHash<QString, QString>::iterator it = mLocalItems.find(mGroupItem.remoteId());
+    mSaveContactGroup = true;
+    if (it != mLocalItems.end()) {
+        const QHash<QString, Akonadi::Entity::Id>::iterator uid = mRemoteLocalIds.find(mGroupItem.remoteId());
+        mGroupItem.setId(*uid);
+        kDebug() <<  mGroupItem.remoteId() <<  mGroupItem.id();
+        if (*it == LDAPMapper::getTimestamp(obj)) {
+            mSaveContactGroup = false;
+            kDebug() << "skipping " << mGroupItem.remoteId();
         }
-    } else {
-        kDebug() << "got person: " << obj.dn().toString() << obj.value("nsuniqueid") << obj.value("modifyTimestamp");
-        Akonadi::Item item;
-        item.setRemoteId(LDAPMapper::getStableIdentifier(obj));
-        item.setPayload(LDAPMapper::getAddressee(obj));
-        item.setMimeType(KABC::Addressee::mimeType());
-        item.setParentCollection(mParentCollection);
-        item.setRemoteRevision(LDAPMapper::getTimestamp(obj));
-
-        const QHash<QString, QString>::iterator it = mLocalItems.find(item.remoteId());
-        if (it != mLocalItems.end()) {
-            const QHash<QString, Akonadi::Entity::Id>::iterator uid = mRemoteLocalIds.find(item.remoteId());
-            KABC::ContactGroup::ContactReference reference;
-            reference.setUid(QString::number(*uid));
-            mGroup.append(reference);
-            if (*it == LDAPMapper::getTimestamp(obj)) {
-                kDebug() << "skipping " << item.remoteId();
+        mLocalItems.erase(it);
+    }
+}
+
+void RetrieveGroupMembersJob::processMember(const Akonadi::Item &member)
+{
+    kDebug() << "got person: " << member.remoteId() << member.remoteRevision();
+    if (mMemberIds.contains(member.remoteId())) {
+        return;
+    }
+    mMemberIds.insert(member.remoteId());
+
+    if (mLinkMembers) {
+        mLinkedMembers << member;
+        return;
+    }
+
+    Akonadi::Item item = member;
+    item.setParentCollection(mParentCollection);
+    if (mFetchScope != FullPayload) {
+        // Akonadi would store the lookup attributes as the full payload, so the copy is left without
+        // one and retrieveItem() provides it on demand
+        item.clearPayload();
+    }
+
+    const QHash<QString, QString>::iterator it = mLocalItems.find(item.remoteId());
+    if (it != mLocalItems.end()) {
+        const QHash<QString, Akonadi::Entity::Id>::iterator uid = mRemoteLocalIds.find(item.remoteId());
+        KABC::ContactGroup::ContactReference reference;
+        reference.setUid(QString::number(*uid));
+        mGroup.append(reference);
+        if (*it == item.remoteRevision()) {
+            kDebug() << "skipping " << item.remoteId();
+        } else {
+            Akonadi::ItemModifyJob *modifyJob = new Akonadi::ItemModifyJob(item, transaction());
+            if (mLocalDigests.contains(item.remoteId()) &&
+                mLocalDigests.value(item.remoteId()) == ContentDigestAttribute::itemDigest(item)) {
+                // only attributes we don't map have changed, just record the new revision
+                kDebug() << "unchanged content" << item.remoteId();
+                modifyJob->setIgnorePayload(true);
             } else {
                 kDebug() << "modification";
-                new Akonadi::ItemModifyJob(item, transaction());
+                modifyJob->setIgnorePayload(!item.hasPayload());
             }
-            mLocalItems.erase(it);
-            return;
         }
-        //new item
-        Akonadi::ItemCreateJob *job = new Akonadi::ItemCreateJob(item, mParentCollection, transaction());
-        connect(job, SIGNAL(result(KJob*)), SLOT(createdItem(KJob*)));
+        mLocalItems.erase(it);
+        return;
     }
+    //new item
+    Akonadi::ItemCreateJob *job = new Akonadi::ItemCreateJob(item, mParentCollection, transaction());
+    connect(job, SIGNAL(result(KJob*)), SLOT(createdItem(KJob*)));
 }
 
 void RetrieveGroupMembersJob::createdItem(KJob* job) {
@@ -293,9 +493,64 @@ void RetrieveGroupMembersJob::savedContactGroup(KJob *job)
 }
 
 
+void RetrieveGroupMembersJob::groupAttributesStored(KJob *job)
+{
+    if (job->error()) {
+        kWarning() << job->errorString();
+
+        // the members are stored, updates of the nested groups just won't reach this one and
+        // the next update of the group compares all members again
+    }
+
+    kDebug() << "Done. Took " << mTime.elapsed()/1000.0 << " s";
+    emitResult();
+}
+
 void RetrieveGroupMembersJob::done()
 {
+    if (!error() && updateGroupAttributes()) {
+        // not a subjob, failing to store them doesn't fail the synchronization
+        Akonadi::CollectionModifyJob *job = new Akonadi::CollectionModifyJob(mParentCollection);
+        connect(job, SIGNAL(result(KJob*)), SLOT(groupAttributesStored(KJob*)));
+        return;
+    }
+
     kDebug() << "Done. Took " << mTime.elapsed()/1000.0 << " s";
     emitResult();
 }
 
+bool RetrieveGroupMembersJob::updateGroupAttributes()
+{
+    bool modified = false;
+
+    // lets updates of the nested groups find this one
+    const NestedGroupsAttribute *nestedGroups = mParentCollection.attribute<NestedGroupsAttribute>();
+    const QStringList storedGroups = nestedGroups ? nestedGroups->groupDns() : QStringList();
+    if (QSet<QString>::fromList(storedGroups) != QSet<QString>::fromList(mNestedGroups)) {
+        mParentCollection.attribute<NestedGroupsAttribute>(Akonadi::Collection::AddIfMissing)->setGroupDns(mNestedGroups);
+        modified = true;
+    }
+
+    // the members are up to date now, so is their digest, see UpdateGroupJob::updateMembers()
+    const MembersDigestAttribute *digest = mParentCollection.attribute<MembersDigestAttribute>();
+    if (mMembersDigest.isEmpty()) {
+        if (digest) {
+            // found through memberOf, a digest of an older member list must not match later on
+            mParentCollection.removeAttribute<MembersDigestAttribute>();
+            modified = true;
+        }
+    } else if (!digest || digest->digest() != mMembersDigest) {
+        mParentCollection.attribute<MembersDigestAttribute>(Akonadi::Collection::AddIfMissing)->setDigest(mMembersDigest);
+        modified = true;
+    }
+
+    if (!mLinkMembers) {
+        const GroupMembersAttribute *members = mParentCollection.attribute<GroupMembersAttribute>();
+        if (!members || members->memberIds() != mMemberDnIds) {
+            mParentCollection.attribute<GroupMembersAttribute>(Akonadi::Collection::AddIfMissing)->setMemberIds(mMemberDnIds);
+            modified = true;
+        }
+    }
+
+    return modified;
+}
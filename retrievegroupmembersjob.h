@@ -27,6 +27,10 @@
 #include <akonadi/item.h>
 #include <akonadi/transactionsequence.h>
 #include <QDateTime>
+#include <QSet>
+
+class ItemIndex;
+class PersonCache;
 
 class RetrieveGroupMembersJob:  public Akonadi::Job
 {
@@ -42,35 +46,123 @@ public:
 
     void setFetchScope(FetchScope fetchScope);
 
+    /**
+     * Maximum number of members fetched at the same time
+     */
+    void setMaxConcurrentSearches(int count);
+
+    /**
+     * Maximum number of members fetched with a single search
+     */
+    void setBatchSize(int size);
+
+    /**
+     * Resolve members through @p personCache before asking the server
+     */
+    void setPersonCache(PersonCache *personCache);
+
+    /**
+     * How many levels of nested groups are expanded into members
+     */
+    void setMaxNestingDepth(int depth);
+
+    /**
+     * Link the members from the top level collection into the (virtual) group collection
+     * instead of storing copies of them
+     */
+    void setLinkMembers(bool link);
+
+    /**
+     * Where the linked members are looked up in the top level collection
+     */
+    void setItemIndex(ItemIndex *itemIndex);
+
+    /**
+     * Find the members through their memberOf attribute instead of the group's uniqueMember list
+     */
+    void setMemberOfLookup(bool memberOf);
+
+    /**
+     * Request the members found through their memberOf attribute in pages of @p pageSize
+     */
+    void setPageSize(int pageSize);
+
+    /**
+     * Write all entries again instead of skipping those whose revision or content digest
+     * matches the local item, e.g. after the attribute mapping has changed
+     */
+    void setIgnoreLocalRevisions(bool ignore);
+
+    /**
+     * Use the already retrieved @p group, its expanded @p memberDns and the already resolved
+     * @p members (see ResolveMembersJob::itemsByDn()) instead of searching the server.
+     * @p nestedGroups are the groups expanded into the members (see ResolveMembersJob::nestedGroupDns())
+     */
+    void setGroup(const KLDAP::LdapObject &group, const QStringList &memberDns,
+                  const QHash<QString, Akonadi::Item> &members, const QStringList &nestedGroups);
+
 signals:
     void contactsRetrieved(const Akonadi::Item::List &);
 
 private Q_SLOTS:
     void gotSearchResult(KLDAP::LdapSearch *search);
     void gotSearchData(KLDAP::LdapSearch *search, const KLDAP::LdapObject &obj);
+    void resolveMembersDone(KJob *job);
+    void linkMembersDone(KJob *job);
     void localFetchDone(KJob*);
     void localItemsReceived(const Akonadi::Item::List &);
     void transactionDone(KJob* job);
     void createdItem(KJob* job);
     void savedContactGroup(KJob* job);
+    void groupAttributesStored(KJob *job);
 
 private:
     Akonadi::TransactionSequence *transaction();
     void searchForGroup();
-    void searchForMember(const QString &memberDn);
+    void processGroup(const KLDAP::LdapObject &obj);
+    void resolveMembers();
+    void processMember(const Akonadi::Item &member);
+    void processMembers();
     void done();
-    bool getNextMember();
+    // returns whether mParentCollection needs to be written
+    bool updateGroupAttributes();
     void saveContactGroup();
 
     FetchScope mFetchScope;
+    KLDAP::LdapConnection &mConnection;
     KLDAP::LdapSearch mLdapSearch;
+    int mMaxConcurrentSearches;
+    int mBatchSize;
+    PersonCache *mPersonCache;
+    int mMaxNestingDepth;
+    bool mLinkMembers;
+    ItemIndex *mItemIndex;
+    bool mMemberOfLookup;
+    int mPageSize;
+    bool mIgnoreLocalRevisions;
+    QString mGroupDn;
+    Akonadi::Item::List mLinkedMembers;
+    bool mHasGroup;
+    KLDAP::LdapObject mGroupObject;
+    QStringList mExpandedMembers;
+    QHash<QString, Akonadi::Item> mResolvedMembers;
+    // normalized DNs of the groups expanded into the members
+    QStringList mNestedGroups;
     Akonadi::Collection mParentCollection;
     QHash<QString, QString> mLocalItems;
+    // remote id -> content digest of the local items
+    QHash<QString, QByteArray> mLocalDigests;
     QHash<QString, Akonadi::Entity::Id> mRemoteLocalIds;
     Akonadi::TransactionSequence *mTransaction;
     QString mSearchbase;
     QTime mTime;
     QStringList mGroupMembers;
+    // remote ids of the members handled so far, nested groups may contain a person several times
+    QSet<QString> mMemberIds;
+    // normalized member dn -> remote id, like UpdateGroupJob stores them
+    QHash<QString, QString> mMemberDnIds;
+    // of the members read from the group, empty if they were found through memberOf
+    QByteArray mMembersDigest;
     Akonadi::Item mGroupItem;
     KABC::ContactGroup mGroup;
     bool mSaveContactGroup;
@@ -31,7 +31,11 @@ RetrieveGroupsJob::RetrieveGroupsJob(const QString &searchbase, const Akonadi::C
 :   Job(parent),
     mLdapSearch(connection),
     mParentCollection(col),
-    mSearchbase(searchbase)
+    mSearchbase(searchbase),
+    mLinkMembers(false),
+    mChangedSince(-1),
+    mOverlap(0),
+    mMostRecentTimestamp(-1)
 {
     Q_ASSERT(connection.handle());
     connect( &mLdapSearch, SIGNAL(result(KLDAP::LdapSearch*)),
@@ -45,12 +49,39 @@ void RetrieveGroupsJob::doStart()
     search();
 }
 
+void RetrieveGroupsJob::setLinkMembers(bool link)
+{
+    mLinkMembers = link;
+}
+
+void RetrieveGroupsJob::setChangedSince(const QString &timestamp, int overlap, const QHash<QString, Akonadi::Collection> &knownGroups)
+{
+    mChangedSince = LDAPMapper::parseTimestamp(timestamp);
+    mOverlap = qMax(0, overlap);
+    mKnownGroups = knownGroups;
+
+    // nothing newer might show up
+    mMostRecentTimestamp = mChangedSince;
+}
+
+QString RetrieveGroupsJob::mostRecentTimestamp() const
+{
+    if (mMostRecentTimestamp < 0) {
+        return QString();
+    }
+    return LDAPMapper::formatTimestamp(mMostRecentTimestamp);
+}
+
 void RetrieveGroupsJob::search()
 {
-    kDebug();
-    const int ret = mLdapSearch.search( KLDAP::LdapDN(mSearchbase), KLDAP::LdapUrl::Sub,
-                                        QLatin1String("(|(objectClass=groupofuniquenames)(objectClass=kolabgroupofuniquenames))"),
-                                        QStringList() << "cn" << "nsuniqueid");
+    kDebug() << mChangedSince;
+    QString filter = QLatin1String("(|(objectClass=groupofuniquenames)(objectClass=kolabgroupofuniquenames))");
+    if (mChangedSince >= 0) {
+        // a change replicated late can carry an older timestamp than the watermark
+        filter = QString::fromLatin1("(&%1(modifyTimestamp>=%2))").arg(filter).arg(LDAPMapper::formatTimestamp(mChangedSince - qint64(mOverlap) * 1000));
+    }
+    const int ret = mLdapSearch.search( KLDAP::LdapDN(mSearchbase), KLDAP::LdapUrl::Sub, filter,
+                                        QStringList() << "cn" << "nsuniqueid" << "modifyTimestamp");
     if (!ret) {
         kWarning() << mLdapSearch.errorString();
         kWarning() << "retrieval failed";
@@ -85,9 +116,27 @@ void RetrieveGroupsJob::gotSearchData(KLDAP::LdapSearch *search, const KLDAP::Ld
     kDebug() << "Object:";
     kDebug() << obj.toString();
     kDebug() << "got group: " << obj.dn().toString() << obj.value("nsuniqueid");
+    const QString id = LDAPMapper::getStableIdentifier(obj);
+    const QString revision = LDAPMapper::getTimestamp(obj);
+    mMostRecentTimestamp = qMax(mMostRecentTimestamp, LDAPMapper::parseTimestamp(revision));
+
+    if (mChangedSince >= 0) {
+        // the overlap returns the groups of the previous search again
+        const QHash<QString, Akonadi::Collection>::const_iterator known = mKnownGroups.constFind(id);
+        if (known != mKnownGroups.constEnd() && known->remoteRevision() == revision && known->name() == obj.value("cn")) {
+            return;
+        }
+    }
+
     Akonadi::Collection col;
-    col.setRemoteId(LDAPMapper::getStableIdentifier(obj));
-    col.setContentMimeTypes(QStringList() << KABC::Addressee::mimeType() << Akonadi::Collection::mimeType() << KABC::ContactGroup::mimeType());
+    col.setRemoteId(id);
+    col.setRemoteRevision(revision);
+    if (mLinkMembers) {
+        col.setVirtual(true);
+        col.setContentMimeTypes(QStringList() << KABC::Addressee::mimeType() << KABC::ContactGroup::mimeType());
+    } else {
+        col.setContentMimeTypes(QStringList() << KABC::Addressee::mimeType() << Akonadi::Collection::mimeType() << KABC::ContactGroup::mimeType());
+    }
     col.setParentCollection(mParentCollection);
     col.setName(obj.value("cn"));
     mRetrievedCollections << col;
@@ -25,6 +25,7 @@
 #include <akonadi/item.h>
 #include <akonadi/transactionsequence.h>
 #include <QDateTime>
+#include <QHash>
 
 class RetrieveGroupsJob :  public Akonadi::Job
 {
@@ -32,8 +33,25 @@ class RetrieveGroupsJob :  public Akonadi::Job
 public:
     explicit RetrieveGroupsJob(const QString &searchbase, const Akonadi::Collection &col, KLDAP::LdapConnection &connection, QObject* parent = 0);
     virtual void doStart();
+
+    /**
+     * Create virtual group collections, to link the members into
+     */
+    void setLinkMembers(bool link);
+
+    /**
+     * Only retrieve groups modified at or after @p timestamp, rewound by @p overlap seconds to
+     * allow for replication lag. Groups found with the remote revision and name they have in
+     * @p knownGroups (by remote id) are skipped.
+     */
+    void setChangedSince(const QString &timestamp, int overlap, const QHash<QString, Akonadi::Collection> &knownGroups);
     
     Akonadi::Collection::List retrievedCollections() const;
+
+    /**
+     * The most recent modifyTimestamp seen
+     */
+    QString mostRecentTimestamp() const;
     
 private Q_SLOTS:
     void gotSearchResult(KLDAP::LdapSearch *search);
@@ -45,6 +63,12 @@ private:
     Akonadi::Collection mParentCollection;
     Akonadi::Collection::List mRetrievedCollections;
     QString mSearchbase;
+    bool mLinkMembers;
+    // parsed modifyTimestamps, -1 if unset
+    qint64 mChangedSince;
+    int mOverlap;
+    QHash<QString, Akonadi::Collection> mKnownGroups;
+    qint64 mMostRecentTimestamp;
     QTime mTime;
 };
 
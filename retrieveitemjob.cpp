@@ -26,7 +26,8 @@ RetrieveItemJob::RetrieveItemJob(const QString &searchbase, const Akonadi::Item&
 :   Job(parent),
     mLdapSearch(connection),
     mItemToFetch(item),
-    mSearchbase(searchbase)
+    mSearchbase(searchbase),
+    mFound(false)
 {
     Q_ASSERT(connection.handle());
     connect( &mLdapSearch, SIGNAL(result(KLDAP::LdapSearch*)),
@@ -45,7 +46,7 @@ void RetrieveItemJob::doStart()
 void RetrieveItemJob::search()
 {
     kDebug();
-    const int ret = mLdapSearch.search( KLDAP::LdapDN(mSearchbase), KLDAP::LdapUrl::Sub, QString("%1=%2").arg(LDAPMapper::getAttribute(LDAPMapper::UniqueIdentifier)).arg(mItemToFetch.remoteId()), LDAPMapper::requestedFullPayloadAttributes());
+    const int ret = mLdapSearch.search( KLDAP::LdapDN(mSearchbase), KLDAP::LdapUrl::Sub, QString("%1=%2").arg(LDAPMapper::getAttribute(LDAPMapper::UniqueIdentifier)).arg(mItemToFetch.remoteId()), LDAPMapper::requestedItemAttributes());
     if (!ret) {
         kWarning() << mLdapSearch.errorString();
         kWarning() << "retrieval failed";
@@ -56,11 +57,13 @@ void RetrieveItemJob::search()
 
 void RetrieveItemJob::gotSearchResult(KLDAP::LdapSearch *search)
 {
-    Q_UNUSED( search );
-    if (!search->error()) {
-        kWarning() << "not found";
+    if (search->error()) {
+        kWarning() << search->errorString();
         setError(KJob::UserDefinedError);
         setErrorText(search->errorString());
+    } else if (!mFound) {
+        kWarning() << "not found";
+        setError(KJob::UserDefinedError);
     }
     emitResult();
 }
@@ -74,6 +77,7 @@ void RetrieveItemJob::gotSearchData(KLDAP::LdapSearch *search, const KLDAP::Ldap
     kDebug() << "got person: " << obj.dn().toString();
     mItemToFetch.setPayload(LDAPMapper::getAddressee(obj));
     mItemToFetch.setRemoteRevision(LDAPMapper::getTimestamp(obj));
+    mFound = true;
 }
 
 Akonadi::Item RetrieveItemJob::getItem() const
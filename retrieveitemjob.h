@@ -42,6 +42,7 @@ private:
     KLDAP::LdapSearch mLdapSearch;
     Akonadi::Item mItemToFetch;
     QString mSearchbase;
+    bool mFound;
 };
 
 #endif // RETRIEVEITEMJOB_H
@@ -16,7 +16,10 @@
  */
 
 #include "retrieveitemsjob.h"
+#include "contentdigestattribute.h"
+#include "ldapconnectionpool.h"
 #include "ldapmapper.h"
+#include "personcache.h"
 
 #include <KABC/Addressee>
 #include <Akonadi/CollectionModifyJob>
@@ -28,13 +31,29 @@
 #include <kldap/ldapdefs.h>
 #include <quuid.h>
 
+// characters the cn of most entries start with, each is searched separately
+static const char PartitionCharacters[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+// prefixes are not split beyond this length
+static const int MaxPartitionPrefixLength = 4;
+
 RetrieveItemsJob::RetrieveItemsJob(const QString &searchbase, const Akonadi::Collection& col, KLDAP::LdapConnection& connection, QObject* parent)
 :   Job(parent),
     mFetchScope(LookupPayload),
+    mPageSize(0),
+    mBatchSize(100),
+    mPersonCache(0),
+    mIgnoreLocalRevisions(false),
+    mConnectionPool(0),
+    mMaxPartitionSearches(1),
+    mPartitionError(false),
+    mPartitionCommit(0),
+    mPhase(ListEntries),
+    mFinishing(false),
     mLdapSearch(connection),
     mParentCollection(col),
     mTransaction(0),
-    mSearchbase(searchbase)
+    mSearchbase(searchbase),
+    mMostRecentTimestamp(-1)
 {
     Q_ASSERT(connection.handle());
     connect( &mLdapSearch, SIGNAL(result(KLDAP::LdapSearch*)),
@@ -50,6 +69,7 @@ void RetrieveItemsJob::doStart()
     job->fetchScope().setFetchModificationTime(false);
     job->fetchScope().setCacheOnly(true);
     job->fetchScope().fetchFullPayload(false);
+    job->fetchScope().fetchAttribute<ContentDigestAttribute>();
     connect(job, SIGNAL(itemsReceived(Akonadi::Item::List)), this, SLOT(localItemsReceived(Akonadi::Item::List)));
     connect(job, SIGNAL(result(KJob*)), this, SLOT(localFetchDone(KJob*)));
     mTime.start();
@@ -60,12 +80,51 @@ void RetrieveItemsJob::setFetchScope(RetrieveItemsJob::FetchScope fetchScope)
     mFetchScope = fetchScope;
 }
 
+void RetrieveItemsJob::setPageSize(int pageSize)
+{
+    mPageSize = qMax(0, pageSize);
+}
+
+void RetrieveItemsJob::setBatchSize(int batchSize)
+{
+    mBatchSize = qMax(1, batchSize);
+}
+
+void RetrieveItemsJob::setPersonCache(PersonCache *personCache)
+{
+    mPersonCache = personCache;
+}
+
+void RetrieveItemsJob::setIgnoreLocalRevisions(bool ignore)
+{
+    mIgnoreLocalRevisions = ignore;
+}
+
+void RetrieveItemsJob::setPartitioned(LdapConnectionPool *pool, int maxConcurrentSearches)
+{
+    mConnectionPool = pool;
+    mMaxPartitionSearches = qMax(1, maxConcurrentSearches);
+}
+
 void RetrieveItemsJob::localItemsReceived(const Akonadi::Item::List &items)
 {
     kDebug() << items.size();
     foreach (const Akonadi::Item &item, items) {
         kDebug() << item.remoteId() << item.remoteRevision();
-        mLocalItems.insert(item.remoteId(), item.remoteRevision());
+        if (item.mimeType() != KABC::Addressee::mimeType()) {
+            // contact groups of linked group collections, synchronized with their group
+            continue;
+        }
+        if (mIgnoreLocalRevisions) {
+            // never matches a timestamp from the server, not even a missing one (-1)
+            mLocalItems.insert(item.remoteId(), -2);
+            continue;
+        }
+        mLocalItems.insert(item.remoteId(), LDAPMapper::parseTimestamp(item.remoteRevision()));
+        const QByteArray digest = ContentDigestAttribute::itemDigest(item);
+        if (!digest.isEmpty()) {
+            mLocalDigests.insert(item.remoteId(), digest);
+        }
     }
 }
 
@@ -84,9 +143,205 @@ void RetrieveItemsJob::localFetchDone(KJob *job)
 void RetrieveItemsJob::search()
 {
     kDebug();
+    QStringList attributes;
+    if (mLocalItems.isEmpty()) {
+        // nothing to compare with, fetch everything in one go
+        mPhase = FetchEntries;
+        attributes = mFetchScope == FullPayload ? LDAPMapper::requestedFullPayloadAttributes()
+                                                : LDAPMapper::requestedLookupPayloadAttributes();
+    } else {
+        // only list identifiers and timestamps, the payload of new and modified entries is fetched afterwards
+        mPhase = ListEntries;
+        attributes << LDAPMapper::getAttribute(LDAPMapper::UniqueIdentifier) << "modifyTimestamp";
+    }
+
+    // this job holds a connection already, the others may be in use by other jobs
+    const int partitionSearches = mConnectionPool ? qMin(mMaxPartitionSearches, mConnectionPool->freeConnections()) : 0;
+    if (partitionSearches > 1) {
+        mMaxPartitionSearches = partitionSearches;
+        mPartitionAttributes = attributes;
+        searchPartitions();
+        return;
+    }
+
+    // with a page size the search also stops after each page (count == pagesize), so we get a
+    // result() signal per page and can flush the page before continuing
+    const int ret = mLdapSearch.search( KLDAP::LdapDN(mSearchbase), KLDAP::LdapUrl::Sub, QLatin1String("objectClass=inetorgperson"), attributes, mPageSize, mPageSize);
+    if (!ret) {
+        kWarning() << mLdapSearch.errorString();
+        kWarning() << "retrieval failed";
+        setError(KJob::UserDefinedError);
+        emitResult();
+    }
+}
+
+void RetrieveItemsJob::searchPartitions()
+{
+    addPartitions(QString());
+    startPartitionSearches();
+}
+
+void RetrieveItemsJob::addPartitions(const QString &prefix)
+{
+    const QString cn = LDAPMapper::escapeFilterValue(prefix);
+    const QString scope = prefix.isEmpty() ? QString() : QString::fromLatin1("(cn=%1*)").arg(cn);
+
+    QString others;
+    for (const char *c = PartitionCharacters; *c; ++c) {
+        const QString filter = QString::fromLatin1("(cn=%1%2*)").arg(cn).arg(QLatin1Char(*c));
+        mPendingPartitions << qMakePair(QString::fromLatin1("(&(objectClass=inetorgperson)%1)").arg(filter), prefix + QLatin1Char(*c));
+        others += filter;
+    }
+    // everything else, e.g. cn's starting with a space, punctuation or a non-latin letter
+    mPendingPartitions << qMakePair(QString::fromLatin1("(&(objectClass=inetorgperson)%1(!(|%2)))").arg(scope).arg(others), QString());
+}
+
+void RetrieveItemsJob::startPartitionSearches()
+{
+    // each search waits for a connection of its own
+    while (mPendingPartitions.count() > mPartitionRequests.count() &&
+           mPartitionSearches.count() + mPartitionRequests.count() < mMaxPartitionSearches) {
+        ConnectionRequest *request = mConnectionPool->requestConnection(this);
+        connect(request, SIGNAL(result(KJob*)), this, SLOT(partitionConnected(KJob*)));
+        mPartitionRequests.insert(request);
+    }
+
+    if (mPartitionSearches.isEmpty() && mPartitionRequests.isEmpty() && mPendingPartitions.isEmpty()) {
+        partitionsDone();
+    }
+}
+
+void RetrieveItemsJob::partitionConnected(KJob *request)
+{
+    mPartitionRequests.remove(request);
+    KLDAP::LdapConnection *connection = static_cast<ConnectionRequest*>(request)->connection();
+    if (!connection) {
+        kWarning() << "no connection for a partition";
+        mPendingPartitions.clear();
+        mPartitionError = true;
+        startPartitionSearches();
+        return;
+    }
+    if (mPendingPartitions.isEmpty()) {
+        mConnectionPool->checkin(connection);
+        startPartitionSearches();
+        return;
+    }
+
+    const QPair<QString, QString> partition = mPendingPartitions.takeFirst();
+    KLDAP::LdapSearch *search = new KLDAP::LdapSearch(*connection);
+    connect(search, SIGNAL(result(KLDAP::LdapSearch*)),
+            this, SLOT(gotPartitionResult(KLDAP::LdapSearch*)));
+    connect(search, SIGNAL(data(KLDAP::LdapSearch*,KLDAP::LdapObject)),
+            this, SLOT(gotSearchData(KLDAP::LdapSearch*,KLDAP::LdapObject)));
+    mPartitionSearches.insert(search, partition.second);
+    mPartitionConnections.insert(search, connection);
+
+    kDebug() << "searching" << partition.first;
+    if (!search->search(KLDAP::LdapDN(mSearchbase), KLDAP::LdapUrl::Sub, partition.first, mPartitionAttributes, mPageSize, mPageSize)) {
+        kWarning() << search->errorString();
+        mPartitionSearches.remove(search);
+        mConnectionPool->checkin(mPartitionConnections.take(search));
+        delete search;
+        mPartitionError = true;
+    }
+    startPartitionSearches();
+}
+
+void RetrieveItemsJob::gotPartitionResult(KLDAP::LdapSearch *search)
+{
+    if (!search->error() && !search->isFinished()) {
+        // end of a page, write what we have before requesting the next one
+        mPausedPartitions << search;
+        if (!mPartitionCommit) {
+            commitPartitionPage();
+        }
+        return;
+    }
+
+    const QString prefix = mPartitionSearches.take(search);
+    mConnectionPool->checkin(mPartitionConnections.take(search));
+    search->deleteLater();
+
+    if (search->error()) {
+        kWarning() << search->error() << search->errorString();
+        const bool tooLarge = search->error() == KLDAP_SIZELIMIT_EXCEEDED || search->error() == KLDAP_ADMINLIMIT_EXCEEDED;
+        if (tooLarge && !prefix.isEmpty() && prefix.length() < MaxPartitionPrefixLength) {
+            // what we got so far is kept, the duplicates are skipped in gotSearchData
+            kDebug() << "splitting" << prefix;
+            addPartitions(prefix);
+        } else {
+            mPartitionError = true;
+        }
+    }
+
+    startPartitionSearches();
+}
+
+void RetrieveItemsJob::commitPartitionPage()
+{
+    if (!mTransaction) {
+        continuePartitions();
+        return;
+    }
+    // entries of the other partitions arriving meanwhile go to a new transaction
+    mPartitionCommit = mTransaction;
+    mTransaction = 0;
+    mPartitionCommit->commit();
+}
+
+void RetrieveItemsJob::continuePartitions()
+{
+    const QList<KLDAP::LdapSearch*> paused = mPausedPartitions;
+    mPausedPartitions.clear();
+    foreach (KLDAP::LdapSearch *search, paused) {
+        search->continueSearch();
+    }
+}
+
+void RetrieveItemsJob::partitionsDone()
+{
+    kDebug() << mPartitionIds.size() << "entries listed";
+    mPartitionIds.clear();
+
+    if (mPartitionError) {
+        // entries may be missing, so nothing is removed, the job fails once the
+        // entries we got are written
+        commit();
+        return;
+    }
+
+    switch (mPhase) {
+        case ListEntries:
+            kDebug() << mPendingItems.size() << "new or modified entries";
+            mPhase = FetchEntries;
+            fetchNextBatch();
+            break;
+
+        case FetchEntries:
+            finish();
+            break;
+    }
+}
+
+void RetrieveItemsJob::fetchNextBatch()
+{
+    Q_ASSERT(mPhase == FetchEntries);
+    if (mPendingItems.isEmpty()) {
+        finish();
+        return;
+    }
+
+    QString filter = QLatin1String("(|");
+    for (int i = 0; i < mBatchSize && !mPendingItems.isEmpty(); ++i) {
+        filter += QString::fromLatin1("(%1=%2)").arg(LDAPMapper::getAttribute(LDAPMapper::UniqueIdentifier))
+                                                .arg(LDAPMapper::escapeFilterValue(mPendingItems.takeFirst()));
+    }
+    filter += QLatin1Char(')');
+
     const QStringList attributes = mFetchScope == FullPayload ? LDAPMapper::requestedFullPayloadAttributes()
                                                               : LDAPMapper::requestedLookupPayloadAttributes();
-    const int ret = mLdapSearch.search( KLDAP::LdapDN(mSearchbase), KLDAP::LdapUrl::Sub, QLatin1String("objectClass=inetorgperson"), attributes);
+    const int ret = mLdapSearch.search( KLDAP::LdapDN(mSearchbase), KLDAP::LdapUrl::Sub, filter, attributes);
     if (!ret) {
         kWarning() << mLdapSearch.errorString();
         kWarning() << "retrieval failed";
@@ -95,6 +350,44 @@ void RetrieveItemsJob::search()
     }
 }
 
+void RetrieveItemsJob::finish()
+{
+    //only do the removal if we got all entires without anything missing
+    Akonadi::Item::List toRemove;
+    toRemove.reserve(mLocalItems.size());
+    QHash<QString, qint64>::const_iterator it = mLocalItems.constBegin();
+    for (; it != mLocalItems.constEnd(); it++) {
+        kDebug() << "deleted " << it.key();
+        Akonadi::Item item;
+        item.setRemoteId(it.key());
+        toRemove << item;
+    }
+    if (!toRemove.isEmpty()) {
+        Akonadi::ItemDeleteJob *job = new Akonadi::ItemDeleteJob(toRemove, transaction());
+        transaction()->setIgnoreJobFailure(job);
+    }
+
+    if (mMostRecentTimestamp >= 0) {
+        Akonadi::Collection col = mParentCollection;
+        col.setRemoteRevision(LDAPMapper::formatTimestamp(mMostRecentTimestamp));
+
+        Akonadi::CollectionModifyJob *job = new Akonadi::CollectionModifyJob(col, transaction());
+        transaction()->setIgnoreJobFailure(job);
+    }
+
+    commit();
+}
+
+void RetrieveItemsJob::commit()
+{
+    mFinishing = true;
+    if (!mTransaction) { // no jobs created here -> done
+        done();
+    } else {
+        mTransaction->commit();
+    }
+}
+
 void RetrieveItemsJob::gotSearchResult(KLDAP::LdapSearch *search)
 {
     Q_UNUSED( search );
@@ -110,64 +403,109 @@ void RetrieveItemsJob::gotSearchResult(KLDAP::LdapSearch *search)
             default:
                 kWarning() << "Unknown error";
         }
-    } else {
-        //only do the removal if we got all entires without anything missing
-        Akonadi::Item::List toRemove;
-        toRemove.reserve(mLocalItems.size());
-        QHash<QString, QString>::const_iterator it = mLocalItems.constBegin();
-        for (; it != mLocalItems.constEnd(); it++) {
-            kDebug() << "deleted " << it.key();
-            Akonadi::Item item;
-            item.setRemoteId(it.key());
-            toRemove << item;
-        }
-        if (!toRemove.isEmpty()) {
-            Akonadi::ItemDeleteJob *job = new Akonadi::ItemDeleteJob(toRemove, transaction());
-            transaction()->setIgnoreJobFailure(job);
-        }
-
-        if (!mMostRecentTimestamp.isEmpty()) {
-            Akonadi::Collection col = mParentCollection;
-            col.setRemoteRevision(mMostRecentTimestamp);
+        commit();
+        return;
+    }
 
-            Akonadi::CollectionModifyJob *job = new Akonadi::CollectionModifyJob(col, transaction());
-            transaction()->setIgnoreJobFailure(job);
+    if (!search->isFinished()) {
+        // end of a page, write it before requesting the next one
+        kDebug() << "page done";
+        if (!mTransaction) {
+            mLdapSearch.continueSearch();
+        } else {
+            mTransaction->commit();
         }
-
+        return;
     }
-    if (!mTransaction) { // no jobs created here -> done
-        done();
-    } else {
-        mTransaction->commit();
+
+    switch (mPhase) {
+        case ListEntries:
+            kDebug() << mPendingItems.size() << "new or modified entries";
+            mPhase = FetchEntries;
+            fetchNextBatch();
+            break;
+
+        case FetchEntries:
+            if (mPendingItems.isEmpty()) {
+                finish();
+            } else if (!mTransaction) {
+                fetchNextBatch();
+            } else {
+                // write the batch before fetching the next one
+                mTransaction->commit();
+            }
+            break;
     }
 }
 
 void RetrieveItemsJob::gotSearchData(KLDAP::LdapSearch *search, const KLDAP::LdapObject &obj)
 {
-    Q_UNUSED( search );
     kWarning();
     kDebug() << "Object:";
     kDebug() << obj.toString();
-    kDebug() << "got person: " << obj.dn().toString() << obj.value("nsuniqueid") << obj.value("modifyTimestamp");
-    updateMostRecentTimestamp(LDAPMapper::getTimestamp(obj));
+    const QString id = LDAPMapper::getStableIdentifier(obj);
+    qint64 timestamp;
+    const QString revision = LDAPMapper::getTimestamp(obj, &timestamp);
+    kDebug() << "got person: " << obj.dn().toString() << id << revision;
+    if (search != &mLdapSearch) {
+        if (mPartitionIds.contains(id)) {
+            return;
+        }
+        mPartitionIds.insert(id);
+    }
+    updateMostRecentTimestamp(timestamp);
+
+    if (mPersonCache) {
+        mPersonCache->insert(obj.dn().toString(), id, revision);
+    }
+
+    bool modified = false;
+    const QHash<QString, qint64>::iterator it = mLocalItems.find(id);
+    if (it != mLocalItems.end()) {
+        if (*it == timestamp) {
+            kDebug() << "skipping " << id;
+            mLocalItems.erase(it);
+            return;
+        }
+        modified = true;
+        mLocalItems.erase(it);
+    }
+
+    if (mPhase == ListEntries) {
+        mPendingItems << id;
+        if (modified) {
+            mModifiedItems.insert(id);
+        }
+        return;
+    }
+
+    const bool modification = modified || mModifiedItems.remove(id);
+    const QByteArray digest = LDAPMapper::getContentDigest(obj);
+    if (modification && mLocalDigests.value(id) == digest) {
+        // only attributes we don't map have changed. The new revision is still recorded, otherwise
+        // every later sync would fetch the entry again.
+        kDebug() << "unchanged content" << id;
+        Akonadi::Item item;
+        item.setRemoteId(id);
+        item.setMimeType(KABC::Addressee::mimeType());
+        item.setParentCollection(mParentCollection);
+        item.setRemoteRevision(revision);
+        Akonadi::ItemModifyJob *modifyJob = new Akonadi::ItemModifyJob(item, transaction());
+        modifyJob->setIgnorePayload(true);
+        return;
+    }
 
     Akonadi::Item item;
-    item.setRemoteId(LDAPMapper::getStableIdentifier(obj));
+    item.setRemoteId(id);
     item.setPayload(LDAPMapper::getAddressee(obj));
     item.setMimeType(KABC::Addressee::mimeType());
     item.setParentCollection(mParentCollection);
-    item.setRemoteRevision(LDAPMapper::getTimestamp(obj));
+    item.setRemoteRevision(revision);
+    item.addAttribute(new ContentDigestAttribute(digest));
 
-    
-    const QHash<QString, QString>::iterator it = mLocalItems.find(item.remoteId());
-    if (it != mLocalItems.end()) {
-        if (*it == LDAPMapper::getTimestamp(obj)) {
-            kDebug() << "skipping " << item.remoteId();
-        } else {
-            kDebug() << "modification";
-            new Akonadi::ItemModifyJob(item, transaction());
-        }
-        mLocalItems.erase(it);
+    if (modification) {
+        kDebug() << "modification";
+        new Akonadi::ItemModifyJob(item, transaction());
         return;
     }
     //new item
@@ -189,21 +527,38 @@ void RetrieveItemsJob::transactionDone (KJob* job)
     if (job->error()) {
         return; // handled by base class
     }
-    done();
+    if (job == mPartitionCommit) {
+        mPartitionCommit = 0;
+        continuePartitions();
+        return;
+    }
+    mTransaction = 0;
+
+    if (mFinishing) {
+        done();
+    } else if (!mLdapSearch.isFinished()) {
+        // only a page has been committed
+        mLdapSearch.continueSearch();
+    } else {
+        // only a batch has been committed
+        fetchNextBatch();
+    }
 }
 
 void RetrieveItemsJob::done()
 {
     kDebug() << "Done. Took " << mTime.elapsed()/1000.0 << " s";
+    if (mPartitionError) {
+        kWarning() << "retrieval failed";
+        setError(KJob::UserDefinedError);
+    }
     emitResult();
 }
 
-void RetrieveItemsJob::updateMostRecentTimestamp(const QString &timestamp)
+void RetrieveItemsJob::updateMostRecentTimestamp(qint64 timestamp)
 {
-    if (!timestamp.isEmpty()) {
-        if (mMostRecentTimestamp.isEmpty() || mMostRecentTimestamp < timestamp) {
-            mMostRecentTimestamp = timestamp;
-        }
+    if (timestamp > mMostRecentTimestamp) {
+        mMostRecentTimestamp = timestamp;
     }
 }
 
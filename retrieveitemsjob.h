@@ -26,6 +26,11 @@
 #include <akonadi/item.h>
 #include <akonadi/transactionsequence.h>
 #include <QDateTime>
+#include <QPair>
+#include <QSet>
+
+class LdapConnectionPool;
+class PersonCache;
 
 class RetrieveItemsJob :  public Akonadi::Job
 {
@@ -41,12 +46,45 @@ public:
     
     void setFetchScope(FetchScope fetchScope);
 
+    /**
+     * Request the entries in pages of @p pageSize using the simple paged results control (RFC 2696).
+     * Each page is written to Akonadi before the next one is requested. 0 disables paging.
+     */
+    void setPageSize(int pageSize);
+
+    /**
+     * Number of new or modified entries whose payload is fetched with a single search.
+     */
+    void setBatchSize(int batchSize);
+
+    /**
+     * Record every person seen in @p personCache, for resolving group members later on
+     */
+    void setPersonCache(PersonCache *personCache);
+
+    /**
+     * Write all entries again instead of skipping those whose revision or content digest
+     * matches the local item, e.g. after the attribute mapping has changed
+     */
+    void setIgnoreLocalRevisions(bool ignore);
+
+    /**
+     * List the entries with several concurrent searches over connections from @p pool,
+     * each for the persons whose cn starts with a given prefix. Prefixes exceeding the
+     * server's size limit are split further. No more searches are run than the pool has
+     * free connections, without at least two the entries are listed with a single search.
+     * If a partition fails the job fails as well.
+     */
+    void setPartitioned(LdapConnectionPool *pool, int maxConcurrentSearches);
+
 signals:
     void contactsRetrieved(const Akonadi::Item::List &);
     
 private Q_SLOTS:
     void gotSearchResult(KLDAP::LdapSearch *search);
     void gotSearchData(KLDAP::LdapSearch *search, const KLDAP::LdapObject &obj);
+    void partitionConnected(KJob *request);
+    void gotPartitionResult(KLDAP::LdapSearch *search);
     void localFetchDone(KJob*);
     void localItemsReceived(const Akonadi::Item::List &);
     void transactionDone(KJob* job);
@@ -54,17 +92,58 @@ private Q_SLOTS:
 private:
     Akonadi::TransactionSequence *transaction();
     void search();
+    void searchPartitions();
+    void addPartitions(const QString &prefix);
+    void startPartitionSearches();
+    void commitPartitionPage();
+    void continuePartitions();
+    void partitionsDone();
+    void fetchNextBatch();
+    void finish();
+    void commit();
     void done();
-    void updateMostRecentTimestamp(const QString &timestamp);
+    void updateMostRecentTimestamp(qint64 timestamp);
 
     FetchScope mFetchScope;
+    int mPageSize;
+    int mBatchSize;
+    PersonCache *mPersonCache;
+    bool mIgnoreLocalRevisions;
+
+    LdapConnectionPool *mConnectionPool;
+    int mMaxPartitionSearches;
+    // filter -> cn prefix it is split on if too large, empty for the remainder of a prefix
+    QList<QPair<QString, QString> > mPendingPartitions;
+    QHash<KLDAP::LdapSearch*, QString> mPartitionSearches;
+    QHash<KLDAP::LdapSearch*, KLDAP::LdapConnection*> mPartitionConnections;
+    // waiting for a connection, see LdapConnectionPool::requestConnection()
+    QSet<KJob*> mPartitionRequests;
+    QStringList mPartitionAttributes;
+    // partitions are retried after splitting them, some entries show up twice
+    QSet<QString> mPartitionIds;
+    bool mPartitionError;
+    // partition searches at the end of a page, continued once it has been written
+    QList<KLDAP::LdapSearch*> mPausedPartitions;
+    Akonadi::TransactionSequence *mPartitionCommit;
+
+    enum Phase {
+        ListEntries,
+        FetchEntries
+    };
+    Phase mPhase;
+    bool mFinishing;
     KLDAP::LdapSearch mLdapSearch;
     Akonadi::Collection mParentCollection;
-    QHash<QString, QString> mLocalItems;
+    // remote id -> modifyTimestamp of the local items, see LDAPMapper::getTimestampValue()
+    QHash<QString, qint64> mLocalItems;
+    // remote id -> content digest of the local items
+    QHash<QString, QByteArray> mLocalDigests;
+    QStringList mPendingItems;
+    QSet<QString> mModifiedItems;
     Akonadi::TransactionSequence *mTransaction;
     QString mSearchbase;
     QTime mTime;
-    QString mMostRecentTimestamp;
+    qint64 mMostRecentTimestamp;
 };
 
 #endif // RETRIEVEITEMSJOB_H
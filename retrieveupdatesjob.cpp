@@ -17,17 +17,29 @@
  */
 
 #include "retrieveupdatesjob.h"
+#include "contentdigestattribute.h"
 
 #include "ldapmapper.h"
+#include "personcache.h"
 
 #include <kldap/ldapdefs.h>
 
+#include <KABC/Addressee>
+
+#include <QRegExp>
+
 RetrieveUpdatesJob::RetrieveUpdatesJob(const QString &timestamp, const QString &searchBase, KLDAP::LdapConnection &connection, QObject *parent)
 :   KJob(parent),
-    mTimeQuery(QString::fromUtf8("(&(modifyTimestamp>=%1)(!(modifyTimestamp=%1)))").arg(timestamp)),
+    mTimestamp(timestamp),
+    mOverlap(0),
     mSearchbase(searchBase),
     mLdapSearch(connection),
-    mPhase(RetrieveItemUpdates)
+    mPhase(RetrieveItemUpdates),
+    mNextTimestamp(-1),
+    mDeletionDetection(NoDeletionDetection),
+    mLastChangeNumber(0),
+    mPersonCache(0),
+    mFullPayload(true)
 {
     Q_ASSERT(connection.handle());
     connect(&mLdapSearch, SIGNAL(result(KLDAP::LdapSearch*)),
@@ -39,7 +51,7 @@ RetrieveUpdatesJob::RetrieveUpdatesJob(const QString &timestamp, const QString &
     QMetaObject::invokeMethod(this, "start", Qt::QueuedConnection);
 }
 
-QStringList RetrieveUpdatesJob::items() const
+Akonadi::Item::List RetrieveUpdatesJob::items() const
 {
     return mItems;
 }
@@ -49,14 +61,49 @@ GroupUpdateList RetrieveUpdatesJob::groups() const
     return mGroups;
 }
 
-QString RetrieveUpdatesJob::nextTimestamp() const
+QStringList RetrieveUpdatesJob::deletedIds() const
+{
+    return mDeletedIds;
+}
+
+qint64 RetrieveUpdatesJob::nextTimestamp() const
 {
     return mNextTimestamp;
 }
 
+void RetrieveUpdatesJob::setOverlap(int seconds)
+{
+    mOverlap = qMax(0, seconds);
+}
+
+void RetrieveUpdatesJob::setDeletionDetection(DeletionDetection detection, qint64 lastChangeNumber)
+{
+    mDeletionDetection = detection;
+    mLastChangeNumber = lastChangeNumber;
+}
+
+qint64 RetrieveUpdatesJob::lastChangeNumber() const
+{
+    return mLastChangeNumber;
+}
+
+void RetrieveUpdatesJob::setPersonCache(PersonCache *personCache)
+{
+    mPersonCache = personCache;
+}
+
+void RetrieveUpdatesJob::setFullPayload(bool full)
+{
+    mFullPayload = full;
+}
+
 void RetrieveUpdatesJob::start()
 {
-    retrieveItemUpdates();
+    if (mDeletionDetection == RetroChangelog && mLastChangeNumber <= 0) {
+        retrieveLastChangeNumber();
+    } else {
+        retrieveItemUpdates();
+    }
 }
 
 void RetrieveUpdatesJob::gotSearchResult(KLDAP::LdapSearch *search)
@@ -76,11 +123,24 @@ void RetrieveUpdatesJob::gotSearchResult(KLDAP::LdapSearch *search)
     }
 
     switch (mPhase) {
+        case RetrieveLastChangeNumber:
+            mPhase = RetrieveItemUpdates;
+            retrieveItemUpdates();
+            break;
+
         case RetrieveItemUpdates:
             retrieveGroupUpdates();
             break;
 
         case RetrieveGroupUpdates:
+            if (mDeletionDetection == NoDeletionDetection) {
+                emitResult();
+            } else {
+                retrieveDeletions();
+            }
+            break;
+
+        case RetrieveDeletions:
             emitResult();
             return;
     }
@@ -96,11 +156,35 @@ void RetrieveUpdatesJob::gotSearchData(KLDAP::LdapSearch *search, const KLDAP::L
     const QString id = LDAPMapper::getStableIdentifier(obj);
 
     switch (mPhase) {
+        case RetrieveLastChangeNumber:
+            // the root DSE attributes are not necessarily returned in lower case
+            for (KLDAP::LdapAttrMap::ConstIterator it = obj.attributes().constBegin(); it != obj.attributes().constEnd(); ++it) {
+                if (it.key().compare(QLatin1String("lastchangenumber"), Qt::CaseInsensitive) == 0 && !it.value().isEmpty()) {
+                    mLastChangeNumber = it.value().first().toLongLong();
+                }
+            }
+            kDebug() << "starting at change number" << mLastChangeNumber;
+            break;
         case RetrieveItemUpdates:
+        {
             kDebug() << "got person update";
-            mItems << id;
-            updateNextTimestamp(LDAPMapper::getTimestamp(obj));
+            qint64 timestampValue;
+            const QString timestamp = LDAPMapper::getTimestamp(obj, &timestampValue);
+
+            Akonadi::Item item;
+            item.setRemoteId(id);
+            item.setPayload(LDAPMapper::getAddressee(obj));
+            item.setMimeType(KABC::Addressee::mimeType());
+            item.setRemoteRevision(timestamp);
+            item.addAttribute(new ContentDigestAttribute(LDAPMapper::getContentDigest(obj)));
+            mItems << item;
+
+            if (mPersonCache) {
+                mPersonCache->insert(obj.dn().toString(), id, timestamp);
+            }
+            updateNextTimestamp(timestampValue);
             break;
+        }
         case RetrieveGroupUpdates:
             kDebug() << "got group update";
             mGroups << GroupUpdate(obj);
@@ -109,21 +193,59 @@ void RetrieveUpdatesJob::gotSearchData(KLDAP::LdapSearch *search, const KLDAP::L
             // group updates is a separated query so there might have been item updates in between
             // which we don't want to miss next time
             if (mItems.isEmpty()) {
-                updateNextTimestamp(LDAPMapper::getTimestamp(obj));
+                updateNextTimestamp(LDAPMapper::getTimestampValue(obj));
+            }
+            break;
+        case RetrieveDeletions:
+            if (mDeletionDetection == RetroChangelog) {
+                const QString targetId = QString::fromUtf8(obj.value(QLatin1String("targetUniqueId")));
+                const QString targetDn = QString::fromUtf8(obj.value(QLatin1String("targetDn")));
+                const qint64 changeNumber = obj.value(QLatin1String("changeNumber")).toLongLong();
+                kDebug() << "got deletion" << changeNumber << targetDn << targetId;
+                mLastChangeNumber = qMax(mLastChangeNumber, changeNumber);
+                if (!isBelowSearchBase(targetDn)) {
+                    // the changelog covers the whole server
+                    break;
+                }
+                if (targetId.isEmpty()) {
+                    kWarning() << "changelog entry without targetUniqueId, is it enabled in the retro changelog plugin?";
+                    break;
+                }
+                mDeletedIds << targetId;
+            } else {
+                // tombstones keep the nsuniqueid of the deleted entry.
+                // their timestamp is not used as a watermark, there might be unseen updates in between
+                kDebug() << "got tombstone" << id;
+                mDeletedIds << id;
             }
             break;
     }
 }
 
+void RetrieveUpdatesJob::retrieveLastChangeNumber()
+{
+    mPhase = RetrieveLastChangeNumber;
+
+    const int ret = mLdapSearch.search(KLDAP::LdapDN(QString()), KLDAP::LdapUrl::Base, QLatin1String("objectClass=*"),
+                                       QStringList() << "lastchangenumber");
+    if (!ret) {
+        kWarning() << mLdapSearch.errorString();
+        kWarning() << "retrieval failed";
+        setError(KJob::UserDefinedError);
+        emitResult();
+    }
+}
+
 void RetrieveUpdatesJob::retrieveItemUpdates()
 {
     Q_ASSERT(mPhase == RetrieveItemUpdates);
 
-    const QString query = QLatin1String("(objectClass=inetorgperson)"); //+ mTimeQuery + QLatin1String(")");
+    const QString query = QLatin1String("(&(objectClass=inetorgperson)") + timeQuery() + QLatin1String(")");
 
+    // fetch the payload right away instead of searching each changed person again
     const int ret = mLdapSearch.search(KLDAP::LdapDN(mSearchbase), KLDAP::LdapUrl::Sub, query,
-                                       QStringList() << LDAPMapper::getAttribute(LDAPMapper::UniqueIdentifier)
-                                                     << "modifyTimestamp");
+                                       mFullPayload ? LDAPMapper::requestedFullPayloadAttributes()
+                                                    : LDAPMapper::requestedLookupPayloadAttributes());
     if (!ret) {
         kWarning() << mLdapSearch.errorString();
         kWarning() << "retrieval failed";
@@ -136,10 +258,11 @@ void RetrieveUpdatesJob::retrieveGroupUpdates()
 {
     mPhase = RetrieveGroupUpdates;
 
-    const QString query = QLatin1String("(&(|(objectClass=groupofuniquenames)(objectClass=kolabgroupofuniquenames))") + mTimeQuery + QLatin1String(")");
+    const QString query = QLatin1String("(&(|(objectClass=groupofuniquenames)(objectClass=kolabgroupofuniquenames))") + timeQuery() + QLatin1String(")");
 
     const int ret = mLdapSearch.search(KLDAP::LdapDN(mSearchbase), KLDAP::LdapUrl::Sub, query,
-                                       QStringList() << LDAPMapper::getAttribute(LDAPMapper::UniqueIdentifier) << "cn" << "modifyTimestamp");
+                                       QStringList() << LDAPMapper::getAttribute(LDAPMapper::UniqueIdentifier) << "cn" << "modifyTimestamp"
+                                                     << "uniqueMember");
     if (!ret) {
         kWarning() << mLdapSearch.errorString();
         kWarning() << "retrieval failed";
@@ -148,11 +271,47 @@ void RetrieveUpdatesJob::retrieveGroupUpdates()
     }
 }
 
-void RetrieveUpdatesJob::updateNextTimestamp(const QString &itemTimestamp)
+void RetrieveUpdatesJob::retrieveDeletions()
 {
-    if (!itemTimestamp.isEmpty()) {
-        if (mNextTimestamp.isEmpty() || mNextTimestamp < itemTimestamp) {
-            mNextTimestamp = itemTimestamp;
-        }
+    mPhase = RetrieveDeletions;
+
+    int ret;
+    if (mDeletionDetection == RetroChangelog) {
+        const QString query = QString::fromLatin1("(&(changeType=delete)(changeNumber>=%1))").arg(mLastChangeNumber + 1);
+        ret = mLdapSearch.search(KLDAP::LdapDN(QLatin1String("cn=changelog")), KLDAP::LdapUrl::One, query,
+                                 QStringList() << "changeNumber" << "targetDn" << "targetUniqueId");
+    } else {
+        const QString query = QLatin1String("(&(objectClass=nsTombstone)") + timeQuery() + QLatin1String(")");
+        ret = mLdapSearch.search(KLDAP::LdapDN(mSearchbase), KLDAP::LdapUrl::Sub, query,
+                                 QStringList() << LDAPMapper::getAttribute(LDAPMapper::UniqueIdentifier) << "modifyTimestamp");
     }
+    if (!ret) {
+        kWarning() << mLdapSearch.errorString();
+        kWarning() << "retrieval failed";
+        setError(KJob::UserDefinedError);
+        emitResult();
+    }
+}
+
+void RetrieveUpdatesJob::updateNextTimestamp(qint64 itemTimestamp)
+{
+    if (itemTimestamp > mNextTimestamp) {
+        mNextTimestamp = itemTimestamp;
+    }
+}
+
+bool RetrieveUpdatesJob::isBelowSearchBase(const QString &dn) const
+{
+    // DNs might differ in case and in the spaces around separators
+    static const QRegExp separator(QLatin1String("\\s*([,=])\\s*"));
+    const QString entry = PersonCache::normalizedDn(dn).replace(separator, QLatin1String("\\1"));
+    const QString base = PersonCache::normalizedDn(mSearchbase).replace(separator, QLatin1String("\\1"));
+    return base.isEmpty() || entry == base || entry.endsWith(QLatin1Char(',') + base);
+}
+
+QString RetrieveUpdatesJob::timeQuery() const
+{
+    // not strictly newer: entries modified within the same second after the last run
+    // carry the same timestamp. Already applied ones are skipped based on their remote revision
+    return QString::fromLatin1("(modifyTimestamp>=%1)").arg(LDAPMapper::rewindTimestamp(mTimestamp, mOverlap));
 }
@@ -28,16 +28,62 @@
 
 #include <kjob.h>
 
+class PersonCache;
+
 class RetrieveUpdatesJob : public KJob
 {
     Q_OBJECT
 public:
+    enum DeletionDetection {
+        NoDeletionDetection,
+        RetroChangelog,
+        Tombstones
+    };
+
     RetrieveUpdatesJob(const QString &timestamp, const QString &searchBase, KLDAP::LdapConnection &connection, QObject *parent = 0);
 
-    QStringList items() const;
+    /**
+     * Changed persons, including their payload
+     */
+    Akonadi::Item::List items() const;
     GroupUpdateList groups() const;
+    QStringList deletedIds() const;
+
+    /**
+     * Most recent modifyTimestamp seen, see LDAPMapper::getTimestampValue(), -1 if none
+     */
+    qint64 nextTimestamp() const;
+
+    /**
+     * Rewinds the watermark by @p seconds when querying for updates, so that entries written
+     * with an older timestamp after the last run (e.g. by a lagging replica) are not missed.
+     */
+    void setOverlap(int seconds);
 
-    QString nextTimestamp() const;
+    /**
+     * Also look for deleted persons and groups, either in the 389 DS retro changelog
+     * (cn=changelog, requires targetUniqueId to be logged) starting after @p lastChangeNumber,
+     * or in the tombstone entries newer than the watermark.
+     *
+     * Without a @p lastChangeNumber the changelog is not scanned from its beginning, the
+     * current change number is taken from the root DSE instead.
+     */
+    void setDeletionDetection(DeletionDetection detection, qint64 lastChangeNumber = 0);
+
+    /**
+     * Highest change number seen in the retro changelog
+     */
+    qint64 lastChangeNumber() const;
+
+    /**
+     * Record changed persons in @p personCache
+     */
+    void setPersonCache(PersonCache *personCache);
+
+    /**
+     * Fetch the full payload of changed persons, instead of only the lookup attributes
+     */
+    void setFullPayload(bool full);
 
 public Q_SLOTS:
     virtual void start();
@@ -47,23 +93,36 @@ private Q_SLOTS:
     void gotSearchData(KLDAP::LdapSearch *search, const KLDAP::LdapObject &obj);
 
 private:
+    void retrieveLastChangeNumber();
     void retrieveItemUpdates();
     void retrieveGroupUpdates();
-    void updateNextTimestamp(const QString &itemTimestamp);
+    void retrieveDeletions();
+    void updateNextTimestamp(qint64 itemTimestamp);
+    bool isBelowSearchBase(const QString &dn) const;
+    QString timeQuery() const;
 
-    const QString mTimeQuery;
+    const QString mTimestamp;
+    int mOverlap;
     const QString mSearchbase;
     KLDAP::LdapSearch mLdapSearch;
 
     enum Phase {
+        RetrieveLastChangeNumber,
         RetrieveItemUpdates,
-        RetrieveGroupUpdates
+        RetrieveGroupUpdates,
+        RetrieveDeletions
     };
     Phase mPhase;
 
-    QStringList mItems;
+    Akonadi::Item::List mItems;
     GroupUpdateList mGroups;
-    QString mNextTimestamp;
+    QStringList mDeletedIds;
+    qint64 mNextTimestamp;
+
+    DeletionDetection mDeletionDetection;
+    qint64 mLastChangeNumber;
+    PersonCache *mPersonCache;
+    bool mFullPayload;
 };
 
 #endif // RETRIEVEUPDATESJOB_H
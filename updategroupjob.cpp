@@ -18,8 +18,17 @@
 
 #include "updategroupjob.h"
 
+#include "groupmembersattribute.h"
 #include "incrementalupdatedata.h"
 #include "ldapmapper.h"
+#include "linkgroupmembersjob.h"
+#include "membersdigestattribute.h"
+#include "nestedgroupsattribute.h"
+#include "personcache.h"
+#include "resolvemembersjob.h"
+
+#include <KABC/Addressee>
+#include <KABC/ContactGroup>
 
 #include <kldap/ldapdefs.h>
 
@@ -28,6 +37,7 @@
 #include <akonadi/itemdeletejob.h>
 #include <akonadi/itemfetchjob.h>
 #include <akonadi/itemfetchscope.h>
+#include <akonadi/itemmodifyjob.h>
 #include <akonadi/transactionsequence.h>
 
 UpdateGroupJob::UpdateGroupJob(const QString &searchBase, KLDAP::LdapConnection &connection, const Akonadi::Collection &collection, QObject *parent)
@@ -35,15 +45,24 @@ UpdateGroupJob::UpdateGroupJob(const QString &searchBase, KLDAP::LdapConnection
     mTransaction(0),
     mSearchbase(searchBase),
     mConnection(connection),
-    mLdapSearch(connection),
+    mSearches(connection),
+    mMaxConcurrentSearches(LdapSearchQueue::DefaultMaxConcurrentSearches),
+    mBatchSize(LdapSearchQueue::DefaultBatchSize),
+    mPersonCache(0),
+    mMaxNestingDepth(0),
+    mLinkMembers(false),
+    mItemIndex(0),
+    mMemberOfLookup(false),
+    mPageSize(0),
+    mFullPayload(true),
     mCollection(collection),
-    mPhase(ListMembers)
+    mMembersChanged(false)
 {
     Q_ASSERT(connection.handle());
-    connect(&mLdapSearch, SIGNAL(result(KLDAP::LdapSearch*)),
-            this, SLOT(gotSearchResult(KLDAP::LdapSearch*)));
-    connect(&mLdapSearch, SIGNAL(data(KLDAP::LdapSearch*,KLDAP::LdapObject)),
-            this, SLOT(gotSearchData(KLDAP::LdapSearch*,KLDAP::LdapObject)));
+    connect(&mSearches, SIGNAL(data(KLDAP::LdapObject)),
+            this, SLOT(gotSearchData(KLDAP::LdapObject)));
+    connect(&mSearches, SIGNAL(finished()),
+            this, SLOT(searchFinished()));
 
     // autostart like an Akonadi::Job
     QMetaObject::invokeMethod(this, "start", Qt::QueuedConnection);
@@ -54,22 +73,77 @@ UpdateGroupJob::UpdateGroupJob(const GroupUpdate &updateData, const QString &sea
     mTransaction(0),
     mName(updateData.name),
     mTimestamp(updateData.timestamp),
+    mMembersDigest(updateData.membersDigest),
     mSearchbase(searchBase),
     mConnection(connection),
-    mLdapSearch(connection),
+    mSearches(connection),
+    mMaxConcurrentSearches(LdapSearchQueue::DefaultMaxConcurrentSearches),
+    mBatchSize(LdapSearchQueue::DefaultBatchSize),
+    mPersonCache(0),
+    mMaxNestingDepth(0),
+    mLinkMembers(false),
+    mItemIndex(0),
+    mMemberOfLookup(false),
+    mPageSize(0),
+    mFullPayload(true),
     mCollection(collection),
-    mPhase(ListMembers)
+    mMembersChanged(false)
 {
     Q_ASSERT(connection.handle());
-    connect(&mLdapSearch, SIGNAL(result(KLDAP::LdapSearch*)),
-            this, SLOT(gotSearchResult(KLDAP::LdapSearch*)));
-    connect(&mLdapSearch, SIGNAL(data(KLDAP::LdapSearch*,KLDAP::LdapObject)),
-            this, SLOT(gotSearchData(KLDAP::LdapSearch*,KLDAP::LdapObject)));
+    connect(&mSearches, SIGNAL(data(KLDAP::LdapObject)),
+            this, SLOT(gotSearchData(KLDAP::LdapObject)));
+    connect(&mSearches, SIGNAL(finished()),
+            this, SLOT(searchFinished()));
 
     // autostart like an Akonadi::Job
     QMetaObject::invokeMethod(this, "start", Qt::QueuedConnection);
 }
 
+void UpdateGroupJob::setMaxConcurrentSearches(int count)
+{
+    mMaxConcurrentSearches = count;
+}
+
+void UpdateGroupJob::setBatchSize(int size)
+{
+    mBatchSize = size;
+}
+
+void UpdateGroupJob::setPersonCache(PersonCache *personCache)
+{
+    mPersonCache = personCache;
+}
+
+void UpdateGroupJob::setMaxNestingDepth(int depth)
+{
+    mMaxNestingDepth = depth;
+}
+
+void UpdateGroupJob::setLinkMembers(bool link)
+{
+    mLinkMembers = link;
+}
+
+void UpdateGroupJob::setItemIndex(ItemIndex *itemIndex)
+{
+    mItemIndex = itemIndex;
+}
+
+void UpdateGroupJob::setMemberOfLookup(bool memberOf)
+{
+    mMemberOfLookup = memberOf;
+}
+
+void UpdateGroupJob::setPageSize(int pageSize)
+{
+    mPageSize = pageSize;
+}
+
+void UpdateGroupJob::setFullPayload(bool full)
+{
+    mFullPayload = full;
+}
+
 void UpdateGroupJob::start()
 {
     if (!mName.isEmpty() || !mTimestamp.isEmpty()) {
@@ -83,15 +157,15 @@ void UpdateGroupJob::start()
         Akonadi::CollectionModifyJob *modifyJob = new Akonadi::CollectionModifyJob(mCollection, this);
         connect(modifyJob, SIGNAL(result(KJob*)), this, SLOT(collectionModifyDone(KJob*)));
     } else {
-        fetchLocalItems();
+        updateMembers();
     }
 }
 
-void UpdateGroupJob::gotSearchResult(KLDAP::LdapSearch *search)
+void UpdateGroupJob::searchFinished()
 {
-    if (search->error()) {
-        kWarning() << search->error() << search->errorString();
-        switch (search->error()) {
+    if (mSearches.error()) {
+        kWarning() << mSearches.error() << mSearches.errorString();
+        switch (mSearches.error()) {
             case KLDAP_SIZELIMIT_EXCEEDED:
                 kWarning() << "Sizelimit exceeded";
                 break;
@@ -106,50 +180,119 @@ void UpdateGroupJob::gotSearchResult(KLDAP::LdapSearch *search)
         return;
     }
 
-    switch (mPhase) {
-        case ListMembers:
-            processMembers();
-            break;
+    processMembers();
+}
 
-        case FetchMembers:
-            if (!mTransaction) { // no jobs created here -> done
-                emitResult();
-            } else {
-                mTransaction->commit();
-            }
-            break;
+void UpdateGroupJob::gotSearchData(const KLDAP::LdapObject &obj)
+{
+    // ignore all objects that are available as local items.
+    // if they have an update, they will be updated by IncrementalUpdateJob
+    // later on using UpdateItemJob on all collections
+
+    mGroupDn = obj.dn().toString();
+    mGroupName = obj.value(QLatin1String("cn"));
+    mGroupTimestamp = LDAPMapper::getTimestamp(obj);
+    if (!mMemberOfLookup) {
+        mMembersDigest = LDAPMapper::getMembersDigest(obj);
+    }
+    foreach (const QByteArray &val, obj.values("uniqueMember")) {
+        mNewMembers << val;
     }
 }
 
-void UpdateGroupJob::gotSearchData(KLDAP::LdapSearch *search, const KLDAP::LdapObject &obj)
+void UpdateGroupJob::resolveMembersDone(KJob *job)
 {
-    Q_UNUSED(search);
+    if (job->error()) {
+        setError(KJob::UserDefinedError);
+        emitResult();
+        return;
+    }
 
-    switch (mPhase) {
-        case ListMembers: {
-            // ignore all objects that are available as local items.
-            // if they have an update, they will be updated by IncrementalUpdateJob
-            // later on using UpdateItemJob on all collections
+    // lets updates of the nested groups find this one
+    mNestedGroups = static_cast<ResolveMembersJob*>(job)->nestedGroupDns();
+
+    if (mLinkMembers) {
+        // references the members, like the one RetrieveGroupMembersJob stores
+        KABC::ContactGroup group;
+        group.setName(mGroupName.isEmpty() ? mCollection.name() : mGroupName);
+        Akonadi::Item contactGroup;
+        contactGroup.setRemoteId(mCollection.remoteId());
+        contactGroup.setMimeType(KABC::ContactGroup::mimeType());
+        contactGroup.setRemoteRevision(mGroupTimestamp);
+        contactGroup.setPayload(group);
+
+        LinkGroupMembersJob *linkJob = new LinkGroupMembersJob(mCollection, static_cast<ResolveMembersJob*>(job)->items(), this);
+        linkJob->setContactGroup(contactGroup);
+        linkJob->setItemIndex(mItemIndex);
+        connect(linkJob, SIGNAL(result(KJob*)), this, SLOT(linkMembersDone(KJob*)));
+        return;
+    }
 
-            foreach (const QByteArray &val, obj.values("uniqueMember")) {
-                mNewMembers << val;
-            }
-            break;
+    const QHash<QString, Akonadi::Item> items = static_cast<ResolveMembersJob*>(job)->itemsByDn();
+    for (QHash<QString, Akonadi::Item>::const_iterator it = items.constBegin(); it != items.constEnd(); ++it) {
+        Akonadi::Item item = it.value();
+        mMemberIds.insert(it.key(), item.remoteId());
+        if (keepMember(item.remoteId())) {
+            // still a member, updates of the person itself are applied by IncrementalUpdateJob
+            continue;
         }
+        item.setParentCollection(mCollection);
+        if (!mFullPayload) {
+            // see RetrieveGroupMembersJob::processMember()
+            item.clearPayload();
+        }
+        Akonadi::ItemCreateJob *createJob = new Akonadi::ItemCreateJob(item, mCollection, transaction());
+        connect(createJob, SIGNAL(result(KJob*)), this, SLOT(itemCreated(KJob*)));
+        mMembersChanged = true;
+    }
 
-        case FetchMembers: {
-            Akonadi::Item item;
-            item.setRemoteId(LDAPMapper::getStableIdentifier(obj));
-            item.setPayload(LDAPMapper::getAddressee(obj));
-            item.setMimeType(KABC::Addressee::mimeType());
-            item.setParentCollection(mCollection);
-            item.setRemoteRevision(LDAPMapper::getTimestamp(obj));
+    removeFormerMembers();
 
-            new Akonadi::ItemCreateJob(item, mCollection, transaction());
-            break;
-        }
+    if (!mTransaction) { // no jobs created here -> continue with the contact group
+        writeContactGroup();
+    } else {
+        mTransaction->commit();
+    }
+}
+
+void UpdateGroupJob::itemCreated(KJob *job)
+{
+    if (!job->error()) {
+        mMemberItemIds.insert(static_cast<Akonadi::ItemCreateJob*>(job)->item().id());
+    }
+}
+
+void UpdateGroupJob::contactGroupDone(KJob *job)
+{
+    if (job->error()) {
+        kWarning() << job->errorString();
+
+        // try to proceed as far as possible
+    }
+
+    storeMembersDigest();
+}
+
+void UpdateGroupJob::linkMembersDone(KJob *job)
+{
+    if (job->error()) {
+        setError(KJob::UserDefinedError);
+        emitResult();
+        return;
     }
 
+    storeMembersDigest();
+}
+
+void UpdateGroupJob::digestStored(KJob *job)
+{
+    if (job->error()) {
+        kWarning() << job->errorString();
+
+        // the members are up to date, they will just be compared again next time
+    }
+
+    emitResult();
 }
 
 void UpdateGroupJob::collectionModifyDone(KJob *job)
@@ -160,7 +303,7 @@ void UpdateGroupJob::collectionModifyDone(KJob *job)
         // just failed the rename, lets still try to update the member list
     }
 
-    fetchLocalItems();
+    updateMembers();
 }
 
 void UpdateGroupJob::retrieveMembersDone(KJob *job)
@@ -177,6 +320,10 @@ void UpdateGroupJob::localFetchDone(KJob *job)
     Akonadi::ItemFetchJob *fetchJob = static_cast<Akonadi::ItemFetchJob*>(job);
     foreach (const Akonadi::Item &item, fetchJob->items()) {
         kDebug() << item.remoteId() << item.remoteRevision();
+        if (item.mimeType() == KABC::ContactGroup::mimeType()) {
+            mContactGroup = item;
+            continue;
+        }
         mLocalItems.insert(item.remoteId(), item);
     }
     searchForAllMembers();
@@ -187,7 +334,7 @@ void UpdateGroupJob::transactionDone(KJob *job)
     if ( job->error() ) {
         return; // handled by base class
     }
-    emitResult();
+    writeContactGroup();
 }
 
 Akonadi::TransactionSequence *UpdateGroupJob::transaction()
@@ -200,6 +347,38 @@ Akonadi::TransactionSequence *UpdateGroupJob::transaction()
     return mTransaction;
 }
 
+void UpdateGroupJob::updateMembers()
+{
+    const MembersDigestAttribute *attribute = mCollection.attribute<MembersDigestAttribute>();
+    if (!mMembersDigest.isEmpty() && attribute && attribute->digest() == mMembersDigest) {
+        // e.g. only the description changed
+        kDebug() << "members of" << mCollection.remoteId() << "unchanged";
+        emitResult();
+        return;
+    }
+
+    fetchLocalItems();
+}
+
+void UpdateGroupJob::storeMembersDigest()
+{
+    if (mMembersDigest.isEmpty()) {
+        emitResult();
+        return;
+    }
+
+    mCollection.attribute<MembersDigestAttribute>(Akonadi::Collection::AddIfMissing)->setDigest(mMembersDigest);
+    if (!mNestedGroups.isEmpty() || mCollection.hasAttribute<NestedGroupsAttribute>()) {
+        mCollection.attribute<NestedGroupsAttribute>(Akonadi::Collection::AddIfMissing)->setGroupDns(mNestedGroups);
+    }
+    if (!mLinkMembers) {
+        mCollection.attribute<GroupMembersAttribute>(Akonadi::Collection::AddIfMissing)->setMemberIds(mMemberIds);
+    }
+
+    Akonadi::CollectionModifyJob *modifyJob = new Akonadi::CollectionModifyJob(mCollection, this);
+    connect(modifyJob, SIGNAL(result(KJob*)), this, SLOT(digestStored(KJob*)));
+}
+
 void UpdateGroupJob::fetchLocalItems()
 {
     Akonadi::ItemFetchJob *job = new Akonadi::ItemFetchJob(mCollection, this);
@@ -211,55 +390,122 @@ void UpdateGroupJob::fetchLocalItems()
 
 void UpdateGroupJob::searchForAllMembers()
 {
-    Q_ASSERT(mPhase == ListMembers);
-
-    const int ret = mLdapSearch.search(KLDAP::LdapDN(mSearchbase), KLDAP::LdapUrl::Sub,
-                                       QString("%1=%2").arg(LDAPMapper::getAttribute(LDAPMapper::UniqueIdentifier)).arg(mCollection.remoteId()),
-                                       QStringList() << "uniqueMember");
-    if (!ret) {
-        kWarning() << mLdapSearch.errorString();
-        kWarning() << "retrieval failed";
-        setError(KJob::UserDefinedError);
-        emitResult();
-    }
+    mSearches.search(KLDAP::LdapDN(mSearchbase), KLDAP::LdapUrl::Sub,
+                     QString("%1=%2").arg(LDAPMapper::getAttribute(LDAPMapper::UniqueIdentifier)).arg(mCollection.remoteId()),
+                     mMemberOfLookup ? QStringList() << "cn" << "modifyTimestamp"
+                                     : QStringList() << "cn" << "modifyTimestamp" << "uniqueMember");
 }
 
-void UpdateGroupJob::searchForMember(const QString &memberDn)
+void UpdateGroupJob::processMembers()
 {
-    const int ret = mLdapSearch.search(KLDAP::LdapDN(memberDn), KLDAP::LdapUrl::Base, QString(),
-                                       LDAPMapper::requestedFullPayloadAttributes());
-    if (!ret) {
-        kWarning() << mLdapSearch.errorString();
-        kWarning() << "retrieval failed";
-        setError(KJob::UserDefinedError);
-        emitResult();
+    const bool memberOf = mMemberOfLookup && !mGroupDn.isEmpty();
+
+    if (!mLinkMembers && !memberOf) {
+        // members which are stored already need neither a search nor a write. The stored member ids
+        // survive a restart of the resource, the person cache does not.
+        const GroupMembersAttribute *attribute = mCollection.attribute<GroupMembersAttribute>();
+        const QHash<QString, QString> previousIds = attribute ? attribute->memberIds() : QHash<QString, QString>();
+        QStringList newMembers;
+        foreach (const QString &member, mNewMembers) {
+            const QString key = PersonCache::normalizedDn(member);
+            QString id = previousIds.value(key);
+            if (id.isEmpty() && mPersonCache && mPersonCache->contains(member)) {
+                id = mPersonCache->value(member).id;
+            }
+            if (!id.isEmpty() && keepMember(id)) {
+                mMemberIds.insert(key, id);
+                continue;
+            }
+            newMembers << member;
+        }
+        kDebug() << mNewMembers.count() - newMembers.count() << "members unchanged," << newMembers.count() << "to resolve";
+        mNewMembers = newMembers;
+    }
+
+    // links are updated even without members, so the former ones are removed
+    if (mNewMembers.isEmpty() && !memberOf && !mLinkMembers) {
+        removeFormerMembers();
+        if (!mTransaction) { // no jobs created here -> continue with the contact group
+            writeContactGroup();
+        } else {
+            mTransaction->commit();
+        }
+        return;
+    }
+
+    // the order they are created in does not matter
+    ResolveMembersJob *resolveJob = new ResolveMembersJob(mNewMembers, mCollection.parentCollection(), mConnection, this);
+    if (memberOf) {
+        resolveJob->setMemberOf(mGroupDn, mSearchbase);
+        resolveJob->setPageSize(mPageSize);
     }
+    resolveJob->setPersonCache(mPersonCache);
+    resolveJob->setMaxConcurrentSearches(mMaxConcurrentSearches);
+    resolveJob->setBatchSize(mBatchSize);
+    resolveJob->setMaxNestingDepth(mMaxNestingDepth);
+    resolveJob->setFullPayload(mFullPayload);
+    connect(resolveJob, SIGNAL(result(KJob*)), this, SLOT(resolveMembersDone(KJob*)));
+    mNewMembers.clear();
 }
 
-void UpdateGroupJob::processMembers()
+void UpdateGroupJob::removeFormerMembers()
 {
-    // all remaining local items are no longer members
-    const Akonadi::Item::List toRemove = mLocalItems.values();
+    // all remaining local persons are no longer members
+    Akonadi::Item::List toRemove;
+    foreach (const Akonadi::Item &item, mLocalItems) {
+        if (item.mimeType() == KABC::Addressee::mimeType()) {
+            toRemove << item;
+        }
+    }
+    mLocalItems.clear();
+
     if (!toRemove.isEmpty()) {
+        kDebug() << toRemove.count() << "members removed";
         Akonadi::ItemDeleteJob *job = new Akonadi::ItemDeleteJob(toRemove, transaction());
         transaction()->setIgnoreJobFailure(job);
+        mMembersChanged = true;
     }
+}
 
-    mPhase = FetchMembers;
-    processNewMember();
+bool UpdateGroupJob::keepMember(const QString &remoteId)
+{
+    const Akonadi::Item item = mLocalItems.take(remoteId);
+    if (!item.isValid()) {
+        return false;
+    }
+    mMemberItemIds.insert(item.id());
+    return true;
 }
 
-void UpdateGroupJob::processNewMember()
+void UpdateGroupJob::writeContactGroup()
 {
-    if (mNewMembers.isEmpty()) {
-        if (!mTransaction) { // no jobs created here -> done
-            emitResult();
-        } else {
-            mTransaction->commit();
-        }
+    if (mContactGroup.isValid() && !mMembersChanged && mName.isEmpty()) {
+        storeMembersDigest();
         return;
     }
 
-    const QString memberDn = mNewMembers.takeFirst();
-    searchForMember(memberDn);
+    // references the members, like the one RetrieveGroupMembersJob stores
+    KABC::ContactGroup group;
+    group.setName(mGroupName.isEmpty() ? mCollection.name() : mGroupName);
+    foreach (Akonadi::Item::Id id, mMemberItemIds) {
+        KABC::ContactGroup::ContactReference reference;
+        reference.setUid(QString::number(id));
+        group.append(reference);
+    }
+
+    Akonadi::Item item = mContactGroup;
+    item.setRemoteId(mCollection.remoteId());
+    item.setMimeType(KABC::ContactGroup::mimeType());
+    if (!mGroupTimestamp.isEmpty()) {
+        item.setRemoteRevision(mGroupTimestamp);
+    }
+    item.setPayload(group);
+
+    if (item.isValid()) {
+        Akonadi::ItemModifyJob *modifyJob = new Akonadi::ItemModifyJob(item, this);
+        connect(modifyJob, SIGNAL(result(KJob*)), this, SLOT(contactGroupDone(KJob*)));
+    } else {
+        Akonadi::ItemCreateJob *createJob = new Akonadi::ItemCreateJob(item, mCollection, this);
+        connect(createJob, SIGNAL(result(KJob*)), this, SLOT(contactGroupDone(KJob*)));
+    }
 }
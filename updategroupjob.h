@@ -22,15 +22,19 @@
 #include <akonadi/collection.h>
 #include <akonadi/item.h>
 
-#include <KLDAP/LdapSearch>
+#include "ldapsearchqueue.h"
 
 #include <kjob.h>
 
+#include <QSet>
+
 namespace Akonadi {
     class TransactionSequence;
 }
 
 struct GroupUpdate;
+class ItemIndex;
+class PersonCache;
 
 class UpdateGroupJob : public KJob
 {
@@ -39,43 +43,115 @@ public:
     UpdateGroupJob(const QString &searchBase, KLDAP::LdapConnection &connection, const Akonadi::Collection &collection, QObject *parent = 0);
     UpdateGroupJob(const GroupUpdate &updateData, const QString &searchBase, KLDAP::LdapConnection &connection, const Akonadi::Collection &collection, QObject *parent = 0);
 
+    /**
+     * Maximum number of new members fetched at the same time
+     */
+    void setMaxConcurrentSearches(int count);
+
+    /**
+     * Maximum number of new members fetched with a single search
+     */
+    void setBatchSize(int size);
+
+    /**
+     * Resolve new members through @p personCache before asking the server
+     */
+    void setPersonCache(PersonCache *personCache);
+
+    /**
+     * How many levels of nested groups are expanded into members
+     */
+    void setMaxNestingDepth(int depth);
+
+    /**
+     * Link the members from the top level collection into the (virtual) group collection
+     * instead of storing copies of them
+     */
+    void setLinkMembers(bool link);
+
+    /**
+     * Where the linked members are looked up in the top level collection
+     */
+    void setItemIndex(ItemIndex *itemIndex);
+
+    /**
+     * Find the members through their memberOf attribute instead of the group's uniqueMember list
+     */
+    void setMemberOfLookup(bool memberOf);
+
+    /**
+     * Request the members found through their memberOf attribute in pages of @p pageSize
+     */
+    void setPageSize(int pageSize);
+
+    /**
+     * Fetch the full payload of new members, instead of only the lookup attributes
+     */
+    void setFullPayload(bool full);
+
 public Q_SLOTS:
     virtual void start();
 
 private Q_SLOTS:
-    void gotSearchResult(KLDAP::LdapSearch *search);
-    void gotSearchData(KLDAP::LdapSearch *search, const KLDAP::LdapObject &obj);
+    void gotSearchData(const KLDAP::LdapObject &obj);
+    void searchFinished();
+    void resolveMembersDone(KJob *job);
+    void linkMembersDone(KJob *job);
     void collectionModifyDone(KJob *job);
     void retrieveMembersDone(KJob *job);
     void localFetchDone(KJob*job);
+    void itemCreated(KJob *job);
     void transactionDone(KJob* job);
+    void contactGroupDone(KJob *job);
+    void digestStored(KJob *job);
 
 private:
     Akonadi::TransactionSequence *transaction();
+    void updateMembers();
+    void storeMembersDigest();
     void fetchLocalItems();
     void searchForAllMembers();
-    void searchForMember(const QString &memberDn);
     void processMembers();
-    void processNewMember();
+    void removeFormerMembers();
+    bool keepMember(const QString &remoteId);
+    void writeContactGroup();
 
     Akonadi::TransactionSequence *mTransaction;
 
     const QString mName;
     const QString mTimestamp;
+    // of the uniqueMember values, the members are only updated if it differs from the stored one
+    QByteArray mMembersDigest;
     const QString mSearchbase;
     KLDAP::LdapConnection &mConnection;
-    KLDAP::LdapSearch mLdapSearch;
+    // the group search shares the connection with the member searches of concurrent jobs
+    LdapSearchQueue mSearches;
+    int mMaxConcurrentSearches;
+    int mBatchSize;
+    PersonCache *mPersonCache;
+    int mMaxNestingDepth;
+    bool mLinkMembers;
+    ItemIndex *mItemIndex;
+    bool mMemberOfLookup;
+    int mPageSize;
+    bool mFullPayload;
 
     Akonadi::Collection mCollection;
     QHash<QString, Akonadi::Item> mLocalItems;
-
+    Akonadi::Item mContactGroup;
+    // of the persons which are members after the update
+    QSet<Akonadi::Item::Id> mMemberItemIds;
+    // normalized member dn -> remote id, see GroupMembersAttribute
+    QHash<QString, QString> mMemberIds;
+    bool mMembersChanged;
+
+    QString mGroupDn;
+    QString mGroupName;
+    QString mGroupTimestamp;
     QStringList mNewMembers;
+    // normalized DNs of the groups expanded into the members
+    QStringList mNestedGroups;
 
-    enum Phase {
-        ListMembers,
-        FetchMembers
-    };
-    Phase mPhase;
 };
 
 #endif // UPDATEGROUPJOB_H
@@ -17,108 +17,77 @@
  */
 
 #include "updateitemjob.h"
-
-#include "ldapmapper.h"
-
-#include <kldap/ldapdefs.h>
+#include "contentdigestattribute.h"
 
 #include <akonadi/itemcreatejob.h>
 #include <akonadi/itemfetchjob.h>
 #include <akonadi/itemfetchscope.h>
 #include <akonadi/itemmodifyjob.h>
 
-UpdateItemJob::UpdateItemJob(const QString &ldapItemId, const QString &searchBase, KLDAP::LdapConnection &connection,
-                             const Akonadi::Collection::List &parentCollections, QObject *parent)
+#include <kdebug.h>
+
+UpdateItemJob::UpdateItemJob(const Akonadi::Item &item, const Akonadi::Item::List &localItems,
+                             const Akonadi::Collection &topLevelCollection, QObject *parent)
 :   KJob(parent),
-    mLdapItemId(ldapItemId),
-    mSearchbase(searchBase),
-    mLdapSearch(connection),
-    mParentCollections(parentCollections)
+    mItem(item),
+    mLocalItems(localItems),
+    mTopLevelCollection(topLevelCollection),
+    mFullPayload(true)
 {
-    Q_ASSERT(connection.handle());
-    connect(&mLdapSearch, SIGNAL(result(KLDAP::LdapSearch*)),
-            this, SLOT(gotSearchResult(KLDAP::LdapSearch*)));
-    connect(&mLdapSearch, SIGNAL(data(KLDAP::LdapSearch*,KLDAP::LdapObject)),
-            this, SLOT(gotSearchData(KLDAP::LdapSearch*,KLDAP::LdapObject)));
-
     // autostart like an Akonadi::Job
     QMetaObject::invokeMethod(this, "start", Qt::QueuedConnection);
 }
 
-void UpdateItemJob::start()
+void UpdateItemJob::setFullPayload(bool full)
 {
-    // TODO have IncrementalUpdateJob provide DN for item instead of searchbase
-    const int ret = mLdapSearch.search(KLDAP::LdapDN(mSearchbase), KLDAP::LdapUrl::Sub,
-                                       QLatin1String("nsuniqueid=") + mLdapItemId,
-                                       LDAPMapper::requestedFullPayloadAttributes());
-    if (!ret) {
-        kWarning() << mLdapSearch.errorString();
-        kWarning() << "retrieval failed";
-        setError(KJob::UserDefinedError);
-        emitResult();
-    }
+    mFullPayload = full;
 }
 
-void UpdateItemJob::gotSearchResult(KLDAP::LdapSearch *search)
+Akonadi::Item UpdateItemJob::item() const
 {
-    if (search->error()) {
-        kWarning() << search->error() << search->errorString();
-        switch (search->error()) {
-            case KLDAP_SIZELIMIT_EXCEEDED:
-                kWarning() << "Sizelimit exceeded";
-                break;
-            case KLDAP_ADMINLIMIT_EXCEEDED:
-                kWarning() << "Administrative limit exceeded";
-                break;
-            default:
-                kWarning() << "Unknown error";
-        }
-
-        setError(KJob::UserDefinedError);
-        emitResult();
-    } else {
-        processNextParentCollection();
-    }
+    return mItem;
 }
 
-void UpdateItemJob::gotSearchData(KLDAP::LdapSearch *search, const KLDAP::LdapObject &obj)
+Akonadi::Item UpdateItemJob::addedTopLevelItem() const
 {
-    Q_UNUSED( search );
-    kWarning();
-
-    kDebug() << "Object:";
-    kDebug() << obj.toString();
-    kDebug() << "got person: " << obj.dn().toString() << obj.value("nsuniqueid") << obj.value("modifyTimestamp");
-
-    mItem.setRemoteId(LDAPMapper::getStableIdentifier(obj));
-    mItem.setPayload(LDAPMapper::getAddressee(obj));
-    mItem.setMimeType(KABC::Addressee::mimeType());
-    mItem.setRemoteRevision(LDAPMapper::getTimestamp(obj));
+    return mAddedTopLevelItem;
 }
 
-void UpdateItemJob::localFetchDone(KJob *job)
+void UpdateItemJob::start()
 {
-    const Akonadi::Collection parentCollection = job->property("parentCollection").value<Akonadi::Collection>();
-    const Akonadi::Item::List items = static_cast<Akonadi::ItemFetchJob*>(job)->items();
-
-    if (job->error() || items.isEmpty()) {
-        // if there is no such item we are OK unless this is the top level collection.
-        // in this case an update could mean a new item, so we create it
-
-        if (parentCollection.parentCollection() == Akonadi::Collection::root()) {
-            Akonadi::Item item = mItem;
-            Akonadi::ItemCreateJob *createJob = new Akonadi::ItemCreateJob(item, parentCollection, this);
-            connect(createJob, SIGNAL(result(KJob*)), this, SLOT(createJobDone(KJob*)));
-        } else {
-            processNextParentCollection();
+    foreach (const Akonadi::Item &localItem, mLocalItems) {
+        if (localItem.parentCollection() == mTopLevelCollection) {
+            processNextLocalItem();
+            return;
         }
-    } else {
-        Akonadi::Item item = mItem;
-        item.setId(items.at(0).id());
+    }
 
-        Akonadi::ItemModifyJob *modifyJob = new Akonadi::ItemModifyJob(item, this);
-        connect(modifyJob, SIGNAL(result(KJob*)), this, SLOT(modifyJobDone(KJob*)));
+    // the index is kept between updates and might not know about items stored by other jobs since
+    Akonadi::Item item;
+    item.setRemoteId(mItem.remoteId());
+    Akonadi::ItemFetchJob *fetchJob = new Akonadi::ItemFetchJob(item, this);
+    fetchJob->setCollection(mTopLevelCollection);
+    fetchJob->fetchScope().setCacheOnly(true);
+    fetchJob->fetchScope().fetchFullPayload(false);
+    fetchJob->fetchScope().fetchAttribute<ContentDigestAttribute>();
+    connect(fetchJob, SIGNAL(result(KJob*)), this, SLOT(topLevelFetchDone(KJob*)));
+}
+
+void UpdateItemJob::topLevelFetchDone(KJob *job)
+{
+    const Akonadi::Item::List items = job->error() ? Akonadi::Item::List() : static_cast<Akonadi::ItemFetchJob*>(job)->items();
+    if (!items.isEmpty()) {
+        mAddedTopLevelItem = items.first();
+        mAddedTopLevelItem.setParentCollection(mTopLevelCollection);
+        mLocalItems.prepend(mAddedTopLevelItem);
+        processNextLocalItem();
+        return;
     }
+
+    // an update could mean a new item, the top level collection contains all of them
+    Akonadi::Item item = mItem;
+    Akonadi::ItemCreateJob *createJob = new Akonadi::ItemCreateJob(item, mTopLevelCollection, this);
+    connect(createJob, SIGNAL(result(KJob*)), this, SLOT(createJobDone(KJob*)));
 }
 
 void UpdateItemJob::createJobDone(KJob *job)
@@ -127,9 +96,12 @@ void UpdateItemJob::createJobDone(KJob *job)
         kWarning() << job->errorString();
 
         // try to proceed as far as possible
+    } else {
+        mAddedTopLevelItem = static_cast<Akonadi::ItemCreateJob*>(job)->item();
+        mAddedTopLevelItem.setParentCollection(mTopLevelCollection);
     }
 
-    processNextParentCollection();
+    processNextLocalItem();
 }
 
 void UpdateItemJob::modifyJobDone(KJob *job)
@@ -140,23 +112,35 @@ void UpdateItemJob::modifyJobDone(KJob *job)
         // try to proceed as far as possible
     }
 
-    processNextParentCollection();
+    processNextLocalItem();
 }
 
-void UpdateItemJob::processNextParentCollection()
+void UpdateItemJob::processNextLocalItem()
 {
-    if (mParentCollections.isEmpty()) {
-        emitResult();
-        return;
-    }
+    while (!mLocalItems.isEmpty()) {
+        const Akonadi::Item localItem = mLocalItems.takeFirst();
+        if (localItem.remoteRevision() == mItem.remoteRevision()) {
+            // already applied by an earlier, overlapping update
+            kDebug() << "skipping" << mItem.remoteId();
+            continue;
+        }
 
-    const Akonadi::Collection parentCollection = mParentCollections.takeFirst();
+        Akonadi::Item item = mItem;
+        item.setId(localItem.id());
 
-    Akonadi::Item item = mItem;
-    item.setParentCollection(parentCollection);
+        Akonadi::ItemModifyJob *modifyJob = new Akonadi::ItemModifyJob(item, this);
+        const QByteArray digest = ContentDigestAttribute::itemDigest(localItem);
+        if (!digest.isEmpty() && digest == ContentDigestAttribute::itemDigest(mItem)) {
+            // only attributes we don't map have changed, just record the new revision
+            kDebug() << "unchanged content" << mItem.remoteId();
+            modifyJob->setIgnorePayload(true);
+        } else if (!mFullPayload && localItem.parentCollection() != mTopLevelCollection) {
+            // the lookup attributes would be stored as the full payload of the copy
+            modifyJob->setIgnorePayload(true);
+        }
+        connect(modifyJob, SIGNAL(result(KJob*)), this, SLOT(modifyJobDone(KJob*)));
+        return;
+    }
 
-    Akonadi::ItemFetchJob *fetchJob = new Akonadi::ItemFetchJob(item, this);
-    fetchJob->fetchScope().setCacheOnly(true);
-    fetchJob->setProperty("parentCollection", QVariant::fromValue(parentCollection));
-    connect(fetchJob, SIGNAL(result(KJob*)), this, SLOT(localFetchDone(KJob*)));
+    emitResult();
 }
@@ -19,8 +19,6 @@
 #ifndef UPDATEITEMJOB_H
 #define UPDATEITEMJOB_H
 
-#include <KLDAP/LdapSearch>
-
 #include <akonadi/collection.h>
 #include <akonadi/item.h>
 
@@ -30,28 +28,43 @@ class UpdateItemJob : public KJob
 {
     Q_OBJECT
 public:
-    UpdateItemJob(const QString &ldapItemId, const QString &searchBase, KLDAP::LdapConnection &connection,
-                  const Akonadi::Collection::List &parentCollections, QObject *parent = 0);
+    /**
+     * Applies @p item to the existing copies @p localItems, as found by IncrementalUpdateJob's index.
+     * The item is created in @p topLevelCollection if it is not there yet.
+     */
+    UpdateItemJob(const Akonadi::Item &item, const Akonadi::Item::List &localItems,
+                  const Akonadi::Collection &topLevelCollection, QObject *parent = 0);
+
+    /**
+     * Whether the item carries the full payload. Otherwise the copies in group collections are
+     * left without it, see RetrieveGroupMembersJob.
+     */
+    void setFullPayload(bool full);
+
+    Akonadi::Item item() const;
+
+    /**
+     * The item of the top level collection if it was missing from the given local items,
+     * either found there after all or newly created
+     */
+    Akonadi::Item addedTopLevelItem() const;
 
 public Q_SLOTS:
     virtual void start();
 
 private Q_SLOTS:
-    void gotSearchResult(KLDAP::LdapSearch *search);
-    void gotSearchData(KLDAP::LdapSearch *search, const KLDAP::LdapObject &obj);
-    void localFetchDone(KJob *job);
+    void topLevelFetchDone(KJob *job);
     void createJobDone(KJob *job);
     void modifyJobDone(KJob *job);
 
 private:
-    void processNextParentCollection();
-
-    const QString mLdapItemId;
-    const QString mSearchbase;
-    KLDAP::LdapSearch mLdapSearch;
+    void processNextLocalItem();
 
-    Akonadi::Collection::List mParentCollections;
-    Akonadi::Item mItem;
+    const Akonadi::Item mItem;
+    Akonadi::Item::List mLocalItems;
+    const Akonadi::Collection mTopLevelCollection;
+    bool mFullPayload;
+    Akonadi::Item mAddedTopLevelItem;
 };
 
 #endif // UPDATEITEMJOB_H